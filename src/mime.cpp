@@ -16,12 +16,18 @@
  */
 #include <time.h>
 #include <string>
+#include <atomic>
+#include <algorithm>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "mimecode.h"
 #include "mimechar.h"
@@ -57,79 +63,400 @@ static const char* findString (const char* p_s1, const char* p_s2,
   return NULL;
 }
 
+static atomic<unsigned long> s_serial(0);
+
+unsigned long mimeSerial () {
+  return ++s_serial;
+}
+
 /* End utility fnuctions */
 
 /* cMimeField definitions */
 
 void cMimeField::value (string& p_value) const {
-  string::size_type end = m_value.find(';');
-  if (end != string::npos) {
-    while (end > 0 && cMimeChar::isSpace((unsigned char)m_value[end-1])) {
-      end--;
-    }
-    p_value.assign(m_value.c_str(), end);
-  } else {
-    p_value = m_value;
-  }
+  if (m_paramstate == PARAM_UNPARSED)
+    parseParameters();
+  p_value.assign(m_value.c_str(), m_mainsize);
 }
 
-void cMimeField::parameter (const char* p_attr, const char* p_value) {
-  int size = p_value ? (int)strlen(p_value) : 0;
+/* cMimeField::parameter - Add or update a parameter. A value with a charset
+ * is stored as an RFC 2231 extended parameter
+ */
+void cMimeField::parameter (const char* p_attr, const char* p_value,
+    const char* p_charset) {
+  ASSERT(p_attr != NULL);
+  if (m_paramstate == PARAM_UNPARSED)
+    parseParameters();
+
   string value;
-  value.reserve(size+3);
-  if (!p_value || *p_value != '"') {
-    value = "\"";
-  }
   if (p_value != NULL) {
-    value += p_value;
-  }
-  if (size < 2 || p_value[size-1] != '"') {
-    value += "\"";
+    int size = (int)strlen(p_value);
+    if (size >= 2 && p_value[0] == '"' && p_value[size-1] == '"') {
+      value.assign(p_value + 1, size - 2);
+    } else {
+      value.assign(p_value, size);
+    }
   }
 
-  int pos;
-  if (!findParameter(p_attr, pos, size)) {
-    // Add a new parameter
-    m_value.reserve(m_value.size() + strlen(p_attr) + value.size() + 5);
-    m_value += "; ";
-    m_value += p_attr;
-    m_value += "=";
-    m_value += value;
+  parameterEntry* entry = (parameterEntry*)findParameter(p_attr);
+  if (!entry) {
+    m_params.push_back(parameterEntry());
+    entry = &m_params.back();
+    entry->attr = p_attr;
+  }
+  entry->value.swap(value);
+  if (p_charset != NULL) {
+    entry->charset = p_charset;
   } else {
-    m_value.replace(pos, size, value);
+    entry->charset.clear();
   }
+  m_paramstate = PARAM_DIRTY;
+  m_serial = mimeSerial();
 }
 
 bool cMimeField::parameter (const char* p_attr, string& p_value) const {
-  int pos, size;
-  if (!findParameter(p_attr, pos, size)){
+  const parameterEntry* entry = findParameter(p_attr);
+  if (!entry) {
     p_value.clear();
     return false;
   }
-  if (m_value[pos] == '"') {
-    pos++;
-    size--;
-    if (size > 0 && m_value[pos + size-1] == '"') {
-      size--;
+  p_value = entry->value;
+  return true;
+}
+
+const char* cMimeField::parameter (const char* p_attr) const {
+  const parameterEntry* entry = findParameter(p_attr);
+  return entry != NULL ? entry->value.c_str() : NULL;
+}
+
+const char* cMimeField::parameterCharset (const char* p_attr) const {
+  const parameterEntry* entry = findParameter(p_attr);
+  return entry != NULL ? entry->charset.c_str() : NULL;
+}
+
+const cMimeField::parameterEntry* cMimeField::findParameter (
+    const char* p_attr) const {
+  ASSERT(p_attr != NULL);
+  if (m_paramstate == PARAM_UNPARSED)
+    parseParameters();
+  for (vector<parameterEntry>::const_iterator it = m_params.begin();
+      it != m_params.end(); it++) {
+    if (!strcasecmp((*it).attr.c_str(), p_attr))
+      return &(*it);
+  }
+  return NULL;
+}
+
+/* isParamToken - token character of a parameter value (RFC 2045 tspecials) */
+static inline bool isParamToken (unsigned char ch) {
+  return cMimeChar::isNonAscii(ch) || 
+    (ch > ' ' && ch != 0x7f && !strchr("()<>@,;:\\\"/[]?=", ch));
+}
+
+/* percentDecode - Append an RFC 2231 extended value with %XX escapes undone */
+static void percentDecode (string& p_out, const char* p_data, 
+    const char* p_end) {
+  while (p_data < p_end) {
+    if (*p_data == '%' && p_end - p_data >= 3 && 
+        cMimeChar::isHexDigit((unsigned char)p_data[1]) &&
+        cMimeChar::isHexDigit((unsigned char)p_data[2])) {
+      char hex[3] = { p_data[1], p_data[2], 0 };
+      p_out += (char)strtol(hex, NULL, 16);
+      p_data += 3;
+    } else {
+      p_out += *p_data++;
     }
   }
-  p_value.assign(m_value.data()+pos, size);
-  return true;
 }
 
-int cMimeField::getLength() const {
-  int len = (int) m_name.size() + 4;
-  cFieldCodeBase* coder = cMimeEnvironment::registerFieldCoder(name());
-  coder->charset(m_charset.c_str());
-  coder->setInput(m_value.c_str(), (int)m_value.size(), true);
-  len += coder->getOutputLength();
-  delete coder;
+/* percentEncode - Append a value escaped as an RFC 2231 extended value */
+static void percentEncode (string& p_out, const string& p_value) {
+  static const char* s_hex = "0123456789ABCDEF";
+  for (string::size_type i = 0; i < p_value.size(); i++) {
+    unsigned char ch = (unsigned char)p_value[i];
+    // attribute-char (RFC 2231, RFC 5987)
+    if (isalnum(ch) || (ch != 0 && strchr("!#$&+-.^_`|~", ch) != NULL)) {
+      p_out += (char)ch;
+    } else {
+      p_out += '%';
+      p_out += s_hex[ch >> 4];
+      p_out += s_hex[ch & 0x0f];
+    }
+  }
+}
+
+/* cMimeField::parseParameters - Build the parameter table from m_value.
+ * RFC 2231 sections (attr*0*=, attr*1=, ...) are collected per attribute
+ * and joined in section order, the charset comes from the first section.
+ * Section numbers past maxnumber are dropped.
+ */
+void cMimeField::parseParameters () const {
+  const int maxnumber = 999;
+  struct section {
+    int entry;
+    int number;
+    bool extended;
+    string text;
+  };
+  vector<section> sections;
+
+  m_params.clear();
+  const char* p_start = m_value.c_str();
+  const char* p_end = p_start + m_value.size();
+  const char* p_data = p_start;
+
+  bool quoted = false;
+  while (p_data < p_end && (quoted || *p_data != ';')) {
+    if (*p_data == '"') {
+      quoted = !quoted;
+    } else if (quoted && *p_data == '\\' && p_data+1 < p_end) {
+      p_data++;
+    }
+    p_data++;
+  }
+  const char* p_mainend = p_data;
+  while (p_mainend > p_start && 
+      cMimeChar::isSpace((unsigned char)p_mainend[-1]))
+    p_mainend--;
+  m_mainsize = p_mainend - p_start;
+
+  while (p_data < p_end) {
+    while (p_data < p_end && (*p_data == ';' || 
+        cMimeChar::isSpace((unsigned char)*p_data)))
+      p_data++;
+    const char* p_attr = p_data;
+    while (p_data < p_end && *p_data != '=' && *p_data != ';')
+      p_data++;
+    if (p_data >= p_end || *p_data != '=')
+      continue;
+    const char* p_attrend = p_data++;
+    while (p_attrend > p_attr && 
+        cMimeChar::isSpace((unsigned char)p_attrend[-1]))
+      p_attrend--;
+    while (p_data < p_end && cMimeChar::isSpace((unsigned char)*p_data))
+      p_data++;
+
+    section sect;
+    if (p_data < p_end && *p_data == '"') {
+      for (p_data++; p_data < p_end && *p_data != '"'; p_data++) {
+        if (*p_data == '\\' && p_data+1 < p_end)
+          p_data++;
+        sect.text += *p_data;
+      }
+      if (p_data < p_end)
+        p_data++;
+    } else {
+      const char* p_token = p_data;
+      while (p_data < p_end && isParamToken((unsigned char)*p_data))
+        p_data++;
+      sect.text.assign(p_token, p_data - p_token);
+    }
+
+    // attr, attr*, attr*N or attr*N*
+    const char* p_star = (const char*)memchr(p_attr, '*', p_attrend - p_attr);
+    sect.number = -1;
+    sect.extended = false;
+    if (p_star != NULL) {
+      const char* p_sect = p_star + 1;
+      if (p_sect < p_attrend && *p_sect >= '0' && *p_sect <= '9') {
+        sect.number = 0;
+        while (p_sect < p_attrend && *p_sect >= '0' && *p_sect <= '9' &&
+            sect.number <= maxnumber)
+          sect.number = sect.number * 10 + (*p_sect++ - '0');
+        if (sect.number > maxnumber)
+          continue;
+      }
+      sect.extended = p_sect < p_attrend && *p_sect == '*';
+      if (sect.number < 0 && p_sect == p_attrend)
+        sect.extended = true;
+      p_attrend = p_star;
+    }
+
+    string attr(p_attr, p_attrend - p_attr);
+    sect.entry = -1;
+    for (int i = 0; i < (int)m_params.size(); i++) {
+      if (!strcasecmp(m_params[i].attr.c_str(), attr.c_str())) {
+        sect.entry = i;
+        break;
+      }
+    }
+    if (sect.entry < 0) {
+      sect.entry = (int)m_params.size();
+      m_params.push_back(parameterEntry());
+      m_params.back().attr = attr;
+    }
+
+    if (!p_star) {
+      // plain value, an extended form of the same attribute wins
+      if (m_params[sect.entry].value.empty())
+        m_params[sect.entry].value = sect.text;
+    } else {
+      sections.push_back(sect);
+    }
+  }
+
+  // join the RFC 2231 sections of each attribute in order, the first of
+  // any repeated number counts
+  stable_sort(sections.begin(), sections.end(), 
+    [] (const section& p_a, const section& p_b) {
+      return p_a.entry != p_b.entry ? p_a.entry < p_b.entry : 
+        p_a.number < p_b.number;
+    });
+  vector<section>::const_iterator it = sections.begin();
+  while (it != sections.end()) {
+    parameterEntry& entry = m_params[(*it).entry];
+    int current = (*it).entry;
+    int number = (*it).number < 0 ? -1 : 0;
+    bool first = true;
+    for (; it != sections.end() && (*it).entry == current; it++) {
+      if ((*it).number != number)
+        continue;
+      if (first)
+        entry.value.clear();
+
+      const char* p_text = (*it).text.c_str();
+      const char* p_textend = p_text + (*it).text.size();
+      if ((*it).extended && first) {
+        // charset'language'value
+        const char* p_quote = (const char*)memchr(p_text, '\'', 
+          p_textend - p_text);
+        const char* p_lang = p_quote != NULL ? (const char*)memchr(p_quote+1, 
+          '\'', p_textend - p_quote - 1) : NULL;
+        if (p_lang != NULL) {
+          entry.charset.assign(p_text, p_quote - p_text);
+          p_text = p_lang + 1;
+        }
+      }
+      if ((*it).extended) {
+        percentDecode(entry.value, p_text, p_textend);
+      } else {
+        entry.value.append(p_text, p_textend - p_text);
+      }
+      first = false;
+      // attr* stands alone, numbered sections stop at the first gap
+      number = number < 0 ? maxnumber + 1 : number + 1;
+    }
+  }
+  m_paramstate = PARAM_PARSED;
+}
+
+/* stringMemory - Heap bytes behind a string, none when it is held inline */
+static size_t stringMemory (const string& p_string) {
+  const char* p_data = p_string.data();
+  if (p_data >= (const char*)&p_string && p_data < (const char*)(&p_string+1))
+    return 0;
+  return p_string.capacity() + 1;
+}
+
+size_t cMimeField::memoryUsage () const {
+  size_t size = stringMemory(m_name) + stringMemory(m_value) + 
+    stringMemory(m_charset);
+  size += m_params.capacity() * sizeof(parameterEntry);
+  for (vector<parameterEntry>::const_iterator it = m_params.begin();
+      it != m_params.end(); it++) {
+    size += stringMemory((*it).attr) + stringMemory((*it).value) +
+      stringMemory((*it).charset);
+  }
+  return size;
+}
+
+void cMimeField::resolve () {
+  if (m_paramstate == PARAM_UNPARSED)
+    parseParameters();
+  if (m_paramstate == PARAM_DIRTY)
+    storeParameters();
+}
+
+/* cMimeField::storeParameters - Rebuild m_value from the parameter table.
+ * Values with a charset are written as RFC 2231 extended parameters and
+ * split into sections when they would make an overlong line.
+ */
+void cMimeField::storeParameters () const {
+  const int maxsection = 60;
+  string value(m_value, 0, m_mainsize);
+  for (vector<parameterEntry>::const_iterator it = m_params.begin();
+      it != m_params.end(); it++) {
+    const parameterEntry& entry = *it;
+    value += "; ";
+    if (entry.charset.empty()) {
+      value += entry.attr;
+      value += "=\"";
+      for (string::size_type i = 0; i < entry.value.size(); i++) {
+        if (entry.value[i] == '"' || entry.value[i] == '\\')
+          value += '\\';
+        value += entry.value[i];
+      }
+      value += '"';
+      continue;
+    }
+
+    string encoded = entry.charset + "''";
+    percentEncode(encoded, entry.value);
+    if ((int)encoded.size() <= maxsection) {
+      value += entry.attr;
+      value += "*=";
+      value += encoded;
+      continue;
+    }
+
+    const char* p_data = encoded.c_str();
+    const char* p_end = p_data + encoded.size();
+    for (int number = 0; p_data < p_end; number++) {
+      const char* p_sectend = p_data + maxsection;
+      if (p_sectend >= p_end) {
+        p_sectend = p_end;
+      } else if (p_sectend[-1] == '%') {
+        p_sectend--;
+      } else if (p_sectend[-2] == '%') {
+        p_sectend -= 2;
+      }
+      char buf[16];
+      sprintf(buf, "*%d*=", number);
+      if (number > 0)
+        value += "; ";
+      value += entry.attr;
+      value += buf;
+      value.append(p_data, p_sectend - p_data);
+      p_data = p_sectend;
+    }
+  }
+  m_value.swap(value);
+  m_paramstate = PARAM_PARSED;
+}
+
+/* valueLoad - Op for cMimeEnvironment::withFieldCoder() decoding a field
+ * value and the charset it was in
+ */
+struct valueLoad {
+  typedef ssize_t result_type;
+  const char* input;
+  size_t size;
+  string& value;
+  string& charset;
+
+  template <class C> ssize_t operator() (C& p_coder, bool p_direct) {
+    p_coder.setInput(input, size, false);
+    value.resize(cMimeCodeBase::outputLength(p_coder, p_direct));
+    ssize_t output = cMimeCodeBase::output(p_coder, 
+      (unsigned char*)&value[0], value.size(), p_direct);
+    value.resize(output);
+    charset = p_coder.charset();
+    return output;
+  }
+};
+
+size_t cMimeField::getLength() const {
+  size_t len = m_name.size() + 4;
+  const string& value = text();
+  cMimeCodeWhole op = { value.c_str(), value.size(), true, NULL, 0,
+    m_charset.c_str(), m_name.size() + 2 };
+  len += cMimeEnvironment::withFieldCoder(name(), op);
   return len;
 }
 
-int cMimeField::store(char* p_data, int maxsize) const {
+ssize_t cMimeField::store(char* p_data, size_t maxsize) const {
   ASSERT(p_data != NULL);
-  int minsize = (int)m_name.size() + 4;
+  size_t minsize = m_name.size() + 4;
   if (maxsize < minsize)
     return 0;
   strcpy(p_data, m_name.c_str());
@@ -137,11 +464,11 @@ int cMimeField::store(char* p_data, int maxsize) const {
   *p_data++ = ':';
   *p_data++ = ' ';
 
-  cFieldCodeBase* coder = cMimeEnvironment::registerFieldCoder(name());
-  coder->charset(m_charset.c_str());
-  coder->setInput(m_value.c_str(), (int)m_value.size(), true);
-  int encoded = coder->getOutput((unsigned char*) p_data, maxsize - minsize);
-  delete coder;
+  const string& value = text();
+  cMimeCodeWhole op = { value.c_str(), value.size(), true, 
+    (unsigned char*)p_data, maxsize - minsize, m_charset.c_str(), 
+    m_name.size() + 2 };
+  ssize_t encoded = cMimeEnvironment::withFieldCoder(name(), op);
   p_data += encoded;
 
   *p_data++ = '\r';
@@ -149,7 +476,7 @@ int cMimeField::store(char* p_data, int maxsize) const {
   return minsize + encoded;
 }
 
-int cMimeField::load (const char* p_data, int datasize) {
+ssize_t cMimeField::load (const char* p_data, size_t datasize) {
   clear();
   ASSERT(p_data != NULL);
 
@@ -179,98 +506,58 @@ int cMimeField::load (const char* p_data, int datasize) {
     end += 2;
   } while (*end == '\t' || *end == ' ');
 
-  cFieldCodeBase* coder = cMimeEnvironment::registerFieldCoder(name());
-  coder->setInput(start, (int)(end - start)-2, false);
-  m_value.resize(coder->getOutputLength());
-  int size = coder->getOutput((unsigned char*) m_value.c_str(), 
-      (int)m_value.capacity());
-  m_value.resize(size);
-  m_charset = coder->charset();
-  delete coder;
-  return (int)(end - start);
+  valueLoad op = { start, (size_t)((end - start) - 2), m_value, m_charset };
+  cMimeEnvironment::withFieldCoder(name(), op);
+  return end - start;
 }
 
-bool cMimeField::findParameter (const char* p_attr, int& pos, int& size) const {
-  ASSERT(p_attr != NULL);
-  const char* params = strchr(m_value.data(), ';');
-  int attrsize = (int)strlen(p_attr);
-  while (params != NULL) {
-    while (cMimeChar::isSpace((unsigned char)*params) || *params == ';')
-      params++;
-
-    const char* name = params;
-    params = strchr(params, '=');
-    if (!params)
-      break;
-
-    params++;
-    const char* paramend = NULL;
-    if (*params == '"')
-      paramend = strchr(params + 1, '"');
-    if (!paramend) {
-      paramend = params;
-      while (cMimeChar::isToken(*paramend))
-        paramend++;
-    } else {
-      paramend++;
-    }
-
-    if (!memcmp(p_attr, name, attrsize) && (
-        cMimeChar::isSpace((unsigned char)name[attrsize]) ||
-        name[attrsize] == '=')) {
-      pos = (int)(params - m_value.data());
-      size = (int)(paramend - params);
-      return true;
-    }
-
-    params = paramend;
-  }
-  return false;
-}
-      
 /* End cMimeField definitions */
 /* cMimeHeader definitions */
-cMimeHeader::media cMimeHeader::mediaType () const {
-  const char* type = contentType();
-  if (!type)
-    type = "text";
-
-  int index = 0;
-  while (m_typetable[index] != NULL && 
-      memcmp(type, m_typetable[index], strlen(m_typetable[index])) != 0)
-    index++;
-  return (media)index;
-}
 
-string cMimeHeader::mainType () const {
-  string type;
-  const char* p_type = contentType();
-  if (p_type != NULL) {
-    const char* slash = strchr(p_type, '/');
+/* cMimeHeader::parseContentType - Split Content-Type into its media type, 
+ * sub-type and the parameters the body code asks for
+ */
+void cMimeHeader::parseContentType () const {
+  contentTypeCache& ct = m_ctcache;
+  ct.liststamp = m_liststamp;
+  ct.field = field(cMimeConst::contentType());
+  ct.serial = ct.field != NULL ? ct.field->serial() : 0;
+  ct.charset.clear();
+  ct.boundary.clear();
+  ct.name.clear();
+
+  if (!ct.field) {
+    ct.mediatype = MEDIA_TEXT;
+    ct.maintype = "text";
+    ct.subtype = "plain";
+  } else {
+    const char* p_type = ct.field->value();
+    while (cMimeChar::isSpace((unsigned char)*p_type))
+      p_type++;
+    const char* p_end = p_type;
+    while (*p_end != 0 && *p_end != ';' && 
+        !cMimeChar::isSpace((unsigned char)*p_end))
+      p_end++;
+
+    const char* slash = (const char*)memchr(p_type, '/', p_end - p_type);
     if (slash != NULL) {
-      type.assign(p_type, slash - p_type);
+      ct.maintype.assign(p_type, slash - p_type);
+      ct.subtype.assign(slash + 1, p_end - slash - 1);
     } else {
-      type = p_type;
+      ct.maintype.assign(p_type, p_end - p_type);
+      ct.subtype.clear();
     }
-  } else {
-    type = "text";
-  }
-  return type;
-}
 
-string cMimeHeader::subType() const {
-  string subtype;
-  const cMimeField *fd = field(cMimeConst::contentType());
-  if (fd != NULL) {
-    string type;
-    fd->value(type);
-    string::size_type slash = type.find('/');
-    if (slash > 0)
-      subtype = type.substr(slash+1);
-  } else {
-    subtype = "plain";
+    int index = 0;
+    while (m_typetable[index] != NULL && 
+        strcasecmp(ct.maintype.c_str(), m_typetable[index]) != 0)
+      index++;
+    ct.mediatype = (media)index;
+
+    ct.field->parameter(cMimeConst::charset(), ct.charset);
+    ct.field->parameter(cMimeConst::boundary(), ct.boundary);
+    ct.field->parameter(cMimeConst::name(), ct.name);
   }
-  return subtype;
 }
 
 void cMimeHeader::charset (const char* p_charset) {
@@ -280,6 +567,7 @@ void cMimeHeader::charset (const char* p_charset) {
     fd.name(cMimeConst::contentType());
     fd.value("text/plain");
     fd.parameter(cMimeConst::charset(), p_charset);
+    field(fd);
   } else {
     fd->parameter(cMimeConst::charset(), p_charset);
   }
@@ -311,7 +599,7 @@ void cMimeHeader::name (const char* p_name) {
     fd.name(cMimeConst::contentType());
     fd.value(p_type);
     fd.parameter(cMimeConst::name(), p_name);
-    m_listfields.push_back(fd);
+    field(fd);
   } else {
     fd->parameter(cMimeConst::name(), p_name);
   }
@@ -334,7 +622,7 @@ void cMimeHeader::boundary (const char* p_boundary) {
     fd.name(cMimeConst::contentType());
     fd.value("multipart/mixed");
     fd.parameter(cMimeConst::boundary(), p_boundary);
-    m_listfields.push_back(fd);
+    field(fd);
   } else {
     if (memcmp(pfd->value(), "multipart", 9) != 0)
       pfd->value("multipart/mixed");
@@ -342,25 +630,52 @@ void cMimeHeader::boundary (const char* p_boundary) {
   }
 }
 
+size_t cMimeHeader::headerMemory () const {
+  size_t size = 0;
+  std::list<cMimeField>::const_iterator it;
+  for (it = m_listfields.begin(); it != m_listfields.end(); it++)
+    size += (*it).memoryUsage();
+  return size;
+}
+
+/* cMimeHeader::resolveFields - Parse every field and the Content-Type cache
+ * ahead of time, const calls then leave the header untouched
+ */
+void cMimeHeader::resolveFields () {
+  std::list<cMimeField>::iterator it;
+  for (it = m_listfields.begin(); it != m_listfields.end(); it++)
+    (*it).resolve();
+  contentTypeInfo();
+}
+
+unsigned long cMimeHeader::serial () const {
+  unsigned long serial = m_serial;
+  std::list<cMimeField>::const_iterator it;
+  for (it = m_listfields.begin(); it != m_listfields.end(); it++)
+    serial = max(serial, (*it).serial());
+  return serial;
+}
+
 void cMimeHeader::clear() {
   m_listfields.clear();
+  invalidateContentType();
 }
 
-int cMimeHeader::getLength() const {
-  int len = 0;
+size_t cMimeHeader::getLength() const {
+  size_t len = 0;
   std::list<cMimeField>::const_iterator it;
   for (it = m_listfields.begin(); it != m_listfields.end(); it++)
     len += (*it).getLength();
   return len + 2;
 }
 
-int cMimeHeader::store (char* p_data, int maxsize) const {
+ssize_t cMimeHeader::store (char* p_data, size_t maxsize) const {
   ASSERT(p_data != NULL);
-  int output = 0;
+  size_t output = 0;
   std::list<cMimeField>::const_iterator it;
   for (it = m_listfields.begin(); it != m_listfields.end(); it++) {
     const cMimeField& fd = *it;
-    int size = fd.store(p_data+output, maxsize-output);
+    ssize_t size = fd.store(p_data+output, maxsize-output);
     if (size <= 0)
       return size;
     output += size;
@@ -371,17 +686,18 @@ int cMimeHeader::store (char* p_data, int maxsize) const {
   return output;
 }
 
-int cMimeHeader::load (const char* p_data, int datasize) {
+ssize_t cMimeHeader::load (const char* p_data, size_t datasize) {
   ASSERT(p_data != NULL);
-  int input = 0;
+  size_t input = 0;
   while (p_data[input] != 0 && p_data[input] != '\r') {
     cMimeField fd;
-    int size = fd.load(p_data + input, datasize - input);
+    ssize_t size = fd.load(p_data + input, datasize - input);
     if (size <= 0)
       return size;
     input += size;
     m_listfields.push_back(fd);
   }
+  invalidateContentType();
   return input + 2;
 }
 
@@ -409,7 +725,258 @@ std::list<cMimeField>::iterator cMimeHeader::findField (
 
 /* End cMimeHeader definitions */
 
+/* cMimeBuffer definitions */
+
+/* spillFile - An unlinked temporary file and its mapping, which stays at
+ * the size it was made with while the file is cut shorter
+ */
+struct cMimeBuffer::spillFile {
+  int file;
+  size_t size;
+  unsigned char* map;
+
+  spillFile() : file(-1), size(0), map(NULL) {}
+  ~spillFile() {
+    if (map != NULL)
+      munmap(map, size);
+    if (file >= 0)
+      close(file);
+  }
+};
+
+/* openSpillFile - Temporary file with no name, O_TMPFILE where the file 
+ * system supports it or else a named file that is unlinked right away
+ */
+static int openSpillFile () {
+  const char* p_directory = cMimeEnvironment::spillDirectory();
+  int file;
+#if defined(O_TMPFILE)
+  file = open(p_directory, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+  if (file >= 0)
+    return file;
+#endif
+  string path = p_directory;
+  path += "/mime-ca.XXXXXX";
+  file = mkstemp(&path[0]);
+  if (file >= 0)
+    unlink(path.c_str());
+  return file;
+}
+
+/* cMimeBuffer::allocate - Buffer for p_size bytes, spilled to a temporary
+ * file past the threshold. Falls back to memory when no file can be made.
+ */
+bool cMimeBuffer::allocate (size_t p_size) {
+  clear();
+  size_t threshold = cMimeEnvironment::spillThreshold();
+  if (threshold > 0 && p_size > threshold) {
+    shared_ptr<spillFile> file = make_shared<spillFile>();
+    file->file = openSpillFile();
+    if (file->file >= 0 && ftruncate(file->file, p_size) == 0) {
+      void* p_map = mmap(NULL, p_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        file->file, 0);
+      if (p_map != MAP_FAILED) {
+        file->map = (unsigned char*)p_map;
+        file->size = p_size;
+        m_file = file;
+        m_owner = file;
+        m_size = p_size;
+        return true;
+      }
+    }
+  }
+
+  m_data = new unsigned char[p_size];
+  if (!m_data)
+    return false;
+  m_owner.reset(m_data, default_delete<unsigned char[]>());
+  m_size = p_size;
+  return true;
+}
+
+void cMimeBuffer::adopt (unsigned char* p_data, size_t p_size,
+    const shared_ptr<void>& p_owner) {
+  clear();
+  m_data = p_data;
+  m_size = p_size;
+  m_owner = p_owner;
+}
+
+/* cMimeBuffer::truncate - A spilled file is cut to the content and its
+ * terminator, the mapping and pointers into it stay valid
+ */
+void cMimeBuffer::truncate (size_t p_size) {
+  ASSERT(p_size <= m_size);
+  if (m_file != NULL && p_size < m_size) {
+    // a file left longer only takes disk space
+    int cut = ftruncate(m_file->file, p_size + 1);
+    (void)cut;
+  }
+  m_size = p_size;
+}
+
+void cMimeBuffer::clear () {
+  m_data = NULL;
+  m_size = 0;
+  m_owner.reset();
+  m_file.reset();
+}
+
+unsigned char* cMimeBuffer::fileData () const {
+  return m_file->map;
+}
+
+/* cMimeBuffer::read - Copy out part of the content */
+size_t cMimeBuffer::read (size_t p_offset, void* p_output, 
+    size_t p_size) const {
+  if (p_offset >= m_size)
+    return 0;
+  p_size = min(p_size, m_size - p_offset);
+  memcpy(p_output, data() + p_offset, p_size);
+  return p_size;
+}
+
+/* writeAll - write() until everything is out or the file fails */
+static bool writeAll (int p_file, const void* p_data, size_t p_size) {
+  const char* p_out = (const char*)p_data;
+  while (p_size > 0) {
+    ssize_t written = ::write(p_file, p_out, p_size);
+    if (written <= 0)
+      return false;
+    p_out += written;
+    p_size -= written;
+  }
+  return true;
+}
+
+/* cMimeBuffer::write - Write the whole content to an open file */
+bool cMimeBuffer::write (int p_file) const {
+  return writeAll(p_file, data(), m_size);
+}
+
+/* End cMimeBuffer definitions */
+
+/* cMimeSegments definitions */
+
+/* cMimeSegments::write - writev() as many segments as the system takes per
+ * call, picking up after short writes
+ */
+bool cMimeSegments::write (int p_file) const {
+  const size_t maxcount = 64;
+  size_t index = 0, offset = 0;
+  while (index < m_segments.size()) {
+    struct iovec vectors[maxcount];
+    size_t count = 0;
+    for (size_t i = index; i < m_segments.size() && count < maxcount; i++) {
+      size_t skip = i == index ? offset : 0;
+      vectors[count].iov_base = (void*)(m_segments[i].first + skip);
+      vectors[count].iov_len = m_segments[i].second - skip;
+      count++;
+    }
+    ssize_t written = ::writev(p_file, vectors, (int)count);
+    if (written <= 0)
+      return false;
+
+    size_t done = written;
+    while (index < m_segments.size() && 
+        done >= m_segments[index].second - offset) {
+      done -= m_segments[index].second - offset;
+      offset = 0;
+      index++;
+    }
+    offset += done;
+  }
+  return true;
+}
+
+void cMimeSegments::clear () {
+  m_segments.clear();
+  m_blocks.clear();
+  m_owners.clear();
+  m_size = 0;
+}
+
+void cMimeSegments::reference (const unsigned char* p_data, size_t p_size,
+    const shared_ptr<const void>& p_owner) {
+  if (!p_size)
+    return;
+  m_segments.push_back(cSegment(p_data, p_size));
+  if (p_owner)
+    m_owners.push_back(p_owner);
+  m_size += p_size;
+}
+
+/* cMimeSegments::block - A new owned segment of p_size bytes, shrink() it to
+ * what was written
+ */
+char* cMimeSegments::block (size_t p_size) {
+  m_blocks.push_back(string(p_size, '\0'));
+  string& block = m_blocks.back();
+  m_segments.push_back(cSegment((const unsigned char*)block.data(), p_size));
+  m_size += p_size;
+  return &block[0];
+}
+
+/* cMimeSegments::shrink - Cut the last segment to p_size bytes */
+void cMimeSegments::shrink (size_t p_size) {
+  ASSERT(!m_segments.empty() && p_size <= m_segments.back().second);
+  m_size -= m_segments.back().second - p_size;
+  m_segments.back().second = p_size;
+}
+
+/* End cMimeSegments definitions */
+
 /* cMimeBody definitions */
+
+/* cMimeBody::cMimeBody - Copy of the part tree. Content and cached encodings
+ * are shared, they are replaced rather than written to once set.
+ */
+cMimeBody::cMimeBody (const cMimeBody& p_body) :
+  cMimeHeader(p_body),
+  m_text(p_body.m_text),
+  m_loadbudget(NULL),
+  m_loadowner(NULL),
+  m_encoded(p_body.m_encoded),
+  m_encodedserial(p_body.m_encodedserial),
+  m_encodedstamp(p_body.m_encodedstamp) {
+  std::list<cMimeBody*>::const_iterator it;
+  for (it = p_body.m_listbodies.begin(); it != p_body.m_listbodies.end(); 
+      it++)
+    m_listbodies.push_back((*it)->clone());
+  m_itfind = m_listbodies.end();
+}
+
+cMimeBody::cMimeBody (cMimeBody&& p_body) :
+  cMimeHeader(std::move(p_body)),
+  m_text(std::move(p_body.m_text)),
+  m_listbodies(std::move(p_body.m_listbodies)),
+  m_loadbudget(NULL),
+  m_loadowner(NULL),
+  m_encoded(std::move(p_body.m_encoded)),
+  m_encodedserial(p_body.m_encodedserial),
+  m_encodedstamp(p_body.m_encodedstamp) {
+  m_itfind = m_listbodies.end();
+  p_body.freeBuffer();
+  p_body.m_listbodies.clear();
+  p_body.m_itfind = p_body.m_listbodies.end();
+}
+
+cMimeBody& cMimeBody::operator= (cMimeBody&& p_body) {
+  if (this != &p_body) {
+    clear();
+    cMimeHeader::operator=(std::move(p_body));
+    m_text = std::move(p_body.m_text);
+    p_body.freeBuffer();
+    m_listbodies.swap(p_body.m_listbodies);
+    m_encoded.swap(p_body.m_encoded);
+    m_encodedserial = p_body.m_encodedserial;
+    m_encodedstamp = p_body.m_encodedstamp;
+    m_itfind = m_listbodies.end();
+    p_body.m_itfind = p_body.m_listbodies.end();
+  }
+  return *this;
+}
+
 void cMimeBody::clear() {
   deleteAll();
   m_itfind = m_listbodies.end();
@@ -417,42 +984,105 @@ void cMimeBody::clear() {
   cMimeHeader::clear();
 }
 
-int cMimeBody::payload (const char* p_text, int length) {
+ssize_t cMimeBody::payload (const char* p_text, size_t length) {
   ASSERT(p_text != NULL);
   if (!length)
-    length = (int)strlen((char*)p_text);
+    length = strlen((char*)p_text);
 
   if (!allocateBuffer(length+4)) 
     return -1;
 
-  memcpy(m_text, p_text, length);
-  m_text[length] = 0;
-  m_textsize = length;
+  unsigned char* p_data = m_text.data();
+  memcpy(p_data, p_text, length);
+  p_data[length] = 0;
+  m_text.truncate(length);
   return length;
 }
 
-int cMimeBody::payload (char* p_text, int maxsize) {
-  int size = min(maxsize, m_textsize);
-  if (m_text != NULL)
-    memcpy(p_text, m_text, size);
-  return size;
+size_t cMimeBody::payload (char* p_text, size_t maxsize) {
+  return m_text.read(0, p_text, maxsize);
 }
 
-int cMimeBody::payload (string& p_text) {
-  if (m_text != NULL)
-    p_text.assign((const char*) m_text, m_textsize);
-  return m_textsize;
+size_t cMimeBody::payload (string& p_text) {
+  p_text.resize(m_text.size());
+  if (!p_text.empty())
+    p_text.resize(m_text.read(0, &p_text[0], p_text.size()));
+  return p_text.size();
+}
+
+/* cMimeBody::utf8Payload - Content in memory is converted at once, spilled
+ * content streamed through the converter in chunks
+ */
+size_t cMimeBody::utf8Payload (string& p_text) {
+  cMimeCodeCharset converter(charset().c_str());
+  p_text.clear();
+  if (!m_text.spilled()) {
+    converter.setInput((const char*)m_text.data(), m_text.size(), false);
+    p_text.resize(converter.getOutputLength());
+    ssize_t size = converter.getOutput((unsigned char*)&p_text[0], 
+      p_text.size());
+    p_text.resize(size > 0 ? size : 0);
+    return p_text.size();
+  }
+
+  const size_t chunksize = 64 << 10;
+  char chunk[chunksize];
+  converter.begin(false);
+  for (size_t offset = 0; offset <= m_text.size(); offset += chunksize) {
+    size_t size = m_text.read(offset, chunk, chunksize);
+    if (size > 0)
+      converter.update(chunk, size);
+    else
+      converter.finish();
+    size_t length = p_text.size();
+    p_text.resize(length + converter.getOutputLength());
+    ssize_t output = converter.getOutput((unsigned char*)&p_text[length], 
+      p_text.size() - length);
+    p_text.resize(length + (output > 0 ? output : 0));
+    if (size == 0)
+      break;
+  }
+  return p_text.size();
+}
+
+size_t cMimeBody::payload (string&& p_text) {
+  shared_ptr<string> text = make_shared<string>(std::move(p_text));
+  adoptBuffer((unsigned char*)&(*text)[0], text->size(), text);
+  return m_text.size();
+}
+
+size_t cMimeBody::payload (vector<unsigned char>&& p_data) {
+  shared_ptr<vector<unsigned char> > data = 
+    make_shared<vector<unsigned char> >(std::move(p_data));
+  adoptBuffer(data->empty() ? NULL : &(*data)[0], data->size(), data);
+  return m_text.size();
+}
+
+size_t cMimeBody::payload (unsigned char* p_data, size_t p_size,
+    const cBufferDeleter& p_deleter) {
+  ASSERT(p_data != NULL || !p_size);
+  if (p_deleter) {
+    adoptBuffer(p_data, p_size, shared_ptr<unsigned char>(p_data, p_deleter));
+  } else {
+    adoptBuffer(p_data, p_size, shared_ptr<void>());
+  }
+  return m_text.size();
 }
 
 bool cMimeBody::message (const cMimeMessage* p_mm) {
   ASSERT(p_mm != NULL);
-  int size = p_mm->getLength();
+  size_t size = p_mm->getLength();
   if (!allocateBuffer(size+4))
     return false;
 
-  size = p_mm->store((char*)m_text, size);
-  m_text[size] = 0;
-  m_textsize = size;
+  unsigned char* p_data = m_text.data();
+  ssize_t stored = p_mm->store((char*)p_data, size);
+  if (stored < 0) {
+    freeBuffer();
+    return false;
+  }
+  p_data[stored] = 0;
+  m_text.truncate(stored);
 
   const char* type = contentType();
   if (!type || memcmp(type, "message", 7) != 0)
@@ -463,8 +1093,8 @@ bool cMimeBody::message (const cMimeMessage* p_mm) {
 
 void cMimeBody::message (cMimeMessage* p_mm) const {
   ASSERT(p_mm != NULL);
-  ASSERT(m_text != NULL);
-  p_mm->load((const char*)m_text, m_textsize);
+  ASSERT(m_text.data() != NULL);
+  p_mm->load((const char*)m_text.data(), m_text.size());
 }
 
 bool cMimeBody::readFromFile (const char* p_filename) {
@@ -473,26 +1103,28 @@ bool cMimeBody::readFromFile (const char* p_filename) {
     return false;
 
   try {
-    int filesize = (int)lseek(file, 0L, SEEK_END);
+    off_t filesize = lseek(file, 0L, SEEK_END);
     lseek(file, 0L, SEEK_SET);
 
     freeBuffer();
     if (filesize > 0) {
       allocateBuffer(filesize+4);
-      unsigned char* p_data = m_text;
-
-      for (;;) {
-        int rd = read(file, p_data, 512);
-        if (rd < 0) {
+      unsigned char* p_data = m_text.data();
+      size_t left = filesize;
+
+      // read straight into the body buffer, as much per call as the OS gives
+      while (left > 0) {
+        ssize_t rd = read(file, p_data, left);
+        if (rd <= 0) {
+          freeBuffer();
           close(file);
           return false;
         }
         p_data += rd;
-        if (rd < 512)
-          break;
+        left -= rd;
       }
       *p_data = 0;
-      m_textsize = filesize;
+      m_text.truncate(filesize);
     }
   } catch (...) {
     close(file);
@@ -500,7 +1132,9 @@ bool cMimeBody::readFromFile (const char* p_filename) {
   }
 
   close(file);
-  const char* p_name = strrchr(p_filename, '\\');
+  const char* p_name = strrchr(p_filename, '/');
+  if (!p_name)
+    p_name = strrchr(p_filename, '\\');
   if (!p_name) {
     p_name = p_filename;
   } else {
@@ -511,7 +1145,7 @@ bool cMimeBody::readFromFile (const char* p_filename) {
 }
 
 bool cMimeBody::writeToFile (const char* p_filename) {
-  if (!m_textsize)
+  if (!m_text.size())
     return true;
 
   int file = open(p_filename, O_CREAT | O_TRUNC | O_RDWR | O_BINARY, 
@@ -519,31 +1153,20 @@ bool cMimeBody::writeToFile (const char* p_filename) {
   if (file < 0) 
     return false;
 
-  const unsigned char* p_data = m_text;
-  int left = m_textsize;
-
+  bool written;
   try {
-    for (;;) {
-      int written = write(file, p_data, min(512, left));
-      if (written <= 0) {
-        close(file);
-        return false;
-      }
-      p_data += written;
-      left -= written;
-      if (left <= 0)
-        break;
-    }
+    written = m_text.write(file);
   } catch (...) {
     close(file);
     throw;
   }
 
   close(file);
-  return true;
+  return written;
 }
 
 void cMimeBody::deleteAll() {
+  touch();
   while (!m_listbodies.empty()) {
     cMimeBody* p_bp = m_listbodies.back();
     m_listbodies.pop_back();
@@ -555,6 +1178,7 @@ void cMimeBody::deleteAll() {
 cMimeBody* cMimeBody::createPart(const char* p_mediatype, cMimeBody* p_where) {
   cMimeBody* p_bp = cMimeEnvironment::createBodyPart(p_mediatype);
   ASSERT(p_bp != NULL);
+  touch();
   if (p_where != NULL) {
     for (cBodyList::iterator it = m_listbodies.begin(); 
         it != m_listbodies.end(); it++) {
@@ -570,6 +1194,7 @@ cMimeBody* cMimeBody::createPart(const char* p_mediatype, cMimeBody* p_where) {
 
 void cMimeBody::erasePart(cMimeBody* p_bp) {
   ASSERT(p_bp != NULL);
+  touch();
   m_listbodies.remove(p_bp);
   delete p_bp;
 }
@@ -597,8 +1222,7 @@ int cMimeBody::attachmentList (cBodyList& p_list) const {
   int mediatype = mediaType();
 
   if (MEDIA_MULTIPART != mediatype) {
-    string s_name = name();
-    if (s_name.size() > 0) {
+    if (isAttachment()) {
       p_list.push_back((cMimeBody*)this);
       count++;
     }
@@ -613,19 +1237,105 @@ int cMimeBody::attachmentList (cBodyList& p_list) const {
   return count;
 }
 
-int cMimeBody::getLength() const {
-  int length = cMimeHeader::getLength();
-  cMimeCodeBase* coder = cMimeEnvironment::registerCoder(transferEncoding());
-  ASSERT(coder != NULL);
-  coder->setInput((const char*)m_text, m_textsize, true);
-  length += coder->getOutputLength();
-  delete coder;
+cMimeMemoryUsage cMimeBody::memoryUsage () const {
+  cMimeMemoryUsage usage;
+  addMemoryUsage(usage);
+  return usage;
+}
+
+void cMimeBody::addMemoryUsage (cMimeMemoryUsage& p_usage) const {
+  const size_t listnode = 2 * sizeof(void*);
+  p_usage.parts++;
+  p_usage.headers += headerMemory();
+  if (m_text.spilled()) {
+    p_usage.spilled += m_text.size();
+  } else {
+    p_usage.bodies += m_text.size();
+  }
+  // a cached encoding shared with clones is counted by each of them
+  if (m_encoded != NULL)
+    p_usage.bodies += m_encoded->capacity();
+  p_usage.overhead += sizeof(*this) + 
+    m_listfields.size() * (sizeof(cMimeField) + listnode) +
+    m_listbodies.size() * (sizeof(cMimeBody*) + listnode);
+
+  std::list<cMimeBody*>::const_iterator it;
+  for (it = m_listbodies.begin(); it != m_listbodies.end(); it++)
+    (*it)->addMemoryUsage(p_usage);
+}
+
+/* cMimeBody::resolveAll - Settle all lazy state of this part and its 
+ * children, see cMimeMessage::freeze()
+ */
+void cMimeBody::resolveAll () {
+  resolveFields();
+  m_itfind = m_listbodies.end();
+
+  std::list<cMimeBody*>::iterator it;
+  for (it = m_listbodies.begin(); it != m_listbodies.end(); it++)
+    (*it)->resolveAll();
+}
+
+/* cMimeBody::chargeLoad - Account for memory about to be taken by a load, 
+ * false once that would pass the limit
+ */
+bool cMimeBody::chargeLoad (size_t p_bytes) {
+  if (!m_loadbudget)
+    return true;
+  m_loadbudget->used += p_bytes;
+  return m_loadbudget->used <= m_loadbudget->limit;
+}
+
+cMimeBody* cMimeBody::clone () const {
+  return new cMimeBody(*this);
+}
+
+/* cMimeBody::cacheEncoding - Store each leaf part once into a shared buffer,
+ * see encodingCached()
+ */
+void cMimeBody::cacheEncoding () {
+  if (!m_listbodies.empty()) {
+    std::list<cMimeBody*>::iterator it;
+    for (it = m_listbodies.begin(); it != m_listbodies.end(); it++)
+      (*it)->cacheEncoding();
+    return;
+  }
+
+  m_encoded.reset();
+  shared_ptr<string> p_encoded = make_shared<string>(getLength(), '\0');
+  ssize_t size = store(&(*p_encoded)[0], p_encoded->size());
+  if (size < 0)
+    return;
+  p_encoded->resize(size);
+  m_encoded = p_encoded;
+  m_encodedserial = serial();
+  m_encodedstamp = cMimeEnvironment::context().stamp();
+}
+
+bool cMimeBody::encodingCached () const {
+  return m_encoded != NULL && m_encodedserial == serial() &&
+    m_encodedstamp == cMimeEnvironment::context().stamp();
+}
+
+const char* cMimeBody::chooseTransferEncoding (bool p_allow8bit) {
+  cMimeAutoEncoding choice(m_text.data(), m_text.size(), p_allow8bit);
+  transferEncoding(choice.encoding());
+  return transferEncoding();
+}
+
+size_t cMimeBody::getLength() const {
+  if (encodingCached())
+    return m_encoded->size();
+  size_t length = cMimeHeader::getLength();
+  cMimeCodeWhole op = { (const char*)m_text.data(), m_text.size(), true, 
+    NULL, 0, NULL, 0 };
+  length += cMimeEnvironment::withCoder(transferEncoding(), op);
 
   if (m_listbodies.empty())
     return length;
 
-  string s_boundary = boundary();
-  int boundsize = (int)s_boundary.size();
+  const string& s_boundary = boundary();
+  size_t boundsize = s_boundary.size();
   std::list<cMimeBody*>::const_iterator it;
   for (it = m_listbodies.begin(); it != m_listbodies.end(); it++) {
     length += boundsize + 6;
@@ -637,8 +1347,15 @@ int cMimeBody::getLength() const {
   return length;
 }
 
-int cMimeBody::store (char* p_data, int maxsize) const {
-  int size = cMimeHeader::store(p_data, maxsize);
+ssize_t cMimeBody::store (char* p_data, size_t maxsize) const {
+  if (encodingCached()) {
+    if (maxsize < m_encoded->size())
+      return ERROR_FAILED;
+    memcpy(p_data, m_encoded->data(), m_encoded->size());
+    return m_encoded->size();
+  }
+
+  ssize_t size = cMimeHeader::store(p_data, maxsize);
   int a_count = 0;
   if (size <= 0)
     return size;
@@ -647,24 +1364,22 @@ int cMimeBody::store (char* p_data, int maxsize) const {
   p_data += size;
   maxsize -= size;
 
-  cMimeCodeBase* coder = cMimeEnvironment::registerCoder(transferEncoding());
-  ASSERT(coder != NULL);
-  coder->setInput((const char*)m_text, m_textsize, true);
-  int output = coder->getOutput((unsigned char*)p_data, maxsize);
-  delete coder;
+  cMimeCodeWhole op = { (const char*)m_text.data(), m_text.size(), true, 
+    (unsigned char*)p_data, maxsize, NULL, 0 };
+  ssize_t output = cMimeEnvironment::withCoder(transferEncoding(), op);
   if (output < 0)
     return output;
 
   p_data += output;
   maxsize -= output;
   if (m_listbodies.empty())
-    return (int)(p_data - p_databegin);
+    return p_data - p_databegin;
 
-  string s_boundary = getBoundary();
+  const string& s_boundary = getBoundary();
   if (s_boundary.empty())
     return -1;
 
-  int boundsize = (int)s_boundary.size() + 6;
+  size_t boundsize = s_boundary.size() + 6;
   for (cBodyList::const_iterator it=m_listbodies.begin();
       it != m_listbodies.end(); it++) {
 
@@ -702,11 +1417,109 @@ int cMimeBody::store (char* p_data, int maxsize) const {
     sprintf(p_data, "\r\n--%s--\r\n", s_boundary.c_str());
     p_data += boundsize + 2;
   }
-  return (int)(p_data - p_databegin);
+  return p_data - p_databegin;
+}
+
+/* cMimeBody::storeSegments - store() into segments. Content is referenced
+ * when it goes out as it is and is not spilled to a file.
+ */
+struct cMimeBody::segmentsStore {
+  typedef ssize_t result_type;
+  const char* input;
+  size_t size;
+  cMimeSegments& out;
+
+  template <class C> ssize_t operator() (C& p_coder, bool p_direct) {
+    p_coder.setInput(input, size, true);
+    size_t length = cMimeCodeBase::outputLength(p_coder, p_direct);
+    return cMimeCodeBase::output(p_coder, (unsigned char*)out.block(length),
+      length, p_direct);
+  }
+};
+
+ssize_t cMimeBody::storeSegments (cMimeSegments& p_out) const {
+  if (encodingCached()) {
+    p_out.reference((const unsigned char*)m_encoded->data(), 
+      m_encoded->size(), m_encoded);
+    return m_encoded->size();
+  }
+
+  size_t start = p_out.size();
+  size_t size = cMimeHeader::getLength();
+  ssize_t output = cMimeHeader::store(p_out.block(size), size);
+  if (output <= 0)
+    return output;
+  p_out.shrink(output);
+
+  const char* encoding = transferEncoding();
+  if (cMimeEnvironment::passthrough(encoding) && !m_text.spilled()) {
+    p_out.reference(m_text.data(), m_text.size(), shared_ptr<const void>());
+  } else if (m_text.size() > 0) {
+    segmentsStore op = { (const char*)m_text.data(), m_text.size(), p_out };
+    output = cMimeEnvironment::withCoder(encoding, op);
+    if (output < 0)
+      return output;
+    p_out.shrink(output);
+  }
+  if (m_listbodies.empty())
+    return p_out.size() - start;
+
+  const string& s_boundary = getBoundary();
+  if (s_boundary.empty())
+    return -1;
+
+  size_t boundsize = s_boundary.size() + 6;
+  for (cBodyList::const_iterator it=m_listbodies.begin();
+      it != m_listbodies.end(); it++) {
+    if (m_listbodies.begin() == it && p_out.count() > 0) {
+      // the first boundary takes the line break before it
+      size_t last = p_out.count() - 1;
+      const unsigned char* p_end = p_out.data(last) + p_out.size(last);
+      if (p_out.size(last) >= 2 && p_end[-2] == '\r' && p_end[-1] == '\n')
+        p_out.shrink(p_out.size(last) - 2);
+    }
+    sprintf(p_out.block(boundsize + 1), "\r\n--%s\r\n", s_boundary.c_str());
+    p_out.shrink(boundsize);
+
+    output = (*it)->storeSegments(p_out);
+    if (output < 0)
+      return output;
+  }
+
+  sprintf(p_out.block(boundsize + 3), "\r\n--%s--\r\n", s_boundary.c_str());
+  p_out.shrink(boundsize + 2);
+  return p_out.size() - start;
 }
 
-int cMimeBody::load (const char* p_data, int datasize) {
-  int size = cMimeHeader::load(p_data, datasize);
+struct cMimeBody::contentLoad {
+  typedef ssize_t result_type;
+  cMimeBody& body;
+  const char* input;
+  size_t size;
+
+  template <class C> ssize_t operator() (C& p_coder, bool p_direct) {
+    p_coder.setInput(input, size, false);
+    size_t length = cMimeCodeBase::outputLength(p_coder, p_direct);
+    // spilled content is on disk and does not count against the limit,
+    // content kept in memory is charged before it is allocated
+    size_t threshold = cMimeEnvironment::spillThreshold();
+    bool spill = threshold > 0 && length+4 > threshold;
+    if (!spill && !body.chargeLoad(length))
+      return ERROR_MEMORY_LIMIT;
+    if (!body.allocateBuffer(length+4))
+      return ERROR_FAILED;
+    // a spill that fell back to memory is charged now
+    if (spill && !body.m_text.spilled() && !body.chargeLoad(length)) {
+      body.freeBuffer();
+      return ERROR_MEMORY_LIMIT;
+    }
+    return cMimeCodeBase::output(p_coder, body.m_text.data(), length, 
+      p_direct);
+  }
+};
+
+ssize_t cMimeBody::load (const char* p_data, size_t datasize) {
+  ssize_t size = cMimeHeader::load(p_data, datasize);
   if (size <= 0)
     return size;
 
@@ -715,6 +1528,10 @@ int cMimeBody::load (const char* p_data, int datasize) {
   datasize -= size;
   freeBuffer();
 
+  if (!chargeLoad(sizeof(*this) + headerMemory() + 
+      m_listfields.size() * sizeof(cMimeField)))
+    return ERROR_MEMORY_LIMIT;
+
   const char* p_end = p_data + datasize;
   int mediatype = mediaType();
   if (MEDIA_MULTIPART == mediatype) {
@@ -729,32 +1546,30 @@ int cMimeBody::load (const char* p_data, int datasize) {
       }
     }
   }
-  size = (int)(p_end - p_data);
+  size = p_end - p_data;
 
-  if (size > 0) {
-    cMimeCodeBase* coder = cMimeEnvironment::registerCoder(transferEncoding());
-    ASSERT(coder != NULL);
-    coder->setInput(p_data, size, false);
-    int output = coder->getOutputLength();
-    if (allocateBuffer(output+4)) {
-      output = coder->getOutput(m_text, output);
-    } else {
-      output -= 1;
-    }
-    delete coder;
+  if (size > 0 && m_loadowner != NULL && 
+      cMimeEnvironment::passthrough(transferEncoding())) {
+    // the content is the input itself
+    adoptBuffer((unsigned char*)p_data, size, *m_loadowner);
+    p_data += size;
+    datasize -= size;
+  } else if (size > 0) {
+    contentLoad op = { *this, p_data, (size_t)size };
+    ssize_t output = cMimeEnvironment::withCoder(transferEncoding(), op);
 
     if (output < 0)
       return output;
 
-    ASSERT(output < m_textsize);
-    m_text[output] = 0;
-    m_textsize = output;
+    ASSERT((size_t)output < m_text.size());
+    m_text.data()[output] = 0;
+    m_text.truncate(output);
     p_data += size;
     datasize -= size;
   }
 
   if (datasize <= 0)
-    return (int)(p_data - p_databegin);
+    return p_data - p_databegin;
 
   string s_boundary = getBoundary();
   ASSERT(s_boundary.size() > 0);
@@ -771,30 +1586,199 @@ int cMimeBody::load (const char* p_data, int datasize) {
     p_start += 2;
     if (p_bound1[s_boundary.size()] == '-' 
         && p_bound1[s_boundary.size()+1] == '-')
-      return (int)(p_start - p_databegin);
+      return p_start - p_databegin;
 
     const char* p_bound2 = findString(p_start, s_boundary.c_str(), p_end);
     if (!p_bound2)
       p_bound2 = p_end;
-    int entitysize = (int)(p_bound2 - p_start);
+    size_t entitysize = p_bound2 - p_start;
 
     cMimeHeader header;
     header.load(p_start, entitysize);
     string s_mediatype = header.mainType();
     cMimeBody* p_bp = createPart(s_mediatype.c_str());
 
-    int inputsize = p_bp->load(p_start, entitysize);
+    p_bp->m_loadbudget = m_loadbudget;
+    p_bp->m_loadowner = m_loadowner;
+    ssize_t inputsize = p_bp->load(p_start, entitysize);
+    p_bp->m_loadbudget = NULL;
+    p_bp->m_loadowner = NULL;
     if (inputsize < 0) {
       erasePart(p_bp);
       return inputsize;
     }
     p_bound1 = p_bound2;
   }
-  return (int)(p_end - p_databegin);
+  return p_end - p_databegin;
 }
 /* End cMimeBody */
 
+/* cMimePartIndex */
+
+/* contentIdKey - Content-ID without white space, angle brackets or a "cid:"
+ * URL prefix, so both header values and references map to the same key
+ */
+static string contentIdKey (const char* p_cid) {
+  while (isspace((unsigned char)*p_cid))
+    p_cid++;
+  if (!strncasecmp(p_cid, "cid:", 4))
+    p_cid += 4;
+  if (*p_cid == '<')
+    p_cid++;
+  size_t size = strlen(p_cid);
+  while (size > 0 && isspace((unsigned char)p_cid[size-1]))
+    size--;
+  if (size > 0 && p_cid[size-1] == '>')
+    size--;
+  return string(p_cid, size);
+}
+
+void cMimePartIndex::build (const cMimeBody& p_body) {
+  clear();
+  add(&p_body);
+}
+
+void cMimePartIndex::clear () {
+  m_contentids.clear();
+  m_filenames.clear();
+  m_mediatypes.clear();
+  m_size = 0;
+}
+
+void cMimePartIndex::add (const cMimeBody* p_bp) {
+  m_size++;
+  const cMimeHeader::cFieldList& fields = p_bp->fields();
+  for (cMimeHeader::cFieldList::const_iterator it = fields.begin();
+      it != fields.end(); it++) {
+    if (!strcasecmp((*it).name(), cMimeConst::constentId())) {
+      string key = contentIdKey((*it).value());
+      if (!key.empty())
+        m_contentids.insert(make_pair(key, p_bp));
+      break;
+    }
+  }
+
+  string filename = p_bp->filename();
+  if (filename.empty())
+    filename = p_bp->name();
+  if (!filename.empty())
+    m_filenames.insert(make_pair(filename, p_bp));
+
+  string mediatype = p_bp->mainType() + "/" + p_bp->subType();
+  for (size_t i = 0; i < mediatype.size(); i++)
+    mediatype[i] = tolower((unsigned char)mediatype[i]);
+  m_mediatypes.insert(make_pair(mediatype, p_bp));
+
+  for (cMimeBody::cPartIterator it = p_bp->partsBegin(); 
+      it != p_bp->partsEnd(); ++it)
+    add(*it);
+}
+
+const cMimeBody* cMimePartIndex::contentId (const char* p_cid) const {
+  ASSERT(p_cid != NULL);
+  cPartMap::const_iterator it = m_contentids.find(contentIdKey(p_cid));
+  return it != m_contentids.end() ? it->second : NULL;
+}
+
+const cMimeBody* cMimePartIndex::filename (const char* p_filename) const {
+  ASSERT(p_filename != NULL);
+  cPartMap::const_iterator it = m_filenames.find(p_filename);
+  return it != m_filenames.end() ? it->second : NULL;
+}
+
+/* cMimePartIndex::mediaType - Append the parts of a media type, in no 
+ * particular order
+ */
+int cMimePartIndex::mediaType (const char* p_mediatype, 
+    vector<const cMimeBody*>& p_list) const {
+  ASSERT(p_mediatype != NULL);
+  string key(p_mediatype);
+  for (size_t i = 0; i < key.size(); i++)
+    key[i] = tolower((unsigned char)key[i]);
+  int count = 0;
+  typedef unordered_multimap<string, const cMimeBody*>::const_iterator 
+    cTypeIterator;
+  pair<cTypeIterator, cTypeIterator> range = m_mediatypes.equal_range(key);
+  for (cTypeIterator it = range.first; it != range.second; it++, count++)
+    p_list.push_back(it->second);
+  return count;
+}
+
+/* End cMimePartIndex */
+
 /* cMimeMessage */
+ssize_t cMimeMessage::load (const char* p_data, size_t p_datasize) {
+  m_partindex.clear();
+  loadBudget budget;
+  budget.limit = m_memorylimit;
+  budget.used = 0;
+  if (m_memorylimit)
+    m_loadbudget = &budget;
+  ssize_t size = cMimeBody::load(p_data, p_datasize);
+  m_loadbudget = NULL;
+  if (size == ERROR_MEMORY_LIMIT)
+    clear();
+  else if (size > 0 && m_indexparts)
+    m_partindex.build(*this);
+  return size;
+}
+
+ssize_t cMimeMessage::load (const char* p_data, size_t p_datasize,
+    const shared_ptr<void>& p_owner) {
+  m_loadowner = &p_owner;
+  ssize_t size = load(p_data, p_datasize);
+  m_loadowner = NULL;
+  return size;
+}
+
+ssize_t cMimeMessage::load (const char* p_data, size_t p_datasize,
+    const cMimeContext& p_context) {
+  cMimeContext::scope use(p_context);
+  return load(p_data, p_datasize);
+}
+
+ssize_t cMimeMessage::load (const char* p_data, size_t p_datasize,
+    const shared_ptr<void>& p_owner, const cMimeContext& p_context) {
+  cMimeContext::scope use(p_context);
+  return load(p_data, p_datasize, p_owner);
+}
+
+size_t cMimeMessage::getLength (const cMimeContext& p_context) const {
+  cMimeContext::scope use(p_context);
+  return getLength();
+}
+
+ssize_t cMimeMessage::store (char* p_data, size_t p_maxsize, 
+    const cMimeContext& p_context) const {
+  cMimeContext::scope use(p_context);
+  return store(p_data, p_maxsize);
+}
+
+ssize_t cMimeMessage::storeSegments (cMimeSegments& p_out, 
+    const cMimeContext& p_context) const {
+  cMimeContext::scope use(p_context);
+  return storeSegments(p_out);
+}
+
+void cMimeMessage::clear () {
+  m_partindex.clear();
+  cMimeBody::clear();
+}
+
+void cMimeMessage::indexParts (bool p_index) {
+  m_indexparts = p_index;
+  m_partindex.clear();
+  if (p_index)
+    m_partindex.build(*this);
+}
+
+shared_ptr<const cMimeMessage> cMimeMessage::freeze () {
+  shared_ptr<cMimeMessage> p_frozen = 
+    make_shared<cMimeMessage>(std::move(*this));
+  p_frozen->resolveAll();
+  return p_frozen;
+}
+
 void cMimeMessage::date() {
   time_t timenow = time(NULL);
   struct tm *ptm = localtime(&timenow);
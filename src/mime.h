@@ -29,7 +29,13 @@
 #define _MIME_H
 
 #include <list>
+#include <memory>
 #include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+#include <sys/types.h>
 
 class cMimeConst {
   public:
@@ -66,52 +72,173 @@ class cMimeConst {
     static inline const char* mediaApplication() { return "application"; }
 };
 
+/* cMimeMemoryUsage - Memory held by a message or part tree, in bytes */
+struct cMimeMemoryUsage {
+  size_t headers;     // field names, values, parameters
+  size_t bodies;      // decoded content buffers held in memory
+  size_t spilled;     // decoded content kept in temporary files
+  size_t overhead;    // part and field objects, list nodes
+  size_t parts;       // number of body parts, the root included
+
+  cMimeMemoryUsage() : 
+    headers(0), bodies(0), spilled(0), overhead(0), parts(0) {}
+  size_t total() const { return headers + bodies + overhead; }
+};
+
 /* cMimeField - Abstraction of a field in a MIME body part header */
+/* mimeSerial - Next modification stamp. Stamps are unique across all fields
+ * and headers, so a stamp taken before a change never matches one after it.
+ */
+unsigned long mimeSerial();
+
 class cMimeField {
   public:
-    cMimeField() {}
+    cMimeField() : m_serial(0), m_paramstate(PARAM_UNPARSED), m_mainsize(0) {}
+    cMimeField(const cMimeField& p_field);
+    cMimeField(cMimeField&& p_field);
     ~cMimeField() {}
 
+    cMimeField& operator=(const cMimeField& p_field);
+    cMimeField& operator=(cMimeField&& p_field);
+
     const char* name() const;
     void name(const char* p_name);
 
     const char* value() const;
     void value (const char* p_value);
+    void value (std::string&& p_value);
     void value (std::string& p_value) const;
 
-    void parameter (const char* p_attr, const char* p_value);
+    void parameter (const char* p_attr, const char* p_value,
+      const char* p_charset=NULL);
     bool parameter (const char* p_attr, std::string& p_value) const;
+    const char* parameter (const char* p_attr) const;
+    const char* parameterCharset (const char* p_attr) const;
 
     const char* charset () const;
     void charset (const char* p_charset);
 
     void clear();
-    int getLength() const;
-    int store (char* p_data, int p_maxsize) const;
-    int load (const char* p_data, int p_datasize);
+    size_t getLength() const;
+    ssize_t store (char* p_data, size_t p_maxsize) const;
+    ssize_t load (const char* p_data, size_t p_datasize);
+
+    // Bumped on every modification, lets owners validate cached parses
+    unsigned long serial() const { return m_serial; }
+
+    // Heap bytes held by the field text and parameter table
+    size_t memoryUsage() const;
+
+    // Do the parsing that is otherwise done lazily, so that later const
+    // calls only read the field
+    void resolve();
 
   private:
     std::string m_name;
-    std::string m_value;
+    mutable std::string m_value;
     std::string m_charset;
-
-    bool findParameter (const char* p_attr, int& p_pos, int& p_size) const;
+    unsigned long m_serial;
+
+    /* Parameters are parsed out of m_value on first use, RFC 2231 sections
+     * joined and percent-decoded. Setting a parameter only touches the table,
+     * m_value is rebuilt from it the next time the text is needed.
+     */
+    struct parameterEntry {
+      std::string attr;
+      std::string value;
+      std::string charset;
+    };
+    enum { PARAM_UNPARSED, PARAM_PARSED, PARAM_DIRTY };
+    mutable std::vector<parameterEntry> m_params;
+    mutable int m_paramstate;
+    mutable size_t m_mainsize;
+
+    void parseParameters() const;
+    void storeParameters() const;
+    const parameterEntry* findParameter (const char* p_attr) const;
+    const std::string& text() const;
 };
 
+inline cMimeField::cMimeField (const cMimeField& p_field) :
+  m_name(p_field.m_name),
+  m_value(p_field.m_value),
+  m_charset(p_field.m_charset),
+  m_serial(p_field.m_serial),
+  m_params(p_field.m_params),
+  m_paramstate(p_field.m_paramstate),
+  m_mainsize(p_field.m_mainsize) {}
+
+inline cMimeField::cMimeField (cMimeField&& p_field) :
+  m_name(std::move(p_field.m_name)),
+  m_value(std::move(p_field.m_value)),
+  m_charset(std::move(p_field.m_charset)),
+  m_serial(p_field.m_serial),
+  m_params(std::move(p_field.m_params)),
+  m_paramstate(p_field.m_paramstate),
+  m_mainsize(p_field.m_mainsize) {
+  p_field.clear();
+}
+
+/* cMimeField::operator= - Copy the text but not the serial, an assignment is a
+ * modification of this field as far as any cached parse is concerned
+ */
+inline cMimeField& cMimeField::operator= (const cMimeField& p_field) {
+  m_name = p_field.m_name;
+  m_value = p_field.m_value;
+  m_charset = p_field.m_charset;
+  m_params = p_field.m_params;
+  m_paramstate = p_field.m_paramstate;
+  m_mainsize = p_field.m_mainsize;
+  m_serial = mimeSerial();
+  return *this;
+}
+
+inline cMimeField& cMimeField::operator= (cMimeField&& p_field) {
+  if (this != &p_field) {
+    m_name.swap(p_field.m_name);
+    m_value.swap(p_field.m_value);
+    m_charset.swap(p_field.m_charset);
+    m_params.swap(p_field.m_params);
+    m_paramstate = p_field.m_paramstate;
+    m_mainsize = p_field.m_mainsize;
+    m_serial = mimeSerial();
+    p_field.clear();
+  }
+  return *this;
+}
+
 inline const char* cMimeField::name() const {
   return m_name.data();
 }
 
 inline void cMimeField::name (const char* p_name) {
   m_name = p_name;
+  m_serial = mimeSerial();
+}
+
+/* cMimeField::text - Field value text, with pending parameter changes */
+inline const std::string& cMimeField::text () const {
+  if (m_paramstate == PARAM_DIRTY)
+    storeParameters();
+  return m_value;
 }
 
 inline const char* cMimeField::value () const {
-  return m_value.data();
+  return text().c_str();
 }
 
 inline void cMimeField::value (const char* p_value) {
   m_value = p_value;
+  m_params.clear();
+  m_paramstate = PARAM_UNPARSED;
+  m_serial = mimeSerial();
+}
+
+inline void cMimeField::value (std::string&& p_value) {
+  m_value.swap(p_value);
+  m_params.clear();
+  m_paramstate = PARAM_UNPARSED;
+  m_serial = mimeSerial();
 }
 
 inline const char* cMimeField::charset () const {
@@ -120,29 +247,41 @@ inline const char* cMimeField::charset () const {
 
 inline void cMimeField::charset (const char* p_charset) {
   m_charset = p_charset;
+  m_serial = mimeSerial();
 }
 
 inline void cMimeField::clear() {
   m_name.clear();
   m_value.clear();
   m_charset.clear();
+  m_params.clear();
+  m_paramstate = PARAM_UNPARSED;
+  m_serial = mimeSerial();
 }
 
 /* cMimeHeader - Abstracts MIME body part headers */
 class cMimeHeader {
   public:
-    cMimeHeader() {}
+    cMimeHeader() : m_serial(0), m_liststamp(1) { m_ctcache.liststamp = 0; }
+    cMimeHeader(const cMimeHeader& p_header);
+    cMimeHeader(cMimeHeader&& p_header);
     virtual ~cMimeHeader() { clear(); }
 
+    cMimeHeader& operator=(cMimeHeader&& p_header);
+
   public:
+    // Same order as m_typetable
     enum media {
-      MEDIA_TEXT, MEDIA_MESSAGE, MEDIA_AUDIO, MEDIA_VIDEO, MEDIA_APPLICATION,
-      MEDIA_MULTIPART, MEDIA_UNKNOWN, MEDIA_IMAGE
+      MEDIA_TEXT, MEDIA_IMAGE, MEDIA_AUDIO, MEDIA_VIDEO, MEDIA_APPLICATION,
+      MEDIA_MULTIPART, MEDIA_MESSAGE, MEDIA_UNKNOWN
     };
 
     media mediaType() const;
 
     void field (const cMimeField& field);
+    void field (cMimeField&& field);
+    cMimeField& emplaceField (const char* p_fieldname, std::string&& p_value,
+      const char* p_charset=NULL);
     cMimeField* field (const char* p_fieldname);
     const cMimeField* field (const char* p_fieldname) const;
 
@@ -161,18 +300,18 @@ class cMimeHeader {
     const char* contentType () const;
     void contentType (const char* p_value, const char* p_charset=NULL);
 
-    std::string subType() const;
-    std::string mainType() const;
+    const std::string& subType() const;
+    const std::string& mainType() const;
 
-    std::string charset() const;
+    const std::string& charset() const;
     void charset (const char* p_charset);
 
-    std::string name () const;
+    const std::string& name () const;
     void name (const char* p_name);
 
-    std::string boundary() const;
+    const std::string& boundary() const;
     void boundary (const char* p_boundary=NULL);
-    std::string getBoundary() const;
+    const std::string& getBoundary() const;
 
     const char* transferEncoding() const;
     void transferEncoding (const char* p_value);
@@ -185,18 +324,30 @@ class cMimeHeader {
     const char* description() const;
     void description (const char* p_value, const char* p_charset=NULL);
 
+    // Fields added or erased through the list are only seen when that is
+    // done right after a call to fields()
     typedef std::list<cMimeField> cFieldList;
-    cFieldList& fields() { return m_listfields; }
+    cFieldList& fields() { invalidateContentType(); return m_listfields; }
+    const cFieldList& fields() const { return m_listfields; }
+
+    size_t headerMemory() const;
+    void resolveFields();
+
+    // Latest modification stamp of the header or any of its fields
+    unsigned long serial() const;
 
     // Overrides
     virtual void clear();
-    virtual int getLength() const;
+    virtual size_t getLength() const;
     // Serialization 
-    virtual int store (char* p_data, int p_maxsize) const;
-    virtual int load (const char* p_data, int p_datasize);
+    virtual ssize_t store (char* p_data, size_t p_maxsize) const;
+    virtual ssize_t load (const char* p_data, size_t p_datasize);
 
   protected:
     std::list<cMimeField> m_listfields;
+    unsigned long m_serial;
+    void touch() { m_serial = mimeSerial(); }
+
     std::list<cMimeField>::const_iterator 
       findField(const char* p_fieldname) const;
     std::list<cMimeField>::iterator findField(const char* p_fieldname);
@@ -209,10 +360,58 @@ class cMimeHeader {
     static const mediaTypeCVT m_typecvttable[];
     static const char* m_typetable[];
 
+    /* Content-Type parsed once and kept until the field list or the field
+     * is modified. The list stamp and field serial identify what was parsed.
+     */
+    struct contentTypeCache {
+      unsigned long liststamp;
+      const cMimeField* field;
+      unsigned long serial;
+      media mediatype;
+      std::string maintype;
+      std::string subtype;
+      std::string charset;
+      std::string boundary;
+      std::string name;
+    };
+    mutable contentTypeCache m_ctcache;
+
+    const contentTypeCache& contentTypeInfo() const;
+    void parseContentType() const;
+    // Bumped whenever the field list changes, which is also a modification
+    unsigned long m_liststamp;
+    void invalidateContentType() { m_liststamp++; touch(); }
+
   private:
     cMimeHeader& operator=(const cMimeHeader&);
 };
 
+inline cMimeHeader::cMimeHeader (const cMimeHeader& p_header) :
+  m_listfields(p_header.m_listfields),
+  m_serial(p_header.m_serial),
+  m_liststamp(1) {
+  m_ctcache.liststamp = 0;
+}
+
+inline cMimeHeader::cMimeHeader (cMimeHeader&& p_header) :
+  m_listfields(std::move(p_header.m_listfields)),
+  m_serial(p_header.m_serial),
+  m_liststamp(1) {
+  m_ctcache.liststamp = 0;
+  p_header.m_listfields.clear();
+  p_header.invalidateContentType();
+}
+
+inline cMimeHeader& cMimeHeader::operator= (cMimeHeader&& p_header) {
+  if (this != &p_header) {
+    m_listfields.swap(p_header.m_listfields);
+    p_header.m_listfields.clear();
+    invalidateContentType();
+    p_header.invalidateContentType();
+  }
+  return *this;
+}
+
 /* cMimeHeader::field() - Add or update a field */
 inline void cMimeHeader::field (const cMimeField& field) {
   std::list<cMimeField>::iterator it = findField(field.name());
@@ -220,7 +419,35 @@ inline void cMimeHeader::field (const cMimeField& field) {
     *it = field;
   } else {
     m_listfields.push_back(field);
+    invalidateContentType();
+  }
+}
+
+inline void cMimeHeader::field (cMimeField&& field) {
+  std::list<cMimeField>::iterator it = findField(field.name());
+  if (it != m_listfields.end()) {
+    *it = std::move(field);
+  } else {
+    m_listfields.push_back(std::move(field));
+    invalidateContentType();
+  }
+}
+
+/* cMimeHeader::emplaceField() - Add or update a field in place, taking the
+ * value text without a copy
+ */
+inline cMimeField& cMimeHeader::emplaceField (const char* p_fieldname,
+    std::string&& p_value, const char* p_charset) {
+  std::list<cMimeField>::iterator it = findField(p_fieldname);
+  if (it == m_listfields.end()) {
+    m_listfields.push_back(cMimeField());
+    it = --m_listfields.end();
+    it->name(p_fieldname);
+    invalidateContentType();
   }
+  it->value(std::move(p_value));
+  it->charset(p_charset != NULL ? p_charset : "");
+  return *it;
 }
 
 /* cMimeHeader::field() - Find a field by name */
@@ -241,13 +468,7 @@ inline cMimeField* cMimeHeader::field (const char* p_fieldname) {
 /* cMimeHeader::fieldValue - Add or update a field with a value */
 inline void cMimeHeader::fieldValue (const char* p_fieldname,
   const char* p_fieldvalue, const char* p_charset) {
-  cMimeField fd;
-  fd.name(p_fieldname);
-  fd.value(p_fieldvalue);
-
-  if (p_charset != NULL)
-    fd.charset(p_charset);
-  field(fd);
+  emplaceField(p_fieldname, std::string(p_fieldvalue), p_charset);
 }
 
 inline const char* cMimeHeader::fieldValue (const char* p_fieldname) const {
@@ -304,21 +525,44 @@ inline const char* cMimeHeader::contentType () const {
   return fieldValue(cMimeConst::contentType());
 }
 
+/* cMimeHeader::contentTypeInfo - Parsed Content-Type, reparsed only when the
+ * field has changed since the last call
+ */
+inline const cMimeHeader::contentTypeCache& 
+    cMimeHeader::contentTypeInfo() const {
+  if (m_ctcache.liststamp != m_liststamp || (m_ctcache.field != NULL &&
+      m_ctcache.field->serial() != m_ctcache.serial))
+    parseContentType();
+  return m_ctcache;
+}
+
+inline cMimeHeader::media cMimeHeader::mediaType() const {
+  return contentTypeInfo().mediatype;
+}
+
+inline const std::string& cMimeHeader::subType() const {
+  return contentTypeInfo().subtype;
+}
+
+inline const std::string& cMimeHeader::mainType() const {
+  return contentTypeInfo().maintype;
+}
+
 /* cMimeHeader::charset - Set/get charset parameter of a header field */
-inline std::string cMimeHeader::charset() const {
-  return parameter(cMimeConst::contentType(), cMimeConst::charset()); 
+inline const std::string& cMimeHeader::charset() const {
+  return contentTypeInfo().charset;
 }
 
-inline std::string cMimeHeader::name() const {
-  return parameter(cMimeConst::contentType(), cMimeConst::name()); 
+inline const std::string& cMimeHeader::name() const {
+  return contentTypeInfo().name;
 }
 
-inline std::string cMimeHeader::boundary() const {
-  return parameter(cMimeConst::contentType(), cMimeConst::boundary()); 
+inline const std::string& cMimeHeader::boundary() const {
+  return contentTypeInfo().boundary;
 }
 
-inline std::string cMimeHeader::getBoundary() const {
-  return parameter(cMimeConst::contentType(), cMimeConst::boundary());
+inline const std::string& cMimeHeader::getBoundary() const {
+  return contentTypeInfo().boundary;
 }
 
 inline void cMimeHeader::transferEncoding (const char* p_value) {
@@ -351,23 +595,120 @@ inline const char* cMimeHeader::description() const {
   return fieldValue(cMimeConst::contentDescription());
 }
 
+/* cMimeBuffer - Storage for body content. Content is kept on the heap, or
+ * adopted from the caller, up to cMimeEnvironment::spillThreshold(). Larger
+ * buffers live in an unlinked temporary file, mapped for as long as the
+ * buffer holds it, whose pages the kernel can drop and read back.
+ */
+class cMimeBuffer {
+  public:
+    cMimeBuffer() : m_data(NULL), m_size(0) {}
+
+    unsigned char* data() const;
+    size_t size() const { return m_size; }
+    bool spilled() const { return m_file != NULL; }
+
+    bool allocate (size_t p_size);
+    void adopt (unsigned char* p_data, size_t p_size,
+      const std::shared_ptr<void>& p_owner);
+    // Set the size of the content written so far, the byte after it is
+    // kept for a terminator
+    void truncate (size_t p_size);
+    void clear();
+
+    size_t read (size_t p_offset, void* p_output, size_t p_size) const;
+    bool write (int p_file) const;
+
+  private:
+    struct spillFile;
+
+    unsigned char* m_data;
+    size_t m_size;
+    std::shared_ptr<void> m_owner;
+    std::shared_ptr<spillFile> m_file;
+
+    unsigned char* fileData() const;
+};
+
+inline unsigned char* cMimeBuffer::data() const {
+  return m_file != NULL ? fileData() : m_data;
+}
+
 /* cMimeBody - Abstract for MIME message payloads */
 class cMimeMessage;
+class cMimeContext;
+
+/* cMimeSegments - A stored message as a list of byte ranges, for writev()
+ * or a send loop. Content that goes out as it is and cached encodings are
+ * referenced where they lie, everything else is coded into blocks the list
+ * owns. Referenced content must not change while the list is in use.
+ */
+class cMimeSegments {
+  public:
+    cMimeSegments() : m_size(0) {}
+
+    size_t size() const { return m_size; }
+    size_t count() const { return m_segments.size(); }
+    const unsigned char* data (size_t p_index) const { 
+      return m_segments[p_index].first;
+    }
+    size_t size (size_t p_index) const { return m_segments[p_index].second; }
+
+    // Write all the segments to an open file or socket
+    bool write (int p_file) const;
+    void clear();
+
+  private:
+    typedef std::pair<const unsigned char*, size_t> cSegment;
+    std::vector<cSegment> m_segments;
+    std::list<std::string> m_blocks;
+    std::vector<std::shared_ptr<const void> > m_owners;
+    size_t m_size;
+
+    void reference (const unsigned char* p_data, size_t p_size,
+      const std::shared_ptr<const void>& p_owner);
+    char* block (size_t p_size);
+    void shrink (size_t p_size);
+
+    friend class cMimeBody;
+};
 
 class cMimeBody : public cMimeHeader {
   protected:
-    cMimeBody() : m_text(NULL), m_textsize(0) {} 
+    cMimeBody() : m_loadbudget(NULL), m_loadowner(NULL), 
+      m_encodedserial(0), m_encodedstamp(0) {} 
+    cMimeBody(const cMimeBody& p_body);
+    cMimeBody(cMimeBody&& p_body);
     virtual ~cMimeBody() { clear(); }
 
+    cMimeBody& operator=(cMimeBody&& p_body);
+
   public:
-    int contentLength() const;
+    // Failures returned by load() and store(), besides 0 for bad input
+    enum error { ERROR_FAILED = -1, ERROR_MEMORY_LIMIT = -2 };
+
+    size_t contentLength() const;
     const unsigned char* content() const;
 
+    // Set the transfer encoding that codes the content in the fewest bytes
+    // (see cMimeAutoEncoding), 8bit only if p_allow8bit. Returns its name.
+    const char* chooseTransferEncoding (bool p_allow8bit = false);
+
     // Operations on 'text' or 'message' media
     bool isText() const;
-    int payload (const char* p_text, int length=0);
-    int payload (char* p_text, int p_maxsize);
-    int payload (std::string& p_text);
+    ssize_t payload (const char* p_text, size_t length=0);
+    size_t payload (char* p_text, size_t p_maxsize);
+    size_t payload (std::string& p_text);
+    // The content converted from its charset to UTF-8, see cMimeCodeCharset
+    size_t utf8Payload (std::string& p_text);
+
+    // Payloads adopted without a copy. With no deleter the buffer is only
+    // referenced and must outlive the body.
+    typedef std::function<void (unsigned char*)> cBufferDeleter;
+    size_t payload (std::string&& p_text);
+    size_t payload (std::vector<unsigned char>&& p_data);
+    size_t payload (unsigned char* p_data, size_t p_size, 
+      const cBufferDeleter& p_deleter);
 
     // Operations on 'message' media
     bool isMessage() const;
@@ -389,51 +730,122 @@ class cMimeBody : public cMimeHeader {
     cMimeBody* findNextPart();
 
     typedef std::list<cMimeBody*> cBodyList;
+
+    /* Iteration over the direct parts that keeps no state in the body, so
+     * shared const bodies can be walked by several threads at once
+     */
+    class cPartIterator {
+      public:
+        cPartIterator(cBodyList::const_iterator p_it) : m_it(p_it) {}
+        const cMimeBody* operator*() const { return *m_it; }
+        cPartIterator& operator++() { ++m_it; return *this; }
+        bool operator==(const cPartIterator& p_it) const { 
+          return m_it == p_it.m_it; 
+        }
+        bool operator!=(const cPartIterator& p_it) const { 
+          return m_it != p_it.m_it; 
+        }
+      private:
+        cBodyList::const_iterator m_it;
+    };
+    cPartIterator partsBegin() const { return m_listbodies.begin(); }
+    cPartIterator partsEnd() const { return m_listbodies.end(); }
+    size_t partCount() const { return m_listbodies.size(); }
+
     int bodyPartList(cBodyList& p_list) const;
     int attachmentList(cBodyList& p_list) const;
 
+    // Memory of this part and its children, added up on each call by a
+    // walk of the tree that reads each field and buffer once: cheap next
+    // to loading or storing the parts, not for calling per field change
+    cMimeMemoryUsage memoryUsage() const;
+
+    /* Templates. clone() copies the part tree, sharing content buffers 
+     * with the original. cacheEncoding() encodes every leaf part once and 
+     * keeps the bytes, which getLength() and store() reuse for as long as
+     * the part and the context's settings are unchanged and which clones
+     * share. So a template with
+     * cached encodings can be cloned per recipient and only the parts an
+     * instance modifies are encoded again. Registered body part types
+     * should override clone().
+     */
+    virtual cMimeBody* clone() const;
+    void cacheEncoding();
+
     // Overrides
     virtual void clear();
-    virtual int getLength() const;
+    virtual size_t getLength() const;
     
     // Serialization
-    virtual int store (char* p_data, int p_maxsize) const;
-    virtual int load (const char* p_data, int p_datasize);
+    virtual ssize_t store (char* p_data, size_t p_maxsize) const;
+    virtual ssize_t load (const char* p_data, size_t p_datasize);
+
+    // Store as segments that reference content instead of copying it,
+    // see cMimeSegments. Returns the size or a failure.
+    ssize_t storeSegments (cMimeSegments& p_out) const;
 
   protected:
-    unsigned char* m_text;
-    int m_textsize;
+    cMimeBuffer m_text;
     cBodyList m_listbodies;
     cBodyList::iterator m_itfind;
 
-    bool allocateBuffer (int p_bufsize);
+    /* Running total of a load() in progress, shared by all the parts being
+     * loaded. Set only for the duration of a load with a memory limit.
+     */
+    struct loadBudget {
+      size_t limit;
+      size_t used;
+    };
+    loadBudget* m_loadbudget;
+    bool chargeLoad (size_t p_bytes);
+
+    // Keeps the input of a load() in progress alive, content that needs no
+    // decoding references it. Set only for the duration of such a load.
+    const std::shared_ptr<void>* m_loadowner;
+    void addMemoryUsage (cMimeMemoryUsage& p_usage) const;
+    void resolveAll();
+
+    // The cached encoding, for the part as it was at m_encodedserial and
+    // the context with m_encodedstamp
+    std::shared_ptr<const std::string> m_encoded;
+    unsigned long m_encodedserial;
+    unsigned long m_encodedstamp;
+    bool encodingCached() const;
+
+    bool allocateBuffer (size_t p_bufsize);
+    // Ops for cMimeEnvironment::withCoder() coding the content of a
+    // storeSegments() and a load()
+    struct segmentsStore;
+    struct contentLoad;
+    void adoptBuffer (unsigned char* p_data, size_t p_size, 
+      const std::shared_ptr<void>& p_owner);
     void freeBuffer();
 
-    friend class cMimeEnvironment;
+    friend class cMimeContext;
 };
 
-inline int cMimeBody::contentLength() const {
-  return m_textsize;
+inline size_t cMimeBody::contentLength() const {
+  return m_text.size();
 }
 
 inline const unsigned char* cMimeBody::content() const {
-  return m_text;
+  return m_text.data();
 }
 
 inline bool cMimeBody::isText() const {
-  return mediaType() == MEDIA_TEXT;
+  return contentTypeInfo().mediatype == MEDIA_TEXT;
 }
 
 inline bool cMimeBody::isMessage() const {
-  return mediaType() == MEDIA_MESSAGE;
+  return contentTypeInfo().mediatype == MEDIA_MESSAGE;
 }
 
 inline bool cMimeBody::isAttachment() const {
-  return name().size() > 0;
+  return !contentTypeInfo().name.empty();
 }
 
 inline bool cMimeBody::isMultipart() const {
-  return mediaType() == MEDIA_MULTIPART;
+  return contentTypeInfo().mediatype == MEDIA_MULTIPART;
 }
 
 inline cMimeBody* cMimeBody::findFirstPart() {
@@ -447,26 +859,83 @@ inline cMimeBody* cMimeBody::findNextPart() {
   return NULL;
 }
 
-inline bool cMimeBody::allocateBuffer (int bufsize) {
-  freeBuffer();
-  m_text = new unsigned char[bufsize];
-  if (!m_text) 
-    return false;
-  m_textsize = bufsize;
-  return true;
+inline bool cMimeBody::allocateBuffer (size_t bufsize) {
+  touch();
+  return m_text.allocate(bufsize);
+}
+
+/* cMimeBody::adoptBuffer - Use p_data as the content, kept alive by p_owner */
+inline void cMimeBody::adoptBuffer (unsigned char* p_data, size_t p_size,
+    const std::shared_ptr<void>& p_owner) {
+  touch();
+  m_text.adopt(p_data, p_size, p_owner);
 }
 
 inline void cMimeBody::freeBuffer() {
-  delete m_text;
-  m_text = NULL;
-  m_textsize = 0;
+  touch();
+  m_text.clear();
 }
 
+/* cMimePartIndex - Parts of a body tree by Content-ID, filename and media
+ * type. Content-IDs are looked up without angle brackets or a "cid:" 
+ * prefix, media types as lower case "type/subtype". When several parts 
+ * share a Content-ID or filename the first one in the tree wins. The index
+ * is a snapshot, rebuild it after adding or removing parts.
+ */
+class cMimePartIndex {
+  public:
+    cMimePartIndex() : m_size(0) {}
+    explicit cMimePartIndex(const cMimeBody& p_body) : m_size(0) { 
+      build(p_body); 
+    }
+
+    void build (const cMimeBody& p_body);
+    void clear();
+    size_t size() const { return m_size; }
+
+    const cMimeBody* contentId (const char* p_cid) const;
+    const cMimeBody* filename (const char* p_filename) const;
+    int mediaType (const char* p_mediatype, 
+      std::vector<const cMimeBody*>& p_list) const;
+
+  private:
+    typedef std::unordered_map<std::string, const cMimeBody*> cPartMap;
+    cPartMap m_contentids;
+    cPartMap m_filenames;
+    std::unordered_multimap<std::string, const cMimeBody*> m_mediatypes;
+    size_t m_size;
+
+    void add (const cMimeBody* p_bp);
+};
+
 class cMimeMessage : public cMimeBody {
   public:
-    cMimeMessage() { /*setVersion();*/ }
+    cMimeMessage() : m_memorylimit(0), m_indexparts(false) { 
+      /*setVersion();*/ 
+    }
+    // The index holds the root, so it is built again for the new one
+    cMimeMessage(cMimeMessage&& p_mm) : 
+      cMimeBody(std::move(p_mm)), m_memorylimit(p_mm.m_memorylimit),
+      m_indexparts(p_mm.m_indexparts) {
+      p_mm.m_partindex.clear();
+      if (m_indexparts)
+        m_partindex.build(*this);
+    }
     virtual ~cMimeMessage() { clear(); }
 
+    virtual cMimeMessage* clone() const { return new cMimeMessage(*this); }
+
+    cMimeMessage& operator=(cMimeMessage&& p_mm) {
+      cMimeBody::operator=(std::move(p_mm));
+      m_memorylimit = p_mm.m_memorylimit;
+      m_indexparts = p_mm.m_indexparts;
+      p_mm.m_partindex.clear();
+      m_partindex.clear();
+      if (m_indexparts)
+        m_partindex.build(*this);
+      return *this;
+    }
+
     const char* from() const;
     void from (const char* p_from, const char* p_charset=NULL);
 
@@ -487,6 +956,63 @@ class cMimeMessage : public cMimeBody {
     void date (int year, int month, int day, int hour, int minute, int second);
 
     void setVersion();
+
+    // Cap on the memory a load() may take, 0 for no limit. A load that
+    // would pass it stops early, clears the message and returns
+    // ERROR_MEMORY_LIMIT.
+    size_t memoryLimit() const { return m_memorylimit; }
+    void memoryLimit (size_t p_limit) { m_memorylimit = p_limit; }
+
+    // With indexing on, load() builds an index of the loaded parts. The 
+    // index is not kept up to date by later changes to the parts.
+    bool indexParts() const { return m_indexparts; }
+    void indexParts (bool p_index);
+    const cMimePartIndex& partIndex() const { return m_partindex; }
+
+    virtual void clear();
+    virtual ssize_t load (const char* p_data, size_t p_datasize);
+
+    // Load parts whose content goes as it is (binary, 8bit, unfolded 7bit)
+    // by reference to p_data, which p_owner keeps alive. With no owner
+    // p_data must outlive the message.
+    ssize_t load (const char* p_data, size_t p_datasize, 
+      const std::shared_ptr<void>& p_owner);
+
+    // Load and store by p_context rather than the calling thread's one,
+    // see cMimeContext. Other calls go by the thread's context.
+    ssize_t load (const char* p_data, size_t p_datasize, 
+      const cMimeContext& p_context);
+    ssize_t load (const char* p_data, size_t p_datasize, 
+      const std::shared_ptr<void>& p_owner, const cMimeContext& p_context);
+    using cMimeBody::getLength;
+    size_t getLength (const cMimeContext& p_context) const;
+    using cMimeBody::store;
+    ssize_t store (char* p_data, size_t p_maxsize, 
+      const cMimeContext& p_context) const;
+    using cMimeBody::storeSegments;
+    ssize_t storeSegments (cMimeSegments& p_out, 
+      const cMimeContext& p_context) const;
+
+    /* Move the message into an immutable snapshot that any number of 
+     * threads may read at once without locking. Everything parsed lazily 
+     * is parsed up front, so const calls on the snapshot never write. Walk it with partsBegin()/partsEnd(),
+     * and don't register coders while it is being stored. This message
+     * is left empty.
+     */
+    std::shared_ptr<const cMimeMessage> freeze();
+
+  protected:
+    cMimeMessage(const cMimeMessage& p_mm) :
+      cMimeBody(p_mm), m_memorylimit(p_mm.m_memorylimit),
+      m_indexparts(p_mm.m_indexparts) {
+      if (m_indexparts)
+        m_partindex.build(*this);
+    }
+
+  private:
+    size_t m_memorylimit;
+    cMimePartIndex m_partindex;
+    bool m_indexparts;
 };
 
 inline void cMimeMessage::from (const char* p_addr, const char* p_charset) {
@@ -526,7 +1052,7 @@ inline void cMimeMessage::subject (const char* p_subj, const char* p_charset) {
 }
 
 inline const char* cMimeMessage::subject () const {
-  fieldValue("Subject");
+  return fieldValue("Subject");
 }
 
 inline const char* cMimeMessage::date() const {
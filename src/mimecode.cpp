@@ -14,412 +14,882 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
+#include <atomic>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <thread>
+#include <vector>
+
 #include "mimecode.h"
 #include "mimechar.h"
+#include "mimepool.h"
+#include "mimesimd.h"
 #include "mime.h"
 
-bool cMimeEnvironment::m_autofolding = false;
-std::string cMimeEnvironment::m_charset;
-std::list<cMimeEnvironment::CODER_PAIR> cMimeEnvironment::m_listcoders;
-std::list<cMimeEnvironment::FIELD_CODER_PAIR> cMimeEnvironment::m_listfieldcoders;
-std::list<cMimeEnvironment::MEDIA_TYPE_PAIR> cMimeEnvironment::m_listmediatypes;
-cMimeEnvironment cMimeEnvironment::m_globalmanager;
+cMimeContext cMimeEnvironment::m_global;
 
-cMimeEnvironment::cMimeEnvironment() {
-  REGISTER_MIMECODER("quoted-printable",      cMimeCodeQP);
-  REGISTER_MIMECODER("base64",                cMimeCodeBase64);
+// Context made current in this thread by a cMimeContext::scope
+static thread_local const cMimeContext* s_context = NULL;
 
-  // initialize header fields encoding
-  REGISTER_FIELDCODER("Subject",              cFieldCodeText);
-  REGISTER_FIELDCODER("Comments",             cFieldCodeText);
-  REGISTER_FIELDCODER("Content-Description",  cFieldCodeText);
-
-  REGISTER_FIELDCODER("From",                 cFieldCodeAddress);
-  REGISTER_FIELDCODER("To",                   cFieldCodeAddress);
-  REGISTER_FIELDCODER("Resent-To",            cFieldCodeAddress);
-  REGISTER_FIELDCODER("Cc",                   cFieldCodeAddress);
-  REGISTER_FIELDCODER("Resent-Cc",            cFieldCodeAddress);
-  REGISTER_FIELDCODER("Bcc",                  cFieldCodeAddress);
-  REGISTER_FIELDCODER("Resent-Bcc",           cFieldCodeAddress);
-  REGISTER_FIELDCODER("Reply-To",             cFieldCodeAddress);
-  REGISTER_FIELDCODER("Resent-Reply-To",      cFieldCodeAddress);
-
-  REGISTER_FIELDCODER("Content-Type",         cFieldCodeParameter);
-  REGISTER_FIELDCODER("Content-Disposition",  cFieldCodeParameter);
-};
+const cMimeContext& cMimeEnvironment::context () {
+  return s_context != NULL ? *s_context : m_global;
+}
 
 bool cMimeEnvironment::autoFolding () {
-  return m_autofolding;
+  return context().autoFolding();
 }
 
 void cMimeEnvironment::autoFolding (bool b_autofolding) {
-  m_autofolding = b_autofolding;
-  if (!b_autofolding) {
-    DEREGISTER_MIMECODER("7bit");
-    DEREGISTER_MIMECODER("8bit");
-  } else {
-    REGISTER_MIMECODER("7bit", cMimeCode7bit);
-    REGISTER_MIMECODER("8bit", cMimeCode7bit);
-  }
+  m_global.autoFolding(b_autofolding);
 }
 
 const char* cMimeEnvironment::globalCharset () {
-  return m_charset.c_str();
+  return context().globalCharset();
 }
 
 void cMimeEnvironment::globalCharset (const char* p_charset) {
-  m_charset = p_charset;
+  m_global.globalCharset(p_charset);
+}
+
+size_t cMimeEnvironment::spillThreshold () {
+  return context().spillThreshold();
+}
+
+void cMimeEnvironment::spillThreshold (size_t p_threshold) {
+  m_global.spillThreshold(p_threshold);
+}
+
+const char* cMimeEnvironment::spillDirectory () {
+  return context().spillDirectory();
+}
+
+void cMimeEnvironment::spillDirectory (const char* p_directory) {
+  m_global.spillDirectory(p_directory);
+}
+
+int cMimeEnvironment::simdLevel () {
+  return context().simdLevel();
+}
+
+void cMimeEnvironment::simdLevel (int p_level) {
+  m_global.simdLevel(p_level);
+}
+
+size_t cMimeEnvironment::parallelThreshold () {
+  return context().parallelThreshold();
+}
+
+void cMimeEnvironment::parallelThreshold (size_t p_threshold) {
+  m_global.parallelThreshold(p_threshold);
+}
+
+unsigned cMimeEnvironment::codingThreads () {
+  return context().codingThreads();
+}
+
+void cMimeEnvironment::codingThreads (unsigned p_threads) {
+  m_global.codingThreads(p_threads);
+}
+
+cMimeCodeBase* cMimeEnvironment::registerCoder (const char* p_codingname) {
+  return context().registerCoder(p_codingname);
 }
 
 void cMimeEnvironment::registerCoder (const char* p_codingname, 
     CODER_BUILD p_createobject) {
-  ASSERT(p_codingname != NULL);
-  std::list<CODER_PAIR>::iterator it = m_listcoders.begin();
+  m_global.registerCoder(p_codingname, p_createobject);
+}
 
-  while (it != m_listcoders.end()) {
-    std::list<CODER_PAIR>::iterator it2 = it;
-    it++;
-    if (!strcmp(p_codingname, (*it2).first)) {
-      m_listcoders.erase(it2);
-    }
-  }
-  
-  if (p_createobject != NULL) {
-    CODER_PAIR newPair(p_codingname, p_createobject);
-    m_listcoders.push_front(newPair);
+bool cMimeEnvironment::passthrough (const char* p_codingname) {
+  return context().passthrough(p_codingname);
+}
+
+int cMimeEnvironment::coderKind (const char* p_codingname) {
+  return context().coderKind(p_codingname);
+}
+
+cFieldCodeBase* cMimeEnvironment::registerFieldCoder (const char* p_fieldname) {
+  return context().registerFieldCoder(p_fieldname);
+}
+
+void cMimeEnvironment::registerFieldCoder (const char* p_fieldname, 
+    FIELD_CODER_BUILD p_createobject) {
+  m_global.registerFieldCoder(p_fieldname, p_createobject);
+}
+
+int cMimeEnvironment::fieldCoderKind (const char* p_fieldname) {
+  return context().fieldCoderKind(p_fieldname);
+}
+
+cMimeBody* cMimeEnvironment::createBodyPart (const char* p_mediatype) {
+  return context().createBodyPart(p_mediatype);
+}
+
+void cMimeEnvironment::registerMediaType (const char* p_mediatype, 
+    BODY_PART_BUILD p_createobject) {
+  m_global.registerMediaType(p_mediatype, p_createobject);
+}
+
+// Source of the stamps, shared by all contexts
+static std::atomic<unsigned long> s_stamps(0);
+
+cMimeContext::cMimeContext() :
+  m_stamp(++s_stamps),
+  m_autofolding(false),
+  m_spillthreshold(0),
+  m_simdlevel(cMimeSimd::LEVEL_AVX512),
+  m_parallelthreshold(4 << 20),
+  m_codingthreads(0) {
+  registerCoder("quoted-printable",           cMimeCodeQP::createObject);
+  registerCoder("base64",                     cMimeCodeBase64::createObject);
+
+  // initialize header fields encoding
+  registerFieldCoder("Subject",              cFieldCodeText::createObject);
+  registerFieldCoder("Comments",             cFieldCodeText::createObject);
+  registerFieldCoder("Content-Description",  cFieldCodeText::createObject);
+
+  registerFieldCoder("From",                 cFieldCodeAddress::createObject);
+  registerFieldCoder("To",                   cFieldCodeAddress::createObject);
+  registerFieldCoder("Resent-To",            cFieldCodeAddress::createObject);
+  registerFieldCoder("Cc",                   cFieldCodeAddress::createObject);
+  registerFieldCoder("Resent-Cc",            cFieldCodeAddress::createObject);
+  registerFieldCoder("Bcc",                  cFieldCodeAddress::createObject);
+  registerFieldCoder("Resent-Bcc",           cFieldCodeAddress::createObject);
+  registerFieldCoder("Reply-To",             cFieldCodeAddress::createObject);
+  registerFieldCoder("Resent-Reply-To",      cFieldCodeAddress::createObject);
+
+  registerFieldCoder("Content-Type",
+    cFieldCodeParameter::createObject);
+  registerFieldCoder("Content-Disposition",
+    cFieldCodeParameter::createObject);
+}
+
+void cMimeContext::changed () {
+  m_stamp = ++s_stamps;
+}
+
+cMimeContext::scope::scope (const cMimeContext& p_context) :
+  m_previous(s_context) {
+  s_context = &p_context;
+}
+
+cMimeContext::scope::~scope () {
+  s_context = m_previous;
+}
+
+/* cMimeContext::autoFolding - 7bit and 8bit content is only coded when it
+ * is to be folded
+ */
+void cMimeContext::autoFolding (bool b_autofolding) {
+  changed();
+  m_autofolding = b_autofolding;
+  if (!b_autofolding) {
+    registerCoder("7bit", NULL);
+    registerCoder("8bit", NULL);
+  } else {
+    registerCoder("7bit", cMimeCode7bit::createObject);
+    registerCoder("8bit", cMimeCode7bit::createObject);
   }
 }
 
-cMimeCodeBase* cMimeEnvironment::registerCoder (const char* p_codename) {
+void cMimeContext::globalCharset (const char* p_charset) {
+  changed();
+  m_charset = p_charset;
+}
+
+void cMimeContext::spillThreshold (size_t p_threshold) {
+  changed();
+  m_spillthreshold = p_threshold;
+}
+
+/* cMimeContext::spillDirectory - TMPDIR, or /tmp, unless one was set */
+const char* cMimeContext::spillDirectory () const {
+  if (!m_spilldirectory.empty())
+    return m_spilldirectory.c_str();
+  const char* p_directory = getenv("TMPDIR");
+  return p_directory != NULL && *p_directory ? p_directory : "/tmp";
+}
+
+void cMimeContext::spillDirectory (const char* p_directory) {
+  changed();
+  m_spilldirectory = p_directory != NULL ? p_directory : "";
+}
+
+void cMimeContext::simdLevel (int p_level) {
+  changed();
+  m_simdlevel = p_level;
+}
+
+void cMimeContext::parallelThreshold (size_t p_threshold) {
+  changed();
+  m_parallelthreshold = p_threshold;
+}
+
+unsigned cMimeContext::codingThreads () const {
+  if (m_codingthreads > 0)
+    return m_codingthreads;
+  unsigned threads = std::thread::hardware_concurrency();
+  return threads > 0 ? threads : 1;
+}
+
+void cMimeContext::codingThreads (unsigned p_threads) {
+  changed();
+  m_codingthreads = p_threads;
+}
+
+/* cMimeContext::caselessHash - FNV-1a of the name folded to lower
+ * case, folding other bytes too only costs a rare collision
+ */
+size_t cMimeContext::caselessHash::operator() (const std::string& p_name) 
+    const {
+  size_t hash = 2166136261u;
+  for (size_t i = 0; i < p_name.size(); i++)
+    hash = (hash ^ (unsigned char)(p_name[i] | 0x20)) * 16777619u;
+  return hash;
+}
+
+const std::string& cMimeContext::lookupKey (const char* p_name) {
+  static thread_local std::string s_key;
+  s_key.assign(p_name);
+  return s_key;
+}
+
+void cMimeContext::registerCoder (const char* p_codingname, 
+    cMimeEnvironment::CODER_BUILD p_createobject) {
+  ASSERT(p_codingname != NULL);
+  changed();
+  m_coders.erase(lookupKey(p_codingname));
+  if (p_createobject == NULL)
+    return;
+
+  registryEntry<cMimeEnvironment::CODER_BUILD> entry = { p_createobject,
+    cMimeEnvironment::CODER_CUSTOM };
+  if (p_createobject == cMimeCodeQP::createObject)
+    entry.kind = cMimeEnvironment::CODER_QP;
+  else if (p_createobject == cMimeCodeBase64::createObject)
+    entry.kind = cMimeEnvironment::CODER_BASE64;
+  else if (p_createobject == cMimeCode7bit::createObject)
+    entry.kind = cMimeEnvironment::CODER_7BIT;
+  else if (p_createobject == cMimeCodeCopy::createObject)
+    entry.kind = cMimeEnvironment::CODER_COPY;
+  m_coders[p_codingname] = entry;
+}
+
+cMimeCodeBase* cMimeContext::registerCoder (const char* p_codename) const {
   if (!p_codename || !strlen(p_codename)) {
     p_codename = "7bit";
   }
 
-  for (std::list<CODER_PAIR>::iterator it=m_listcoders.begin();
-      it!=m_listcoders.end(); it++) {
-    ASSERT((*it).first != NULL);
-    if (!strcmp(p_codename, (*it).first)) {
-      CODER_BUILD p_createobject = (*it).second;
-      ASSERT(p_createobject != NULL);
-      return p_createobject();
-    }
-  }
-  return new cMimeCodeBase;
+  CODER_MAP::const_iterator it = m_coders.find(lookupKey(p_codename));
+  if (it == m_coders.end())
+    return new cMimeCodeCopy;
+  ASSERT(it->second.build != NULL);
+  return it->second.build();
 }
 
-void cMimeEnvironment::registerFieldCoder(const char* p_fieldname,
-    FIELD_CODER_BUILD p_createobject) {
- ASSERT(p_fieldname != NULL);
-  std::list<FIELD_CODER_PAIR>::iterator it = m_listfieldcoders.begin();
-  while (it != m_listfieldcoders.end()) {
-    std::list<FIELD_CODER_PAIR>::iterator it2 = it;
-    it++;
-    if (!strcmp(p_fieldname, (*it2).first))
-      m_listfieldcoders.erase(it2);
-  }
-  if (p_createobject != NULL) {
-    FIELD_CODER_PAIR newPair(p_fieldname, p_createobject);
-    m_listfieldcoders.push_front(newPair);
-  }
+int cMimeContext::coderKind (const char* p_codingname) const {
+  if (!p_codingname || !*p_codingname)
+    p_codingname = "7bit";
+  CODER_MAP::const_iterator it = m_coders.find(lookupKey(p_codingname));
+  return it != m_coders.end() ? it->second.kind : 
+    cMimeEnvironment::CODER_COPY;
+}
+
+bool cMimeContext::passthrough (const char* p_codingname) const {
+  if (!p_codingname || !*p_codingname)
+    p_codingname = "7bit";
+  return m_coders.find(lookupKey(p_codingname)) == m_coders.end();
+}
+
+void cMimeContext::registerFieldCoder(const char* p_fieldname,
+    cMimeEnvironment::FIELD_CODER_BUILD p_createobject) {
+  ASSERT(p_fieldname != NULL);
+  changed();
+  m_fieldcoders.erase(lookupKey(p_fieldname));
+  if (p_createobject == NULL)
+    return;
+
+  registryEntry<cMimeEnvironment::FIELD_CODER_BUILD> entry = { 
+    p_createobject, cMimeEnvironment::FIELD_CODER_CUSTOM };
+  if (p_createobject == cFieldCodeText::createObject)
+    entry.kind = cMimeEnvironment::FIELD_CODER_TEXT;
+  else if (p_createobject == cFieldCodeAddress::createObject)
+    entry.kind = cMimeEnvironment::FIELD_CODER_ADDRESS;
+  else if (p_createobject == cFieldCodeParameter::createObject)
+    entry.kind = cMimeEnvironment::FIELD_CODER_PARAMETER;
+  m_fieldcoders[p_fieldname] = entry;
 }
  
-cFieldCodeBase* cMimeEnvironment::registerFieldCoder(const char* p_fieldname) {
+cFieldCodeBase* cMimeContext::registerFieldCoder (const char* p_fieldname) 
+    const {
   ASSERT(p_fieldname != NULL);
-  for (std::list<FIELD_CODER_PAIR>::iterator it=m_listfieldcoders.begin(); 
-      it!=m_listfieldcoders.end(); it++) {
-    ASSERT((*it).first != NULL);
-    if (!strcmp(p_fieldname, (*it).first)) {
-      FIELD_CODER_BUILD p_createobject = (*it).second;
-      ASSERT(p_createobject != NULL);
-      return p_createobject();
-    }
-  }
-  return new cFieldCodeBase;    // default coder for unregistered header fields
+  FIELD_CODER_MAP::const_iterator it = 
+    m_fieldcoders.find(lookupKey(p_fieldname));
+  if (it == m_fieldcoders.end())
+    return new cFieldCodeBase;  // default coder for unregistered header fields
+  ASSERT(it->second.build != NULL);
+  return it->second.build();
 }
 
-void cMimeEnvironment::registerMediaType (const char* p_mediatype, 
-    BODY_PART_BUILD p_createobject) {
+int cMimeContext::fieldCoderKind (const char* p_fieldname) const {
+  ASSERT(p_fieldname != NULL);
+  FIELD_CODER_MAP::const_iterator it = 
+    m_fieldcoders.find(lookupKey(p_fieldname));
+  return it != m_fieldcoders.end() ? it->second.kind : 
+    cMimeEnvironment::FIELD_CODER_BASE;
+}
+
+void cMimeContext::registerMediaType (const char* p_mediatype, 
+    cMimeEnvironment::BODY_PART_BUILD p_createobject) {
   ASSERT(p_mediatype != NULL);
-  std::list<MEDIA_TYPE_PAIR>::iterator it = m_listmediatypes.begin();
-  while (it != m_listmediatypes.end()) {
-    std::list<MEDIA_TYPE_PAIR>::iterator it2 = it;
-    it++;
-    if (!strcmp(p_mediatype, (*it2).first))
-      m_listmediatypes.erase(it2);
-  }
-  if (p_createobject != NULL) {
-    MEDIA_TYPE_PAIR newPair(p_mediatype, p_createobject);
-    m_listmediatypes.push_front(newPair);
-  }
+  changed();
+  m_mediatypes.erase(lookupKey(p_mediatype));
+  if (p_createobject != NULL)
+    m_mediatypes[p_mediatype] = p_createobject;
 }
 
-cMimeBody* cMimeEnvironment::createBodyPart (const char* p_mediatype) {
+cMimeBody* cMimeContext::createBodyPart (const char* p_mediatype) const {
   if (!p_mediatype || !::strlen(p_mediatype))
     p_mediatype = "text";
 
-  ASSERT(p_mediatype != NULL);
-  for (std::list<MEDIA_TYPE_PAIR>::iterator it=m_listmediatypes.begin(); 
-    it!=m_listmediatypes.end(); it++) {
-    ASSERT((*it).first != NULL);
-    if (!strcmp(p_mediatype, (*it).first)) {
-      BODY_PART_BUILD p_createobject = (*it).second;
-      ASSERT(p_createobject != NULL);
-      return p_createobject();
-    }
-  }
-  return new cMimeBody;     // default body part for unregistered media type
+  MEDIA_TYPE_MAP::const_iterator it = 
+    m_mediatypes.find(lookupKey(p_mediatype));
+  if (it == m_mediatypes.end())
+    return new cMimeBody;   // default body part for unregistered media type
+  ASSERT(it->second != NULL);
+  return it->second();
 }
 
 cMimeCodeBase::cMimeCodeBase() : 
   m_input(NULL),
   m_inputsize(0),
-  m_isencoding(false) {}
+  m_isencoding(false),
+  m_streaming(false),
+  m_final(false),
+  m_streamoffset(0),
+  m_streamsize(0) {}
 
-void cMimeCodeBase::setInput (const char* p_input, int p_inputsize,
+void cMimeCodeBase::setInput (const char* p_input, size_t p_inputsize,
     bool p_encoding) {
   m_input = (const unsigned char*)p_input;
   m_inputsize = p_inputsize;
   m_isencoding = p_encoding;
+  m_streaming = false;
+  m_streamoffset = 0;
+  m_streamsize = p_inputsize;
+  m_pending.clear();
 }
 
-int cMimeCodeBase::getOutputLength () const {
+size_t cMimeCodeBase::getOutputLength () const {
   return m_isencoding ? getEncodeLength() : getDecodeLength();
 }
 
-int cMimeCodeBase::getOutput (unsigned char* p_output, int p_maxsize) {
-  return m_isencoding ? encode(p_output, p_maxsize) :
+ssize_t cMimeCodeBase::getOutput (unsigned char* p_output, size_t p_maxsize) {
+  ssize_t size = m_isencoding ? encode(p_output, p_maxsize) :
     decode(p_output, p_maxsize);
+  if (m_streaming) {
+    // drop the input that was coded
+    streamAdvance(m_inputsize);
+    m_pending.erase(0, m_inputsize);
+    m_streamoffset += m_inputsize;
+    m_input = (const unsigned char*)m_pending.data();
+    m_inputsize = 0;
+    m_streamsize = m_pending.size();
+  }
+  return size;
+}
+
+void cMimeCodeBase::begin (bool p_encoding) {
+  setInput(NULL, 0, p_encoding);
+  m_streaming = true;
+  m_final = false;
+}
+
+/* cMimeCodeBase::update - Add a chunk to the input kept from earlier ones
+ * and make the part of it that can be coded now the input
+ */
+void cMimeCodeBase::update (const char* p_input, size_t p_inputsize) {
+  ASSERT(m_streaming && !m_final);
+  m_pending.append(p_input, p_inputsize);
+  m_input = (const unsigned char*)m_pending.data();
+  m_inputsize = m_streamsize = m_pending.size();
+  m_inputsize = streamPrefix();
 }
 
-int cMimeCodeBase::getEncodeLength() const {
+void cMimeCodeBase::finish () {
+  ASSERT(m_streaming);
+  m_final = true;
+  m_input = (const unsigned char*)m_pending.data();
+  m_inputsize = m_streamsize = m_pending.size();
+}
+
+size_t cMimeCodeBase::streamPrefix () const {
   return m_inputsize;
 }
 
-int cMimeCodeBase::getDecodeLength() const {
+void cMimeCodeBase::streamAdvance (size_t) {}
+
+size_t cMimeCodeBase::getEncodeLength() const {
   return m_inputsize;
 }
 
-int cMimeCodeBase::encode(unsigned char* p_output,int p_maxsize) const {
-  int size = std::min(p_maxsize, m_inputsize);
+size_t cMimeCodeBase::getDecodeLength() const {
+  return m_inputsize;
+}
+
+ssize_t cMimeCodeBase::encode(unsigned char* p_output, size_t p_maxsize) const {
+  size_t size = std::min(p_maxsize, m_inputsize);
   memcpy(p_output, m_input, size);
   return size;
 }
 
-int cMimeCodeBase::decode(unsigned char* p_output,int p_maxsize) {
+ssize_t cMimeCodeBase::decode(unsigned char* p_output, size_t p_maxsize) {
   return cMimeCodeBase::encode(p_output, p_maxsize);
 }
 
 /* cMimeCode7bit */
-int cMimeCode7bit::getEncodeLength() const {
-  int size = m_inputsize + m_inputsize / MAX_MIME_LINE_LEN * 4;
-  size += 4;
-  return size;
-}
-
-int cMimeCode7bit::encode(unsigned char* p_output, int p_maxsize) const {
-  const unsigned char* p_data = m_input;
-  const unsigned char* p_end = m_input + m_inputsize;
-  unsigned char* p_outstart = p_output;
-  unsigned char* p_outend = p_output + p_maxsize;
-  unsigned char* p_space = NULL;
-  int linelen = 0;
-  while (p_data < p_end) {
-    if (p_output >= p_outend)
-      break;
+// cMimeFold
+cMimeFold::cMimeFold (size_t p_maxline) : m_maxline(p_maxline) {}
 
-    unsigned char ch = *p_data;
-    if (ch == '\r' || ch == '\n')
-    {
-      linelen = -1;
-      p_space = NULL;
+/* cMimeFold::fold - A line at least m_maxline long is folded at its last
+ * white space, or at the first one to come if it has none yet. Input up to
+ * the fold point is copied when the point moves on, the rest waits.
+ */
+size_t cMimeFold::fold (const unsigned char* p_input, size_t p_size, 
+    unsigned char* p_output, size_t p_maxsize) const {
+  const size_t none = (size_t)-1;
+  size_t output = 0, copied = 0, start = 0;
+  size_t point = none;
+
+  for (size_t i = 0; i < p_size; i++) {
+    unsigned char ch = p_input[i];
+    if (ch == '\r' || ch == '\n') {
+      start = i + 1;
+      point = none;
+      continue;
     }
-    else if (linelen > 0 && cMimeChar::isSpace(ch))
-      p_space = p_output;
 
-    // fold the line if it's longer than 76
-    if (linelen >= MAX_MIME_LINE_LEN && p_space != NULL &&
-      p_output+2 <= p_outend)
-    {
-      int size = (int)(p_output - p_space);
-      ::memmove(p_space+2, p_space, size);
-      *p_space++ = '\r';
-      *p_space = '\n';
-      p_space = NULL;
-      linelen = size;
-      p_output += 2;
+    size_t col = i - start;
+    if (col > 0 && cMimeChar::isSpace(ch))
+      point = i;
+    if (col >= m_maxline && point != none) {
+      size_t size = point - copied + 2;
+      if (p_output != NULL) {
+        if (output + size > p_maxsize)
+          break;
+        memcpy(p_output + output, p_input + copied, point - copied);
+        memcpy(p_output + output + point - copied, "\r\n", 2);
+      }
+      output += size;
+      copied = start = point;
+      point = none;
     }
+  }
 
-    *p_output++ = ch;
-    p_data++;
-    linelen++;
+  size_t size = p_size - copied;
+  if (p_output != NULL) {
+    if (size > p_maxsize - output)
+      size = p_maxsize - output;
+    memcpy(p_output + output, p_input + copied, size);
+  }
+  return output + size;
+}
+
+size_t cMimeFold::unfold (const unsigned char* p_input, size_t p_size,
+    unsigned char* p_output) {
+  size_t output = 0;
+  for (size_t i = 0; i < p_size; ) {
+    if (p_input[i] == '\r' && i + 1 < p_size && p_input[i+1] == '\n') {
+      for (i += 2; i < p_size && cMimeChar::isSpace(p_input[i]); i++) {}
+      p_output[output++] = ' ';
+    } else {
+      p_output[output++] = p_input[i++];
+    }
   }
+  return output;
+}
+// end cMimeFold
+
+// cMimeCode7bit
+size_t cMimeCode7bit::getEncodeLength() const {
+  size_t size = m_inputsize + m_inputsize / MAX_MIME_LINE_LEN * 4;
+  size += 4;
+  return size;
+}
+
+/* cMimeCode7bit::streamPrefix - Lines are folded on their own, code up to
+ * the last line break
+ */
+size_t cMimeCode7bit::streamPrefix () const {
+  if (!m_isencoding) { return m_inputsize; }
+  size_t size = m_inputsize;
+  while (size > 0 && m_input[size-1] != '\r' && m_input[size-1] != '\n')
+    size--;
+  return size;
+}
 
-  return (int)(p_output - p_outstart);
+ssize_t cMimeCode7bit::encode(unsigned char* p_output, 
+    size_t p_maxsize) const {
+  return cMimeFold().fold(m_input, m_inputsize, p_output, p_maxsize);
 }
 // end cMimeCode7bit
 
 // cMimeCodeQP
 cMimeCodeQP::cMimeCodeQP() :
-  m_quotelinebreak(false) {}
+  m_quotelinebreak(false) {
+  m_before[0] = m_before[1] = 0;
+}
 
 void cMimeCodeQP::quoteLineBreak (bool p_quote) {
   m_quotelinebreak = p_quote;
 }
 
-int cMimeCodeQP::getEncodeLength() const {
-  int length = m_inputsize;
-  const unsigned char* p_data = m_input;
-  const unsigned char* p_end = m_input + m_inputsize;
-  while (p_data < p_end) {
-    if (!cMimeChar::isPrintable(*p_data++)) { length += 2; }
+/* cMimeCodeQP::planLine - Lay out the encoded line starting at input
+ * p_start before writing it, so a soft line break can go after the last
+ * space without moving output that was already written. Literal runs are
+ * found with cMimeSimd::qpLiteralRun(), only the bytes between them are
+ * looked at one by one.
+ */
+void cMimeCodeQP::planLine (size_t p_start, qpLine& p_line) const {
+  const size_t maxcol = MAX_MIME_LINE_LEN - 1;
+  const size_t inputsize = m_streamsize;
+  size_t pos = p_start;
+  size_t col = 0;
+  bool forcequote = false;
+
+  p_line.quotedcount = 0;
+  p_line.soft = false;
+
+  // A lone '.' on a line would be taken for SMTP's message end flag
+  if (!m_quotelinebreak && pos + 2 < inputsize && m_input[pos] == '.' &&
+      m_input[pos+1] == '\r' && m_input[pos+2] == '\n' && 
+      afterLineBreak(pos)) {
+    p_line.quoted[p_line.quotedcount++] = pos++;
+    col = 3;
   }
-  length += length / (MAX_MIME_LINE_LEN - 2) * 6;
-  return length;
-}
 
-int cMimeCodeQP::encode (unsigned char* p_output, int p_maxsize) const {
-  static const char* s_qptable = "0123456789ABCDEF";
-  const unsigned char* p_data = m_input;
-  const unsigned char* p_end = m_input + m_inputsize;
-  unsigned char* p_outstart = p_output;
-  unsigned char* p_outend = p_output + p_maxsize;
-  unsigned char* p_space = NULL;
-  int linelen = 0;
-  while (p_data < p_end) {
-    if (p_output >= p_outend) { break; }
+  size_t cut = 0;
+  while (pos < inputsize) {
+    size_t limit = maxcol - col + 1;
+    if (limit > inputsize - pos) { limit = inputsize - pos; }
+    size_t run = cMimeSimd::qpLiteralRun(m_input + pos, limit);
+    size_t next = pos + run;
 
-    unsigned char ch = *p_data;
-    bool b_quote = false, b_copy = false;
+    if (col + run > maxcol) {
+      cut = pos + maxcol - col;
+      break;
+    }
 
-    // According to RFC 2045, TAB and SPACE MAY be represented as 
-    // ASCII characters, but MUST NOT be so represented at the end of an 
-    // encoded line.
-    if (ch == '\t' || ch == ' ') {
-      if (p_data == p_end-1 || (!m_quotelinebreak && *(p_data+1) == '\r')) {
-        // quote the SPACE/TAB
-        b_quote = true;    
-      } else {
-        // copy the SPACE/TAB
-        b_copy = true;   
-      }
-      if (linelen > 0) {
-        p_space = (unsigned char*) p_output;
-      }
-    } else if (!m_quotelinebreak && (ch == '\r' || ch == '\n')) {
+    // According to RFC 2045, TAB and SPACE MAY be represented as ASCII
+    // characters, but MUST NOT be so represented at the end of an encoded
+    // line.
+    if (run > 0 && (m_input[next-1] == ' ' || m_input[next-1] == '\t') &&
+        (next == inputsize || 
+         (!m_quotelinebreak && m_input[next] == '\r'))) {
+      run--;
+      next--;
+      forcequote = true;
+    }
+    col += run;
+    pos = next;
+    if (pos == inputsize) { break; }
+
+    unsigned char ch = m_input[pos];
+    if (!forcequote && !m_quotelinebreak && (ch == '\r' || ch == '\n')) {
       // keep 'hard' line break
-      b_copy = true;     
-      linelen = -1;
-      p_space = NULL;
-    } else if (!m_quotelinebreak && ch == '.') {
-      if (p_data-m_input >= 2 &&
-        *(p_data-2) == '\r' && *(p_data-1) == '\n' &&
-        *(p_data+1) == '\r' && *(p_data+2) == '\n') {
-        // avoid confusing with SMTP's message end flag
-        b_quote = true;    
-      } else {
-        b_copy = true;
-      }
-    } else if (ch < 33 || ch > 126 || ch == '=') {
-      // quote this character
-      b_quote = true;      
+      p_line.textend = pos;
+      p_line.end = pos + 1;
+      p_line.length = col + 1;
+      return;
+    }
+
+    if (col + 3 > maxcol) {
+      cut = pos;
+      break;
+    }
+    p_line.quoted[p_line.quotedcount++] = pos++;
+    col += 3;
+    forcequote = false;
+  }
+
+  if (pos == inputsize) {
+    p_line.textend = p_line.end = inputsize;
+    p_line.length = col;
+    return;
+  }
+
+  // Soft line break after the last space of the line, if any
+  size_t end = cut;
+  for (size_t i = cut; i > p_start + 1; i--) {
+    if (m_input[i-1] == ' ' || m_input[i-1] == '\t') {
+      end = i;
+      break;
+    }
+  }
+  while (p_line.quotedcount > 0 && 
+      p_line.quoted[p_line.quotedcount-1] >= end) {
+    p_line.quotedcount--;
+  }
+  p_line.textend = p_line.end = end;
+  p_line.length = end - p_start + 2 * p_line.quotedcount + 3;
+  p_line.soft = true;
+}
+
+/* cMimeCodeQP::afterLineBreak - Whether CRLF comes before input p_pos,
+ * looking back into the stream before m_input
+ */
+bool cMimeCodeQP::afterLineBreak (size_t p_pos) const {
+  unsigned char last[2];
+  for (int i = 0; i < 2; i++) {
+    size_t back = 2 - i;
+    if (p_pos >= back) {
+      last[i] = m_input[p_pos - back];
+    } else if (m_streaming && m_streamoffset >= back - p_pos) {
+      last[i] = m_before[i + p_pos];
     } else {
-      // copy this character
-      b_copy = true;     
+      return false;
     }
+  }
+  return last[0] == '\r' && last[1] == '\n';
+}
 
-    if (linelen+(b_quote ? 3 : 1) >= MAX_MIME_LINE_LEN 
-      && p_output+3 <= p_outend) {
-      if (p_space != NULL && p_space < p_output) {
-        p_space++;
-        int p_size = (int)(p_output - p_space);
-        memmove(p_space+3, p_space, p_size);
-        linelen = p_size;
+/* cMimeCodeQP::streamPrefix - Encoding codes the lines that no later input
+ * can change: up to the last hard line break with a few bytes after it, to
+ * see a lone '.', or failing that the soft broken lines that are followed
+ * by a full line of input. Decoding stops short of white space that may
+ * end a line and of a '=' sequence that may be incomplete.
+ */
+size_t cMimeCodeQP::streamPrefix () const {
+  size_t size = m_inputsize;
+  if (!m_isencoding) {
+    for (;;) {
+      while (size > 0 && (m_input[size-1] == ' ' || 
+          m_input[size-1] == '\t' || m_input[size-1] == '\r'))
+        size--;
+      if (size >= 1 && m_input[size-1] == '=') {
+        size--;
+      } else if (size >= 2 && m_input[size-2] == '=') {
+        size -= 2;
       } else {
-        p_space = p_output;
-        linelen = 0;
+        return size;
       }
-      memcpy(p_space, "=\r\n", 3);
-      p_output += 3;
-      p_space = NULL;
     }
+  }
+
+  if (!m_quotelinebreak) {
+    for (size_t i = size < 3 ? 0 : size - 3; i > 0; i--) {
+      if (m_input[i-1] == '\r' || m_input[i-1] == '\n')
+        return i;
+    }
+  }
+  size_t prefix = 0;
+  qpLine line;
+  while (prefix + MAX_MIME_LINE_LEN + 3 <= size) {
+    planLine(prefix, line);
+    prefix = line.end;
+  }
+  return prefix;
+}
+
+void cMimeCodeQP::streamAdvance (size_t p_size) {
+  if (p_size >= 2) {
+    m_before[0] = m_input[p_size-2];
+    m_before[1] = m_input[p_size-1];
+  } else if (p_size == 1) {
+    m_before[0] = m_before[1];
+    m_before[1] = m_input[0];
+  }
+}
 
-    if (b_quote && p_output+3 <= p_outend) {
+size_t cMimeCodeQP::getEncodeLength() const {
+  size_t length = 0;
+  qpLine line;
+  for (size_t pos = 0; pos < m_inputsize; pos = line.end) {
+    planLine(pos, line);
+    length += line.length;
+  }
+  return length;
+}
+
+ssize_t cMimeCodeQP::encode (unsigned char* p_output, 
+    size_t p_maxsize) const {
+  static const char* s_qptable = "0123456789ABCDEF";
+  unsigned char* p_outstart = p_output;
+  unsigned char* p_outend = p_output + p_maxsize;
+  qpLine line;
+  for (size_t pos = 0; pos < m_inputsize; pos = line.end) {
+    planLine(pos, line);
+    if (line.length > (size_t)(p_outend - p_output)) { break; }
+
+    for (int i = 0; i < line.quotedcount; i++) {
+      size_t quoted = line.quoted[i];
+      memcpy(p_output, m_input + pos, quoted - pos);
+      p_output += quoted - pos;
+      unsigned char ch = m_input[quoted];
       *p_output++ = '=';
       *p_output++ = s_qptable[(ch >> 4) & 0x0f];
       *p_output++ = s_qptable[ch & 0x0f];
-      linelen += 3;
-    } else if (b_copy) {
-      *p_output++ = (char) ch;
-      linelen++;
+      pos = quoted + 1;
     }
+    memcpy(p_output, m_input + pos, line.textend - pos);
+    p_output += line.textend - pos;
 
-    p_data++;
+    if (line.soft) {
+      memcpy(p_output, "=\r\n", 3);
+      p_output += 3;
+    } else if (line.end > line.textend) {
+      *p_output++ = m_input[line.textend];
+    }
   }
 
-  return (int)(p_output - p_outstart);
+  return p_output - p_outstart;
 }
 
-int cMimeCodeQP::decode(unsigned char* p_output, int p_maxsize) {
+// Hex digit values, either case, 0xff for other bytes
+static const unsigned char s_hexValues[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+/* cMimeCodeQP::decode - Copy the spans between '=' and line ends in bulk.
+ * Beyond RFC 2045 this takes lowercase hex, soft line breaks ending in LF
+ * alone or followed by white space, and drops white space at the end of
+ * lines, which some transports add. A '=' that starts no valid sequence is
+ * kept as it is.
+ */
+ssize_t cMimeCodeQP::decode(unsigned char* p_output, size_t p_maxsize) {
   const unsigned char* p_data = m_input;
   const unsigned char* p_end = m_input + m_inputsize;
   unsigned char* p_outstart = p_output;
   unsigned char* p_outend = p_output + p_maxsize;
 
-  while (p_data < p_end) {
-    if (p_output >= p_outend) { break; }
+  while (p_data < p_end && p_output < p_outend) {
+    size_t run = cMimeSimd::qpDecodeRun(p_data, p_end - p_data);
+    const unsigned char* p_stop = p_data + run;
+    const unsigned char* p_text = p_stop;
+    if (p_stop < p_end && *p_stop == '\n') {
+      // drop white space at the end of the line
+      if (p_text > p_data && *(p_text-1) == '\r') { p_text--; }
+      const unsigned char* p_break = p_text;
+      while (p_text > p_data && (*(p_text-1) == ' ' || *(p_text-1) == '\t'))
+        p_text--;
+      size_t size = std::min((size_t)(p_text - p_data), 
+        (size_t)(p_outend - p_output));
+      memcpy(p_output, p_data, size);
+      p_output += size;
+      size = std::min((size_t)(p_stop + 1 - p_break), 
+        (size_t)(p_outend - p_output));
+      memcpy(p_output, p_break, size);
+      p_output += size;
+      p_data = p_stop + 1;
+      continue;
+    }
 
-    unsigned char ch = *p_data++;
-    if (ch == '=') {
-      if (p_data+2 > p_end) {
-        // invalid endcoding
-        break;        
-      }
-      ch = *p_data++;
-      if (cMimeChar::isHexDigit(ch)) {
-        ch -= ch > '9' ? 0x37 : '0';
-        *p_output = ch << 4;
-        ch = *p_data++;
-        ch -= ch > '9' ? 0x37 : '0';
-        *p_output++ |= ch & 0x0f;
-      } else if (ch == '\r' && *p_data == '\n') {
-        // Soft Line Break, eat it
-        p_data++;     
-      } else {          
-        // invalid endcoding, let it go
-        *p_output++ = ch;
-      }
+    size_t size = std::min(run, (size_t)(p_outend - p_output));
+    memcpy(p_output, p_data, size);
+    p_output += size;
+    p_data = p_stop;
+    if (p_data == p_end || p_output == p_outend) { break; }
+
+    // '=' followed by two hex digits, or a soft line break
+    if (p_end - p_data >= 3 && 
+        (s_hexValues[p_data[1]] | s_hexValues[p_data[2]]) != 0xff) {
+      *p_output++ = (s_hexValues[p_data[1]] << 4) | s_hexValues[p_data[2]];
+      p_data += 3;
+      continue;
+    }
+    const unsigned char* p_next = p_data + 1;
+    while (p_next < p_end && (*p_next == ' ' || *p_next == '\t')) 
+      p_next++;
+    if (p_next < p_end && *p_next == '\r') { p_next++; }
+    if (p_next == p_end || *p_next == '\n') {
+      p_data = p_next < p_end ? p_next + 1 : p_end;
     } else {
-      *p_output++ = ch;
+      *p_output++ = *p_data++;
     }
   }
 
-  return (int)(p_output - p_outstart);
+  return p_output - p_outstart;
 }
 // end cMimeCodeQP
 
 // cMimeCodeBase64
-cMimeCodeBase64::cMimeCodeBase64() : m_addlinebreak(true) {}
+cMimeCodeBase64::cMimeCodeBase64() : 
+  m_addlinebreak(true), m_erroroffset(-1) {}
 
-int cMimeCodeBase64::getEncodeLength() const {
-  int length = (m_inputsize + 2) / 3 * 4;
+size_t cMimeCodeBase64::getEncodeLength() const {
+  size_t length = (m_inputsize + 2) / 3 * 4;
   if (m_addlinebreak) {
     length += (length / MAX_MIME_LINE_LEN + 1) * 2;
   }
   return length;
 }
 
-int cMimeCodeBase64::getDecodeLength() const {
+size_t cMimeCodeBase64::getDecodeLength() const {
   return m_inputsize * 3 / 4 + 2;
 }
 
 void cMimeCodeBase64::addLineBreak(bool add) { m_addlinebreak = add; }
 
-int cMimeCodeBase64::encode (unsigned char* p_output, int p_maxsize) const {
+/* cMimeCodeBase64::encode - Whole groups go through the vector kernels when
+ * the output has room for all of it, a short buffer takes what fits
+ */
+ssize_t cMimeCodeBase64::encode (unsigned char* p_output, 
+    size_t p_maxsize) const {
   static const char* s_base64Table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+  size_t length = (m_inputsize + 2) / 3 * 4;
+  if (m_addlinebreak)
+    length += (length + MAX_MIME_LINE_LEN - 1) / MAX_MIME_LINE_LEN * 2;
+  if (p_maxsize >= length) {
+    size_t linesize = m_addlinebreak ? MAX_MIME_LINE_LEN / 4 * 3 : 0;
+    size_t whole = m_inputsize / 3 * 3;
+    size_t output = parallelEncode(p_output, whole, linesize);
+    const unsigned char* p_tail = m_input + whole;
+    switch (m_inputsize - whole) {
+      case 1:
+        p_output[output++] = s_base64Table[p_tail[0] >> 2];
+        p_output[output++] = s_base64Table[(p_tail[0] << 4) & 0x30];
+        p_output[output++] = '=';
+        p_output[output++] = '=';
+        break;
+
+      case 2:
+        p_output[output++] = s_base64Table[p_tail[0] >> 2];
+        p_output[output++] = s_base64Table[((p_tail[0] << 4) & 0x30) | 
+          (p_tail[1] >> 4)];
+        p_output[output++] = s_base64Table[(p_tail[1] << 2) & 0x3c];
+        p_output[output++] = '=';
+    }
+    if (m_addlinebreak && output < length) {
+      p_output[output++] = '\r';
+      p_output[output++] = '\n';
+    }
+    ASSERT(output == length);
+    return output;
+  }
+
   unsigned char* p_outstart = p_output;
   unsigned char* p_outend = p_output + p_maxsize;
-  int n_from, n_linelen = 0;
+  size_t n_from;
+  int n_linelen = 0;
   unsigned char ch_high4bits = 0;
 
   for (n_from=0; n_from<m_inputsize; n_from++) {
@@ -466,56 +936,393 @@ int cMimeCodeBase64::encode (unsigned char* p_output, int p_maxsize) const {
     *p_output++ = '\r';
     *p_output++ = '\n';
   }
-  return (int)(p_output - p_outstart);
+  return p_output - p_outstart;
 }
 
-int cMimeCodeBase64::decode(unsigned char* p_output, int p_maxsize)
+/* cMimeCodeBase64::parallelEncode - The first p_size input bytes, whole
+ * groups, in segments of whole lines that each go to their own place in
+ * the output
+ */
+size_t cMimeCodeBase64::parallelEncode (unsigned char* p_output, 
+    size_t p_size, size_t p_linesize) const {
+  // the workers go by the context of this thread
+  const cMimeContext& context = cMimeEnvironment::context();
+  size_t threshold = context.parallelThreshold();
+  unsigned threads = context.codingThreads();
+  if (threshold == 0 || p_size < threshold || threads < 2)
+    return cMimeSimd::base64Encode(m_input, p_size, p_output, p_linesize);
+
+  size_t unit = p_linesize ? p_linesize : 3;
+  size_t outunit = p_linesize ? p_linesize / 3 * 4 + 2 : 4;
+  size_t segment = (p_size / (threads * 4) + unit - 1) / unit * unit;
+  if (segment < (1 << 20))
+    segment = ((1 << 20) + unit - 1) / unit * unit;
+  size_t count = (p_size + segment - 1) / segment;
+  std::vector<size_t> sizes(count);
+  cMimePool::run(count, threads, [&] (size_t i) {
+    cMimeContext::scope use(context);
+    size_t start = i * segment;
+    size_t size = std::min(segment, p_size - start);
+    sizes[i] = cMimeSimd::base64Encode(m_input + start, size, 
+      p_output + start / unit * outunit, p_linesize);
+  });
+  return (count - 1) * segment / unit * outunit + sizes[count-1];
+}
+
+/* cMimeCodeBase64::parallelDecode - Split the input into segments that
+ * start on a group, found by counting the base64 characters of each, and
+ * decode them on their own. Input with padding or anything else that is
+ * not base64 before the last segment, including where a segment stops
+ * early, is left to the serial decoder, which reports the error.
+ */
+bool cMimeCodeBase64::parallelDecode (unsigned char* p_output, 
+    size_t p_maxsize, size_t* p_size) {
+  // the workers go by the context of this thread
+  const cMimeContext& context = cMimeEnvironment::context();
+  size_t threshold = context.parallelThreshold();
+  unsigned threads = context.codingThreads();
+  if (threshold == 0 || m_inputsize < threshold || threads < 2)
+    return false;
+
+  size_t segment = std::max(m_inputsize / (threads * 4), (size_t)1 << 20);
+  size_t count = (m_inputsize + segment - 1) / segment;
+  if (count < 2)
+    return false;
+  std::vector<size_t> starts(count + 1), values(count), scanned(count);
+  for (size_t i = 0; i < count; i++)
+    starts[i] = i * segment;
+  starts[count] = m_inputsize;
+  cMimePool::run(count, threads, [&] (size_t i) {
+    cMimeContext::scope use(context);
+    scanned[i] = cMimeSimd::base64Scan(m_input + starts[i], 
+      starts[i+1] - starts[i], &values[i]);
+  });
+
+  // move each start past the characters that finish the group before it,
+  // the scans cover the segments as they were before the moves
+  std::vector<size_t> offsets(count);
+  size_t total = 0;
+  for (size_t i = 0; i < count - 1; i++) {
+    if (scanned[i] < segment)
+      return false;
+    total += values[i];
+    size_t pos = starts[i+1];
+    for (size_t need = (4 - total % 4) % 4; need > 0; pos++) {
+      if (pos >= starts[i+2] || pos >= starts[i+1] + scanned[i+1])
+        return false;
+      unsigned char ch = m_input[pos];
+      if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n') {
+        need--;
+        total++;
+        values[i+1]--;
+      }
+    }
+    starts[i+1] = pos;
+    offsets[i+1] = total / 4 * 3;
+  }
+  if (offsets[count-1] + (m_inputsize - starts[count-1]) / 4 * 3 + 3 > 
+      p_maxsize)
+    return false;
+
+  std::vector<ssize_t> errors(count);
+  std::vector<size_t> sizes(count);
+  cMimePool::run(count, threads, [&] (size_t i) {
+    cMimeContext::scope use(context);
+    sizes[i] = cMimeSimd::base64Decode(m_input + starts[i], 
+      starts[i+1] - starts[i], p_output + offsets[i], 
+      p_maxsize - offsets[i], &errors[i]);
+  });
+  for (size_t i = 0; i < count - 1; i++) {
+    if (errors[i] >= 0)
+      return false;
+  }
+  m_erroroffset = errors[count-1] >= 0 ? 
+    (ssize_t)starts[count-1] + errors[count-1] : -1;
+  *p_size = offsets[count-1] + sizes[count-1];
+  return true;
+}
+
+/* cMimeCodeBase64::decode - Decode skipping white space. Stops at padding
+ * or at the first byte that isn't base64, see errorOffset().
+ */
+ssize_t cMimeCodeBase64::decode(unsigned char* p_output, size_t p_maxsize)
 {
-  const unsigned char* p_data = m_input;
-  const unsigned char* p_end = m_input + m_inputsize;
-  unsigned char* p_outstart = p_output;
-  unsigned char* p_outend = p_output + p_maxsize;
+  if (!m_streaming) {
+    size_t size;
+    if (parallelDecode(p_output, p_maxsize, &size))
+      return size;
+    return cMimeSimd::base64Decode(m_input, m_inputsize, p_output, 
+      p_maxsize, &m_erroroffset);
+  }
 
-  int n_from = 0;
-  unsigned char ch_highbits = 0;
+  // streaming keeps the first error, as an offset into the whole stream
+  if (m_streamoffset == 0) { m_erroroffset = -1; }
+  ssize_t error;
+  size_t consumed;
+  size_t size = cMimeSimd::base64Decode(m_input, m_inputsize, p_output, 
+    p_maxsize, &error, streamMore() ? &consumed : NULL);
+  if (streamMore()) { m_inputsize = consumed; }
+  if (error >= 0 && m_erroroffset < 0) { 
+    m_erroroffset = m_streamoffset + error; 
+  }
+  return size;
+}
 
-  while (p_data < p_end) {
-    if (p_output >= p_outend)
-      break;
+/* cMimeCodeBase64::streamPrefix - Encode whole lines, or whole groups 
+ * without line breaks. Decoding leaves the last group in decode().
+ */
+size_t cMimeCodeBase64::streamPrefix () const {
+  if (!m_isencoding) { return m_inputsize; }
+  size_t block = m_addlinebreak ? MAX_MIME_LINE_LEN / 4 * 3 : 3;
+  return m_inputsize / block * block;
+}
+// end cMimeCodeBase64
 
-    unsigned char ch = *p_data++;
-    if (ch == '\r' || ch == '\n')
-      continue;
-    ch = (unsigned char) decodeBase64Char(ch);
-    if (ch >= 64)       // invalid encoding, or trailing pad '='
-      break;
+// cMimeAutoEncoding
+/* cMimeAutoEncoding::cMimeAutoEncoding - A quoted-printable payload is at
+ * least its size plus two bytes for each quoted byte. Only when that beats
+ * base64 does the QP coder plan the lines for its exact size.
+ */
+cMimeAutoEncoding::cMimeAutoEncoding (const unsigned char* p_data, 
+    size_t p_size, bool p_allow8bit) : m_encoding("base64"), m_length(0) {
+  cMimeSimd::textStats stats;
+  cMimeSimd::textScan(p_data, p_size, &stats);
+
+  size_t maxline = cMimeEnvironment::autoFolding() ? MAX_MIME_LINE_LEN : 998;
+  bool binary = stats.nul > 0 || stats.barebreaks > 0;
+  if (!binary && stats.maxline <= maxline && 
+      (!stats.nonascii || p_allow8bit)) {
+    m_encoding = stats.nonascii ? "8bit" : "7bit";
+    m_length = p_size;
+    return;
+  }
 
-    switch ((n_from++) % 4) {
-      case 0:
-        ch_highbits = ch << 2;
-        break;
+  m_length = (p_size + 2) / 3 * 4;
+  m_length += (m_length + MAX_MIME_LINE_LEN - 1) / MAX_MIME_LINE_LEN * 2;
+  if (binary || p_size + stats.quoted * 2 >= m_length)
+    return;
+
+  cMimeCodeQP qp;
+  qp.setInput((const char*) p_data, p_size, true);
+  size_t length = qp.getOutputLength();
+  if (length < m_length) {
+    m_encoding = "quoted-printable";
+    m_length = length;
+  }
+}
+// end cMimeAutoEncoding
+
+// cMimeCodeCharset
+cMimeCodeCharset::cMimeCodeCharset (const char* p_charset) :
+  m_kind(CHARSET_UTF8),
+  m_supported(true),
+  m_table(NULL),
+  m_iconv((iconv_t)-1) {
+  charset(p_charset);
+}
 
-      case 1:
-        *p_output++ = ch_highbits | (ch >> 4);
-        ch_highbits = ch << 4;
-        break;
+cMimeCodeCharset::~cMimeCodeCharset() {
+  if (m_iconv != (iconv_t)-1)
+    iconv_close(m_iconv);
+}
 
-      case 2:
-        *p_output++ = ch_highbits | (ch >> 2);
-        ch_highbits = ch << 6;
-        break;
+const char* cMimeCodeCharset::charset () const { return m_charset.c_str(); }
 
-      default:
-        *p_output++ = ch_highbits | ch;
+bool cMimeCodeCharset::supported () const { return m_supported; }
+
+/* cMimeCodeCharset::charset - Names are compared by their letters and
+ * digits in lower case, so "ISO_8859-2" is "iso-8859-2". No charset is
+ * US-ASCII, which is read as UTF-8 like mail that has 8bit text anyway.
+ */
+void cMimeCodeCharset::charset (const char* p_charset) {
+  if (m_iconv != (iconv_t)-1)
+    iconv_close(m_iconv);
+  m_iconv = (iconv_t)-1;
+  m_charset = p_charset != NULL ? p_charset : "";
+  m_kind = CHARSET_UTF8;
+  m_supported = true;
+  m_table = NULL;
+
+  std::string name;
+  for (size_t i = 0; i < m_charset.size(); i++) {
+    if (isalnum((unsigned char)m_charset[i]))
+      name += (char)tolower((unsigned char)m_charset[i]);
+  }
+  if (name.size() == 6 && !name.compare(0, 5, "cp125"))
+    name = "windows" + name.substr(2);
+  if (name.empty() || name == "usascii" || name == "ascii" || 
+      name == "utf8")
+    return;
+  if (name == "iso88591" || name == "latin1") {
+    m_kind = CHARSET_LATIN1;
+    return;
+  }
+  for (const charsetTable* p_table = m_tables; p_table->name; p_table++) {
+    if (name == p_table->name) {
+      m_kind = CHARSET_TABLE;
+      m_table = p_table->high;
+      return;
     }
   }
 
-  return (int)(p_output - p_outstart);
+  // mail labels text in the supersets with the older names
+  const char* p_name = m_charset.c_str();
+  if (name == "gb2312")
+    p_name = "GBK";
+  else if (name == "ksc56011987")
+    p_name = "CP949";
+  m_iconv = iconv_open("UTF-8", p_name);
+  if (m_iconv != (iconv_t)-1)
+    m_kind = CHARSET_ICONV;
+  else
+    m_supported = false;
 }
-// end cMimeCodeBase64
+
+/* cMimeCodeCharset::getDecodeLength - ASCII stays one byte, anything else
+ * takes at most 3 bytes for each byte it comes from
+ */
+size_t cMimeCodeCharset::getDecodeLength() const {
+  if (m_isencoding)
+    return m_inputsize;
+  if (m_kind == CHARSET_ICONV)
+    return m_inputsize * 3;
+  size_t nonascii = cMimeSimd::nonAsciiCount(m_input, m_inputsize);
+  return m_inputsize + nonascii * (m_kind == CHARSET_LATIN1 ? 1 : 2);
+}
+
+/* cMimeCodeCharset::decode - The output takes getDecodeLength() bytes, it
+ * is only worked out if the room may be short. Streaming leaves a
+ * character cut short at the end of a chunk to the next one.
+ */
+ssize_t cMimeCodeCharset::decode (unsigned char* p_output, size_t p_maxsize) {
+  if (p_maxsize < m_inputsize * 3 && p_maxsize < getDecodeLength())
+    return -1;
+  switch (m_kind) {
+    case CHARSET_LATIN1: 
+      return cMimeSimd::latin1ToUtf8(m_input, m_inputsize, p_output);
+    case CHARSET_TABLE: return tableDecode(p_output);
+    case CHARSET_ICONV: return iconvDecode(p_output, p_maxsize);
+    default: return utf8Decode(p_output);
+  }
+}
+
+static const unsigned char s_replacement[] = { 0xef, 0xbf, 0xbd };
+
+/* utf8Prefix - Bytes at p_input that begin a valid UTF-8 character without
+ * completing it, 0 if the first is not a lead byte
+ */
+static size_t utf8Prefix (const unsigned char* p_input, size_t p_size) {
+  unsigned char ch = p_input[0], low = 0x80, high = 0xbf;
+  if (ch < 0xc2 || ch > 0xf4)
+    return 0;
+  size_t length = ch < 0xe0 ? 2 : ch < 0xf0 ? 3 : 4;
+  if (ch == 0xe0)
+    low = 0xa0;
+  else if (ch == 0xed)
+    high = 0x9f;
+  else if (ch == 0xf0)
+    low = 0x90;
+  else if (ch == 0xf4)
+    high = 0x8f;
+  size_t i = 1;
+  if (i < p_size && p_input[i] >= low && p_input[i] <= high) {
+    for (i++; i < p_size && i < length && (p_input[i] & 0xc0) == 0x80; i++)
+      ;
+  }
+  return i < length ? i : 0;
+}
+
+/* cMimeCodeCharset::utf8Decode - Valid runs are copied, each invalid byte
+ * or start of a character cut short becomes one U+FFFD
+ */
+size_t cMimeCodeCharset::utf8Decode (unsigned char* p_output) {
+  unsigned char* p_start = p_output;
+  size_t i = 0;
+  while (i < m_inputsize) {
+    size_t run = cMimeSimd::utf8Run(m_input + i, m_inputsize - i);
+    memcpy(p_output, m_input + i, run);
+    p_output += run;
+    i += run;
+    if (i == m_inputsize)
+      break;
+    size_t prefix = utf8Prefix(m_input + i, m_inputsize - i);
+    if (streamMore() && prefix == m_inputsize - i)
+      break;
+    memcpy(p_output, s_replacement, 3);
+    p_output += 3;
+    i += prefix ? prefix : 1;
+  }
+  if (streamMore())
+    m_inputsize = i;
+  return p_output - p_start;
+}
+
+size_t cMimeCodeCharset::tableDecode (unsigned char* p_output) {
+  unsigned char* p_start = p_output;
+  size_t i = 0;
+  while (i < m_inputsize) {
+    size_t run = cMimeSimd::asciiRun(m_input + i, m_inputsize - i);
+    memcpy(p_output, m_input + i, run);
+    p_output += run;
+    i += run;
+    for (; i < m_inputsize && m_input[i] >= 0x80; i++) {
+      unsigned cp = m_table[m_input[i] - 0x80];
+      if (cp < 0x800) {
+        *p_output++ = 0xc0 | (cp >> 6);
+      } else {
+        *p_output++ = 0xe0 | (cp >> 12);
+        *p_output++ = 0x80 | ((cp >> 6) & 0x3f);
+      }
+      *p_output++ = 0x80 | (cp & 0x3f);
+    }
+  }
+  return p_output - p_start;
+}
+
+/* cMimeCodeCharset::iconvDecode - The shift state of stateful charsets is
+ * kept from one chunk to the next and reset when a stream or a whole input
+ * starts
+ */
+size_t cMimeCodeCharset::iconvDecode (unsigned char* p_output, 
+    size_t p_maxsize) {
+  if (!m_streaming || m_streamoffset == 0)
+    iconv(m_iconv, NULL, NULL, NULL, NULL);
+  char* p_in = (char*) m_input;
+  size_t inleft = m_inputsize;
+  char* p_out = (char*) p_output;
+  size_t outleft = p_maxsize;
+  while (inleft > 0) {
+    if (iconv(m_iconv, &p_in, &inleft, &p_out, &outleft) != (size_t)-1)
+      break;
+    if ((errno == EINVAL && streamMore()) || errno == E2BIG || outleft < 3)
+      break;
+    // not valid, or cut short at the end
+    memcpy(p_out, s_replacement, 3);
+    p_out += 3;
+    outleft -= 3;
+    p_in++;
+    inleft--;
+  }
+  if (streamMore())
+    m_inputsize -= inleft;
+  return p_out - (char*) p_output;
+}
+// end cMimeCodeCharset
 
 // cMimeEncodedWord
-cMimeEncodedWord::cMimeEncodedWord() : m_encoding(0) {}
+cMimeEncodedWord::cMimeEncodedWord() : 
+  m_encoding(0), 
+  m_afterword(false), 
+  m_utf8(false) {}
+
+void cMimeEncodedWord::utf8Output (bool p_utf8) { m_utf8 = p_utf8; }
+
+/* cMimeEncodedWord::getDecodeLength - A word decodes to fewer bytes than it
+ * takes, and UTF-8 to at most 3 for each of those and the words held
+ */
+size_t cMimeEncodedWord::getDecodeLength() const {
+  return m_utf8 ? (m_inputsize + m_word.size()) * 3 : m_inputsize;
+}
 
 int cMimeEncodedWord::encoding() const { return m_encoding; }
 
@@ -526,117 +1333,350 @@ void cMimeEncodedWord::encoding(int p_encoding, const char* p_charset) {
 
 const char* cMimeEncodedWord::charset () const { return m_charset.c_str(); }
 
-int cMimeEncodedWord::getEncodeLength() const {
+size_t cMimeEncodedWord::getEncodeLength() const {
   if (!m_inputsize || m_charset.empty())
     return cMimeCodeBase::getEncodeLength();
 
-  int n_length, n_codelen = (int) m_charset.size() + 7;
+  size_t n_length, n_codelen = m_charset.size() + 7;
   if (tolower(m_encoding) == 'b') {
     cMimeCodeBase64 base64;
     base64.setInput((const char*)m_input, m_inputsize, true);
     base64.addLineBreak(false);
     n_length = base64.getOutputLength();
   } else {
-    cMimeCodeQP qp;
-    qp.setInput((const char*)m_input, m_inputsize, true);
-    qp.quoteLineBreak(false);
-    n_length = qp.getOutputLength();
+    n_length = m_inputsize;
+    for (size_t i = 0; i < m_inputsize; i++) {
+      unsigned char ch = m_input[i];
+      if (ch < 33 || ch > 126 || ch == '=' || ch == '?' || ch == '_')
+        n_length += 2;
+    }
   }
 
   n_codelen += 4;
   ASSERT(n_codelen < MAX_ENCODEDWORD_LEN);
   return (n_length / (MAX_ENCODEDWORD_LEN - n_codelen) + 1) 
-    * n_codelen + n_length;
+    * n_codelen + n_length + 1;
 }
 
-int cMimeEncodedWord::encode (unsigned char* p_output, int p_maxsize) const {
+/* cMimeEncodedWord::streamPrefix - Encode up to where the last word is
+ * full, the next update() starts a new word. Decoding stops in decode().
+ */
+size_t cMimeEncodedWord::streamPrefix () const {
+  if (!m_isencoding || m_charset.empty()) { return m_inputsize; }
+
+  size_t n_maxline = MAX_ENCODEDWORD_LEN - m_charset.size() - 7;
+  if (tolower(m_encoding) == 'b') {
+    size_t n_blocksize = n_maxline / 4 * 3;
+    return m_inputsize / n_blocksize * n_blocksize;
+  }
+
+  size_t prefix = 0, n_linelen = 0;
+  for (size_t i = 0; i < m_inputsize; i++) {
+    unsigned char ch = m_input[i];
+    size_t n_codelen = ch < 33 || ch > 126 || ch == '=' || ch == '?' || 
+      ch == '_' ? 3 : 1;
+    if (n_linelen + n_codelen > n_maxline) {
+      prefix = i;
+      n_linelen = 0;
+    }
+    n_linelen += n_codelen;
+  }
+  return prefix;
+}
+
+ssize_t cMimeEncodedWord::encode (unsigned char* p_output, 
+    size_t p_maxsize) const {
   if (m_charset.empty()) { 
     return cMimeCodeBase::encode(p_output, p_maxsize);
   }
 
-  if (!m_inputsize) {
+  if (!m_inputsize || !p_maxsize) {
     return 0;
   }
 
+  // words of earlier chunks of a stream come before
+  size_t n_space = 0;
+  if (m_streaming && m_streamoffset > 0) {
+    *p_output = ' ';
+    n_space = 1;
+  }
   if (tolower(m_encoding) == 'b') {
-    return base64Encode(p_output, p_maxsize);
+    return n_space + base64Encode(p_output + n_space, p_maxsize - n_space);
+  }
+  return n_space + QPEncode(p_output + n_space, p_maxsize - n_space);
+}
+
+/* The parts of "=?charset?X?text?=" */
+struct encodedWord {
+  const char* charset;
+  size_t charsetlen;
+  int coding;
+  const char* text;
+  size_t textlen;
+  const char* end;
+};
+enum { WORD_NONE, WORD_FOUND, WORD_SHORT };
+
+/* findWord - The next "=?" before p_end, or p_end */
+static const char* findWord (const char* p_data, const char* p_end) {
+  while ((p_data = (const char*) memchr(p_data, '=', p_end - p_data))) {
+    if (p_data + 1 < p_end && p_data[1] == '?')
+      return p_data;
+    p_data++;
   }
-  return QPEncode(p_output, p_maxsize);
+  return p_end;
 }
 
-int cMimeEncodedWord::decode (unsigned char* p_output, int p_maxsize) {
-  m_charset.clear();
+/* parseWord - The encoded-word at p_data, read no further than p_end. The
+ * charset is a token of at most a word's length. A word without its "?="
+ * runs to p_end, unless p_more input follows: then it is short, like a
+ * word cut off in its charset.
+ */
+static int parseWord (const char* p_data, const char* p_end, bool p_more,
+    encodedWord& p_word) {
+  if (p_end - p_data < 2)
+    return p_more && p_data < p_end && *p_data == '=' ? WORD_SHORT : 
+      WORD_NONE;
+  if (p_data[0] != '=' || p_data[1] != '?')
+    return WORD_NONE;
+  const char* p_charset = p_data + 2;
+  const char* p_limit = p_end - p_charset > MAX_ENCODEDWORD_LEN ?
+    p_charset + MAX_ENCODEDWORD_LEN : p_end;
+  const char* p_mark = p_charset;
+  while (p_mark < p_limit && *p_mark != '?' && 
+      !cMimeChar::isSpace((unsigned char)*p_mark))
+    p_mark++;
+  if (p_mark == p_end || (p_mark < p_end && *p_mark == '?' && 
+      p_mark + 3 >= p_end))
+    return p_more ? WORD_SHORT : WORD_NONE;
+  if (*p_mark != '?' || p_mark[2] != '?')
+    return WORD_NONE;
+  int coding = tolower((unsigned char)p_mark[1]);
+  if (coding != 'b' && coding != 'q')
+    return WORD_NONE;
+
+  const char* p_text = p_mark + 3;
+  const char* p_tail = p_text;
+  for (;;) {
+    p_tail = (const char*) memchr(p_tail, '?', p_end - p_tail);
+    if (p_tail == NULL || p_tail + 1 == p_end) {
+      p_tail = NULL;
+      break;
+    }
+    if (p_tail[1] == '=')
+      break;
+    p_tail++;
+  }
+  if (p_tail == NULL && p_more)
+    return WORD_SHORT;
+
+  p_word.charset = p_charset;
+  p_word.charsetlen = p_mark - p_charset;
+  p_word.coding = coding;
+  p_word.text = p_text;
+  p_word.textlen = (p_tail ? p_tail : p_end) - p_text;
+  p_word.end = p_tail ? p_tail + 2 : p_end;
+  return WORD_FOUND;
+}
+
+/* qWordDecode - RFC 2047 Q: '_' is a space, '=' and two hex digits a byte.
+ * A '=' that starts no such sequence is kept.
+ */
+static size_t qWordDecode (const unsigned char* p_input, size_t p_size,
+    unsigned char* p_output) {
+  unsigned char* p_start = p_output;
+  for (size_t i = 0; i < p_size; i++) {
+    unsigned char ch = p_input[i];
+    if (ch == '_') {
+      ch = ' ';
+    } else if (ch == '=' && p_size - i > 2 && 
+        (s_hexValues[p_input[i+1]] | s_hexValues[p_input[i+2]]) != 0xff) {
+      ch = (s_hexValues[p_input[i+1]] << 4) | s_hexValues[p_input[i+2]];
+      i += 2;
+    }
+    *p_output++ = ch;
+  }
+  return p_output - p_start;
+}
+
+/* decodeWord - The text of a B or Q word into p_output, which takes
+ * p_word.textlen bytes
+ */
+static size_t decodeWord (const encodedWord& p_word, 
+    unsigned char* p_output) {
+  const unsigned char* p_text = (const unsigned char*) p_word.text;
+  if (p_word.coding == 'q')
+    return qWordDecode(p_text, p_word.textlen, p_output);
+  ssize_t error;
+  return cMimeSimd::base64Decode(p_text, p_word.textlen, p_output,
+    p_word.textlen, &error);
+}
+
+/* cMimeEncodedWord::flushWords - Convert the words held in m_word to UTF-8 */
+size_t cMimeEncodedWord::flushWords (unsigned char* p_output, 
+    size_t p_maxsize) {
+  if (m_word.empty())
+    return 0;
+  cMimeCodeCharset converter(m_wordcharset.c_str());
+  converter.setInput(m_word.data(), m_word.size(), false);
+  ssize_t size = converter.getOutput(p_output, p_maxsize);
+  m_word.clear();
+  return size > 0 ? size : 0;
+}
+
+/* cMimeEncodedWord::decode - Decode the encoded-words and copy the text
+ * between them, dropping the white space between two words. Input is read
+ * within its bounds only, a value without words is copied at once.
+ * Streaming stops before a word or text that may go on in the next chunk.
+ * For UTF-8, adjacent words in one charset are joined before they are
+ * converted, a character may be split between them.
+ */
+ssize_t cMimeEncodedWord::decode (unsigned char* p_output, 
+    size_t p_maxsize) {
+  if (!m_streaming || m_streamoffset == 0) {
+    m_charset.clear();
+    m_afterword = false;
+    m_word.clear();
+  }
   const char* p_data = (const char*) m_input;
   const char* p_end = p_data + m_inputsize;
   unsigned char* p_outstart = p_output;
+  bool b_more = streamMore();
+  if (!b_more && !m_afterword && m_word.empty() && 
+      findWord(p_data, p_end) == p_end) {
+    if (!m_utf8) {
+      size_t size = std::min(m_inputsize, p_maxsize);
+      memcpy(p_output, p_data, size);
+      return size;
+    }
+    cMimeCodeCharset converter;
+    converter.setInput(p_data, m_inputsize, false);
+    return converter.getOutput(p_output, p_maxsize);
+  }
+
   while (p_data < p_end) {
-    const char* p_headerend = p_data;
-    const char* p_codeend = p_end;
-    int n_coding = 0, n_codelen = (int)(p_end - p_data);
-    // it might be an encoded-word
-    if (p_data[0] == '=' && p_data[1] == '?') {
-      p_headerend = strchr(p_data+2, '?');
-      if (p_headerend != NULL && p_headerend[2] == '?' 
-          && p_headerend+3 < p_end) {
-        n_coding = tolower(p_headerend[1]);
-        p_headerend += 3;
-        p_codeend = strstr(p_headerend, "?=");  // look for the tailer
-        if (!p_codeend || p_codeend >= p_end)
-          p_codeend = p_end;
-        n_codelen = (int)(p_codeend - p_headerend);
-        p_codeend += 2;
-        if (m_charset.empty()) {
-          m_charset.assign(p_data+2, p_headerend-p_data-5);
-          m_encoding = n_coding;
+    encodedWord word;
+    int found = parseWord(p_data, p_end, b_more, word);
+    if (found == WORD_SHORT)
+      break;
+    if (found == WORD_FOUND) {
+      if (m_charset.empty()) {
+        m_charset.assign(word.charset, word.charsetlen);
+        m_encoding = word.coding;
+      }
+      if (m_utf8) {
+        // the language of RFC 2231 is not part of the charset
+        size_t n_charsetlen = std::find(word.charset, 
+          word.charset + word.charsetlen, '*') - word.charset;
+        if (!m_word.empty() && (m_wordcharset.size() != n_charsetlen ||
+            strncasecmp(m_wordcharset.data(), word.charset, n_charsetlen))) {
+          size_t size = flushWords(p_output, p_maxsize);
+          p_output += size;
+          p_maxsize -= size;
         }
+        m_wordcharset.assign(word.charset, n_charsetlen);
+        size_t n_held = m_word.size();
+        m_word.resize(n_held + word.textlen);
+        m_word.resize(n_held + decodeWord(word, 
+          (unsigned char*) &m_word[n_held]));
+      } else {
+        if (p_maxsize < word.textlen)
+          break;
+        size_t size = decodeWord(word, p_output);
+        p_output += size;
+        p_maxsize -= size;
       }
+      m_afterword = true;
+      p_data = word.end;
+      continue;
     }
 
-    int n_decoded;
-    if (n_coding == 'b') {
-      cMimeCodeBase64 base64;
-      base64.setInput(p_headerend, n_codelen, false);
-      n_decoded = base64.getOutput(p_output, p_maxsize);
-    } else if (n_coding == 'q') {
-      cMimeCodeQP qp;
-      qp.setInput(p_headerend, n_codelen, false);
-      n_decoded = qp.getOutput(p_output, p_maxsize);
-    } else {
-      p_codeend = strstr(p_data+1, "=?");  // find the next encoded-word
-      if (!p_codeend || p_codeend >= p_end) {
-        p_codeend = p_end;
-      } else if (p_data > (const char*) m_input) {
-        const char* p_space = p_data;
-        while (cMimeChar::isSpace((unsigned char)*p_space))
-          p_space++;
-          // ignore white-space between adjacent encoded words
-          if (p_space == p_codeend) 
-          p_data = p_codeend;
+    // text up to the next encoded-word
+    const char* p_next = findWord(p_data + 1, p_end);
+    if (p_next == p_end && b_more) {
+      // white space or a '=' may come before the next encoded-word, and a
+      // UTF-8 character may be cut short
+      while (p_next > p_data && (p_next[-1] == '=' ||
+          cMimeChar::isSpace((unsigned char)p_next[-1])))
+        p_next--;
+      while (m_utf8 && p_next > p_data && (unsigned char)p_next[-1] >= 0x80)
+        p_next--;
+      if (p_next == p_data)
+        break;
+    } else if (p_next < p_end && m_afterword) {
+      const char* p_space = p_data;
+      while (p_space < p_next && cMimeChar::isSpace((unsigned char)*p_space))
+        p_space++;
+      if (p_space == p_next) {
+        // white space between adjacent encoded-words is dropped
+        int next = parseWord(p_next, p_end, b_more, word);
+        if (next == WORD_SHORT)
+          break;
+        if (next == WORD_FOUND) {
+          p_data = p_next;
+          continue;
+        }
       }
-      n_decoded = std::min((int)(p_codeend - p_data), p_maxsize);
-      memcpy(p_output, p_data, n_decoded);
     }
 
-    p_data = p_codeend;
-    p_output += n_decoded;
-    p_maxsize -= n_decoded;
-    if (p_maxsize <= 0)
-      break;
+    size_t size = p_next - p_data;
+    if (m_utf8) {
+      size_t n_words = flushWords(p_output, p_maxsize);
+      p_output += n_words;
+      p_maxsize -= n_words;
+      cMimeCodeCharset converter;
+      converter.setInput(p_data, size, false);
+      ssize_t converted = converter.getOutput(p_output, p_maxsize);
+      size = converted > 0 ? converted : 0;
+    } else {
+      size = std::min(size, p_maxsize);
+      memcpy(p_output, p_data, size);
+    }
+    p_output += size;
+    p_maxsize -= size;
+    m_afterword = false;
+    p_data = p_next;
   }
 
-  return (int)(p_output - p_outstart);
+  if (!b_more)
+    p_output += flushWords(p_output, p_maxsize);
+  else
+    m_inputsize = p_data - (const char*) m_input;
+  return p_output - p_outstart;
 } 
 
-int cMimeEncodedWord::base64Encode (unsigned char* p_output, 
-    int p_maxsize) const {
-  int n_charsetlen = (int)m_charset.size();
+/* cMimeEncodedWord::decodeValue - Plain values are handed back as they are,
+ * the rest decoded into p_buffer
+ */
+size_t cMimeEncodedWord::decodeValue (const char* p_begin, const char* p_end,
+    std::string& p_buffer, const char** p_text, bool p_utf8) {
+  size_t size = p_end - p_begin;
+  if (findWord(p_begin, p_end) == p_end && (!p_utf8 ||
+      cMimeSimd::asciiRun((const unsigned char*) p_begin, size) == size)) {
+    *p_text = p_begin;
+    return size;
+  }
+  cMimeEncodedWord coder;
+  coder.utf8Output(p_utf8);
+  coder.setInput(p_begin, size, false);
+  p_buffer.resize(coder.getOutputLength());
+  ssize_t decoded = coder.getOutput((unsigned char*) &p_buffer[0], 
+    p_buffer.size());
+  p_buffer.resize(decoded > 0 ? decoded : 0);
+  *p_text = p_buffer.data();
+  return p_buffer.size();
+}
+
+ssize_t cMimeEncodedWord::base64Encode (unsigned char* p_output, 
+    size_t p_maxsize) const {
+  size_t n_charsetlen = m_charset.size();
   // a single encoded-word cannot exceed 75 bytes
-  int n_blocksize = MAX_ENCODEDWORD_LEN - n_charsetlen - 7; 
+  size_t n_blocksize = MAX_ENCODEDWORD_LEN - n_charsetlen - 7; 
   n_blocksize = n_blocksize / 4 * 3;
   ASSERT(n_blocksize > 0);
 
   unsigned char* p_outstart = p_output;
-  int n_input = 0;
+  size_t n_input = 0;
   for (;;) {
     if (p_maxsize < n_charsetlen+7)
       break;
@@ -654,31 +1694,32 @@ int cMimeEncodedWord::base64Encode (unsigned char* p_output,
     base64.setInput((const char*)m_input+n_input, 
       std::min(m_inputsize-n_input, n_blocksize), true);
     base64.addLineBreak(false);
-    int n_encoded = base64.getOutput(p_output, p_maxsize);
+    size_t n_encoded = base64.getOutput(p_output, p_maxsize);
     p_output += n_encoded;
     // encoded-word tail
     *p_output++ = '?';      
     *p_output++ = '=';
 
     n_input += n_blocksize;
-    p_maxsize -= n_encoded + n_charsetlen + 7;
-    if (n_input >= m_inputsize)
+    p_maxsize -= n_encoded;
+    if (n_input >= m_inputsize || !p_maxsize)
       break;
     // add a liner-white-space between adjacent encoded words
     *p_output++ = ' ';      
     p_maxsize--;
   }
-  return (int)(p_output - p_outstart);
+  return p_output - p_outstart;
 }
 
-int cMimeEncodedWord::QPEncode (unsigned char* p_output, int p_maxsize) const {
+ssize_t cMimeEncodedWord::QPEncode (unsigned char* p_output, 
+    size_t p_maxsize) const {
   static const char* s_qptable = "0123456789ABCDEF";
   const unsigned char* p_data = m_input;
   const unsigned char* p_end = m_input + m_inputsize;
   unsigned char* p_outstart = p_output;
   unsigned char* p_outend = p_output + p_maxsize;
-  int n_codelen, n_charsetlen = (int)m_charset.size();
-  int n_linelen = 0, n_maxline = MAX_ENCODEDWORD_LEN - n_charsetlen - 7;
+  size_t n_codelen, n_charsetlen = m_charset.size();
+  size_t n_linelen = 0, n_maxline = MAX_ENCODEDWORD_LEN - n_charsetlen - 7;
 
   while (p_data < p_end) {
     unsigned char ch = *p_data++;
@@ -725,12 +1766,15 @@ int cMimeEncodedWord::QPEncode (unsigned char* p_output, int p_maxsize) const {
     *p_output++ = '?';
     *p_output++ = '=';
   }
-  return (int)(p_output - p_outstart);
+  return p_output - p_outstart;
 }
 
 // end cMimeEncodedWord
 
 // cFieldCodeBase
+cFieldCodeBase::cFieldCodeBase () : m_column(0) {
+}
+
 const char* cFieldCodeBase::charset () const {
   return m_charset.c_str();
 }
@@ -739,105 +1783,343 @@ void cFieldCodeBase::charset (const char* p_charset) {
   m_charset = p_charset;
 }
 
-int cFieldCodeBase::findSymbol (const char* p_data, int p_size, 
-  int& p_delimeter, int& p_nonascchars) const {
-
-  p_nonascchars = 0;
-  const char* p_datastart = p_data;
-  const char* p_end = p_data + p_size;
-
-  while (p_data < p_end) {
-    char ch = *p_data;
-    if (cMimeChar::isNonAscii((unsigned char)ch)) {
-      p_nonascchars++;
-    } else {
-      if (ch == (char) p_delimeter) {
-        p_delimeter = 0;   // stop at any delimeters (space or specials)
-        break;
-      }
-
-      if (!p_delimeter && cMimeChar::isDelimiter(ch)) {
-        switch (ch) {
-          case '"':
-            p_delimeter = '"'; // quoted-string, delimeter is '"'
-            break;
-          case '(':
-            p_delimeter = ')'; // comment, delimeter is ')'
-            break;
-          case '<':
-            p_delimeter = '>'; // address, delimeter is '>'
-            break;
-        }
-        break;
+/* cFieldCodeBase::findSymbol - Size of the unit up to the next delimeter.
+ * Inside a quoted-string, comment or address (p_delimeter set) that's its
+ * closing char, otherwise any white space or special, where the unit stops
+ * and a quoted-string, comment or address begins.
+ */
+size_t cFieldCodeBase::findSymbol (const char* p_data, size_t p_size, 
+  int& p_delimeter, size_t& p_nonascchars) const {
+
+  const unsigned char* p_start = (const unsigned char*) p_data;
+  size_t n_size = p_size;
+  if (!p_delimeter) {
+    n_size = cMimeSimd::delimiterRun(p_start, p_size);
+    if (n_size < p_size) {
+      switch (p_data[n_size]) {
+        case '"':
+          p_delimeter = '"'; // quoted-string, delimeter is '"'
+          break;
+        case '(':
+          p_delimeter = ')'; // comment, delimeter is ')'
+          break;
+        case '<':
+          p_delimeter = '>'; // address, delimeter is '>'
+          break;
       }
     }
-    p_data++;
+  } else if (!cMimeChar::isNonAscii((unsigned char)p_delimeter)) {
+    const char* p_close = (const char*) memchr(p_data, p_delimeter, p_size);
+    if (p_close != NULL) {
+      n_size = p_close - p_data;
+      p_delimeter = 0;   // stop at any delimeters (space or specials)
+    }
   }
 
-  return (int)(p_data - p_datastart);
+  p_nonascchars = cMimeSimd::nonAsciiCount(p_start, n_size);
+  return n_size;
 } 
 
-int cFieldCodeBase::selectEncoding (int p_length, 
-  int p_nonasciichars) const {
+int cFieldCodeBase::selectEncoding (size_t p_length, 
+  size_t p_nonasciichars) const {
 
-  int q_encodesize = p_length + p_nonasciichars * 2;
-  int b_encodesize = (p_length + 2) / 3 * 4;
+  size_t q_encodesize = p_length + p_nonasciichars * 2;
+  size_t b_encodesize = (p_length + 2) / 3 * 4;
   return (q_encodesize <= b_encodesize 
     || p_nonasciichars * 5 <= p_length) ? 'Q' : 'B';
 }
 
-void cFieldCodeBase::unfoldField (std::string& p_field) const {
-  for (;;) {
-    std::string::size_type pos = p_field.rfind("\r\n");
-    if (pos == std::string::npos) 
-      break;
+/* cFieldCodeBase::isPlain - Nothing to fold and nothing to encode, the
+ * field is copied as it is
+ */
+bool cFieldCodeBase::isPlain () const {
+  if (cMimeEnvironment::autoFolding())
+    return false;
+  return (m_charset.empty() && !*cMimeEnvironment::globalCharset()) ||
+    !cMimeSimd::nonAsciiCount(m_input, m_inputsize);
+}
 
-    p_field.erase(pos, 2);
-    int spaces = 0;
-    while (cMimeChar::isSpace((unsigned char)p_field[pos+spaces]))
-      spaces++;
-    p_field.replace(pos, spaces, " ");
-  }
+/* cFieldCodeBase::encode - Write words with non-ASCII characters as
+ * encoded-words in the field or global charset, folding on the way
+ */
+ssize_t cFieldCodeBase::encode (unsigned char* p_output, 
+    size_t p_maxsize) const {
+  if (isPlain())
+    return cMimeCodeBase::encode(p_output, p_maxsize);
+  return encodeField(p_output, p_maxsize);
+}
+
+ssize_t cFieldCodeBase::decode (unsigned char* p_output, size_t p_maxsize) {
+  if (p_maxsize < m_inputsize)
+    return -1;
+  return cMimeFold::unfold(m_input, m_inputsize, p_output);
+}
+
+size_t cFieldCodeBase::getEncodeLength() const {
+  if (isPlain())
+    return cMimeCodeBase::getEncodeLength();
+  return encodeField(NULL, 0);
 }
 
-int cFieldCodeBase::getEncodeLength() const {
+/* cFieldCodeBase::encodeField - One pass over the syntactic units of the
+ * field. Units with non-ASCII characters, joined with the words after them
+ * that have some too, become encoded-words; a quoted-string that needs
+ * encoding loses its quotes, encoded-words cannot be quoted. The rest is
+ * copied, folding before white space or after a folding char when auto
+ * folding is on. Measures only if p_output is NULL.
+ */
+size_t cFieldCodeBase::encodeField (unsigned char* p_output, 
+    size_t p_maxsize) const {
   // use the global charset if there's no specified charset
   std::string charset = m_charset;
   if (charset.empty())
     charset = cMimeEnvironment::globalCharset();
-  if (charset.empty() && !cMimeEnvironment::autoFolding())
-    return cMimeCodeBase::getEncodeLength();
+  bool b_fold = cMimeEnvironment::autoFolding();
 
-  int n_length = 0;
+  fieldOutput output = { p_output, 0, p_maxsize, false, m_column, true, 
+    NULL, 0, false };
   const char* p_data = (const char*) m_input;
-  int inputsize = m_inputsize;
-  int p_nonasciichars, n_delimeter = getDelimeter();
-
-  // divide the field into syntactic units to calculate the output length
-  do {
-    int n_unitsize = findSymbol(p_data, inputsize, n_delimeter, 
-      p_nonasciichars);
-    if (!p_nonasciichars || charset.empty()) {
-      n_length += n_unitsize;
+  const char* p_end = p_data + m_inputsize;
+  int n_delimeter = getDelimeter();
+  while (p_data < p_end && !output.full) {
+    size_t n_nonascii;
+    size_t n_unitsize = findSymbol(p_data, p_end - p_data, n_delimeter, 
+      n_nonascii);
+    if (n_nonascii && !charset.empty()) {
+      const char* p_unitend = p_data + n_unitsize;
+      while (!n_delimeter && p_unitend < p_end && 
+          cMimeChar::isSpace((unsigned char)*p_unitend)) {
+        const char* p_next = p_unitend;
+        while (p_next < p_end && cMimeChar::isSpace((unsigned char)*p_next))
+          p_next++;
+        int n_nextdelimeter = 0;
+        size_t n_nextnonascii;
+        size_t n_nextsize = findSymbol(p_next, p_end - p_next, 
+          n_nextdelimeter, n_nextnonascii);
+        if (!n_nextnonascii)
+          break;
+        p_unitend = p_next + n_nextsize;
+        n_nonascii += n_nextnonascii;
+        n_delimeter = n_nextdelimeter;
+      }
+      n_unitsize = p_unitend - p_data;
+      putEncoded(output, (const unsigned char*) p_data, n_unitsize, 
+        selectEncoding(n_unitsize, n_nonascii), charset);
     } else {
-      cMimeEncodedWord coder;
-      coder.encoding(selectEncoding(n_unitsize, p_nonasciichars), 
-        charset.c_str());
-      coder.setInput(p_data, n_unitsize, true);
-      n_length += coder.getOutputLength();
+      putText(output, p_data, n_unitsize, b_fold);
     }
 
     p_data += n_unitsize;
-    inputsize -= n_unitsize;
-    if (isFoldingChar(*p_data)) 
-      // the char follows the unit is a delimeter (space or special char)
-      n_length += 3;
-    n_length++;
+    if (p_data >= p_end)
+      break;
+    if (*p_data == '"' && n_delimeter == '"' && !charset.empty()) {
+      int n_quotedelimeter = '"';
+      size_t n_quotesize = findSymbol(p_data + 1, p_end - p_data - 1, 
+        n_quotedelimeter, n_nonascii);
+      if (n_nonascii && p_data + n_quotesize + 1 < p_end) {
+        putEncoded(output, (const unsigned char*) p_data + 1, n_quotesize,
+          selectEncoding(n_quotesize, n_nonascii), charset);
+        p_data += n_quotesize + 2;
+        n_delimeter = 0;
+        continue;
+      }
+    }
+    // the delimeter after the unit (space or special char)
+    putText(output, p_data, 1, b_fold);
+    if (isFoldingChar(*p_data))
+      output.foldpoint = true;
     p_data++;
-    inputsize--;
-  } while (inputsize > 0);
+  }
 
-  if (cMimeEnvironment::autoFolding())
-    n_length += n_length / MAX_MIME_LINE_LEN * 6;
-  return n_length;
+  if (output.spacesize)
+    startWord(output, false);
+  return output.size;
+}
+
+/* cFieldCodeBase::reserve - Room for the next p_size bytes, NULL when
+ * measuring or when they do not fit. Nothing is written after that.
+ */
+unsigned char* cFieldCodeBase::reserve (fieldOutput& p_out, 
+    size_t p_size) const {
+  if (p_out.full)
+    return NULL;
+  unsigned char* p_write = NULL;
+  if (p_out.data != NULL) {
+    if (p_out.size + p_size > p_out.maxsize) {
+      p_out.full = true;
+      return NULL;
+    }
+    p_write = p_out.data + p_out.size;
+  }
+  p_out.size += p_size;
+  p_out.column += p_size;
+  return p_write;
+}
+
+/* cFieldCodeBase::startWord - Write the white space held back before a
+ * word, or fold the line there. A fold after a folding char adds a space.
+ */
+void cFieldCodeBase::startWord (fieldOutput& p_out, bool p_fold) const {
+  if (p_fold) {
+    unsigned char* p_write = reserve(p_out, 2);
+    if (p_write != NULL)
+      memcpy(p_write, "\r\n", 2);
+    p_out.column = 0;
+    if (!p_out.spacesize) {
+      p_out.space = " ";
+      p_out.spacesize = 1;
+    }
+  }
+  if (p_out.spacesize) {
+    unsigned char* p_write = reserve(p_out, p_out.spacesize);
+    if (p_write != NULL)
+      memcpy(p_write, p_out.space, p_out.spacesize);
+    for (size_t i = p_out.spacesize; i > 0; i--) {
+      if (p_out.space[i-1] == '\n') {
+        p_out.column = p_out.spacesize - i;
+        break;
+      }
+    }
+  }
+  p_out.spacesize = 0;
+  p_out.linestart = false;
+  p_out.foldpoint = false;
+}
+
+/* cFieldCodeBase::putText - Copy text word by word, folding before a word
+ * that would run past the line if p_fold
+ */
+void cFieldCodeBase::putText (fieldOutput& p_out, const char* p_data, 
+    size_t p_size, bool p_fold) const {
+  const char* p_end = p_data + p_size;
+  while (p_data < p_end) {
+    const char* p_word = p_data;
+    if (cMimeChar::isSpace((unsigned char)*p_data)) {
+      while (p_data < p_end && cMimeChar::isSpace((unsigned char)*p_data))
+        p_data++;
+      // white space in a row is one piece of the input
+      if (!p_out.spacesize)
+        p_out.space = p_word;
+      p_out.spacesize += p_data - p_word;
+      continue;
+    }
+
+    while (p_data < p_end && !cMimeChar::isSpace((unsigned char)*p_data))
+      p_data++;
+    size_t n_size = p_data - p_word;
+    bool b_fold = false;
+    if (p_fold && !p_out.linestart && (p_out.spacesize || p_out.foldpoint)) {
+      // specials after the word stick to it up to the next white space
+      const char* p_next = p_data;
+      const char* p_inputend = (const char*) m_input + m_inputsize;
+      while (p_next < p_inputend && 
+          !cMimeChar::isSpace((unsigned char)*p_next) && 
+          (p_next == p_data || !isFoldingChar(p_next[-1])))
+        p_next++;
+      b_fold = p_out.column + p_out.spacesize + (p_next - p_word) > 
+        MAX_MIME_LINE_LEN;
+    }
+    startWord(p_out, b_fold);
+    unsigned char* p_write = reserve(p_out, n_size);
+    if (p_write != NULL)
+      memcpy(p_write, p_word, n_size);
+  }
+}
+
+/* qWordCost - Output size of a byte in a Q encoded-word, only characters
+ * that may appear in any encoded-word are written as they are (RFC 2047 5)
+ */
+static size_t qWordCost (unsigned char ch) {
+  return isalnum(ch) || (ch != 0 && strchr("!*+-/", ch) != NULL) ? 1 : 3;
+}
+
+/* cFieldCodeBase::putEncoded - Write encoded-words for p_data. A word
+ * fills up the rest of the line, or starts a new one if little is left,
+ * and never ends inside a UTF-8 character.
+ */
+void cFieldCodeBase::putEncoded (fieldOutput& p_out, 
+    const unsigned char* p_data, size_t p_size, int p_encoding, 
+    const std::string& p_charset) const {
+  static const char* s_qptable = "0123456789ABCDEF";
+  size_t n_overhead = p_charset.size() + 7;
+  ASSERT(n_overhead + 4 <= MAX_ENCODEDWORD_LEN);
+  bool b_utf8 = !strcasecmp(p_charset.c_str(), "utf-8") || 
+    !strcasecmp(p_charset.c_str(), "utf8");
+  bool b_foldpoint = p_out.spacesize || p_out.foldpoint;
+
+  while (p_size > 0 && !p_out.full) {
+    size_t n_column = p_out.column + p_out.spacesize;
+    bool b_fold = b_foldpoint && !p_out.linestart && 
+      n_column + n_overhead + 4 > MAX_MIME_LINE_LEN;
+    if (b_fold)
+      n_column = p_out.spacesize ? p_out.spacesize : 1;
+    size_t n_maxword = MAX_ENCODEDWORD_LEN;
+    if (n_column + n_overhead + 4 <= MAX_MIME_LINE_LEN)
+      n_maxword = std::min(n_maxword, MAX_MIME_LINE_LEN - n_column);
+
+    size_t n_payload = n_maxword - n_overhead, n_used = 0, n_length = 0;
+    if (p_encoding == 'B') {
+      n_used = std::min(p_size, n_payload / 4 * 3);
+    } else {
+      while (n_used < p_size && 
+          n_length + qWordCost(p_data[n_used]) <= n_payload)
+        n_length += qWordCost(p_data[n_used++]);
+    }
+    if (b_utf8 && n_used < p_size) {
+      size_t n_char = n_used;
+      while (n_char > 0 && (p_data[n_char] & 0xc0) == 0x80)
+        n_char--;
+      if (n_char > 0) {
+        n_length -= (n_used - n_char) * 3;
+        n_used = n_char;
+      }
+    }
+    if (p_encoding == 'B')
+      n_length = (n_used + 2) / 3 * 4;
+
+    startWord(p_out, b_fold);
+    unsigned char* p_write = reserve(p_out, n_overhead + n_length);
+    if (p_write != NULL) {
+      *p_write++ = '=';
+      *p_write++ = '?';
+      memcpy(p_write, p_charset.c_str(), p_charset.size());
+      p_write += p_charset.size();
+      *p_write++ = '?';
+      *p_write++ = (unsigned char) p_encoding;
+      *p_write++ = '?';
+      if (p_encoding == 'B') {
+        size_t n_whole = n_used / 3 * 3;
+        p_write += cMimeSimd::base64Encode(p_data, n_whole, p_write, 0);
+        if (n_used > n_whole) {
+          unsigned char tail[3] = { p_data[n_whole], 
+            n_used - n_whole > 1 ? p_data[n_whole+1] : (unsigned char)0, 0 };
+          cMimeSimd::base64Encode(tail, 3, p_write, 0);
+          p_write[3] = '=';
+          if (n_used - n_whole == 1)
+            p_write[2] = '=';
+          p_write += 4;
+        }
+      } else {
+        for (size_t i = 0; i < n_used; i++) {
+          unsigned char ch = p_data[i];
+          if (qWordCost(ch) == 1) {
+            *p_write++ = ch;
+          } else {
+            *p_write++ = '=';
+            *p_write++ = s_qptable[ch >> 4];
+            *p_write++ = s_qptable[ch & 0x0f];
+          }
+        }
+      }
+      *p_write++ = '?';
+      *p_write++ = '=';
+    }
+
+    p_data += n_used;
+    p_size -= n_used;
+    // adjacent encoded-words are separated by a space
+    p_out.space = " ";
+    p_out.spacesize = p_size ? 1 : 0;
+    b_foldpoint = true;
+  }
 }
@@ -21,10 +21,13 @@
 #if !defined(_MIME_CODING_H)
 #define _MIME_CODING_H
 
-#include <list>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <iconv.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/types.h>
 
 // identifier was truncated to 'number' charates in debug
 #pragma warning(disable:4786)
@@ -77,23 +80,72 @@ class cMimeBody;
 class cMimeCodeBase;
 class cFieldCodeBase;
 
+class cMimeContext;
+
+/* cMimeEnvironment - The settings and registries of the calling thread's
+ * context, see cMimeContext. The setters change the global context, which
+ * every thread uses unless it made another one current, so they are not
+ * for use while other threads load or store.
+ */
 class cMimeEnvironment {
   public:
-    cMimeEnvironment();
+    static const cMimeContext& context ();
 
-  public:
     static bool autoFolding ();
     static void autoFolding (bool b_autofolding);
 
     static const char* globalCharset ();
     static void globalCharset (const char* p_charset);
 
+    // Body content larger than the threshold is kept in a temporary file
+    // created in the spill directory, 0 keeps everything in memory
+    static size_t spillThreshold ();
+    static void spillThreshold (size_t p_threshold);
+    static const char* spillDirectory ();
+    static void spillDirectory (const char* p_directory);
+
+    // Cap on the vector instructions the coders use, a cMimeSimd::level.
+    // Defaults to the best the CPU has.
+    static int simdLevel ();
+    static void simdLevel (int p_level);
+
+    // Base64 bodies of at least the threshold are coded in segments on up
+    // to codingThreads() threads, 0 codes them on the calling thread. The
+    // threads default to the number of cores.
+    static size_t parallelThreshold ();
+    static void parallelThreshold (size_t p_threshold);
+    static unsigned codingThreads ();
+    static void codingThreads (unsigned p_threads);
+
     // Content-Transfer-Endcoding management
     typedef cMimeCodeBase* (*CODER_BUILD)();
     static cMimeCodeBase* registerCoder (const char* p_codingname);
     static void registerCoder (const char* p_codingname, 
       CODER_BUILD p_createobject);
 
+    // No coder is registered for the encoding, content is stored and
+    // loaded as it is
+    static bool passthrough (const char* p_codingname);
+
+    // The coders behind an encoding or a field name. Built-in ones run on
+    // the stack with direct calls, CODER_CUSTOM ones are made by their
+    // registered factory.
+    enum coderKind { CODER_COPY, CODER_7BIT, CODER_QP, CODER_BASE64, 
+      CODER_CUSTOM };
+    static int coderKind (const char* p_codingname);
+    enum fieldCoderKind { FIELD_CODER_BASE, FIELD_CODER_TEXT, 
+      FIELD_CODER_ADDRESS, FIELD_CODER_PARAMETER, FIELD_CODER_CUSTOM };
+    static int fieldCoderKind (const char* p_fieldname);
+
+    // Call p_op with the coder of the encoding or field, and whether it is
+    // typed as what it is, true for the built-in coders. Op has a
+    // result_type and a template operator() (coder, direct), see
+    // cMimeCodeWhole.
+    template <class Op> static typename Op::result_type withCoder (
+      const char* p_codingname, Op& p_op);
+    template <class Op> static typename Op::result_type withFieldCoder (
+      const char* p_fieldname, Op& p_op);
+
     // Header fields encoding / folding management
     typedef cFieldCodeBase* (*FIELD_CODER_BUILD)();
     static cFieldCodeBase* registerFieldCoder (const char* p_fieldname);
@@ -107,19 +159,124 @@ class cMimeEnvironment {
       BODY_PART_BUILD p_createobject);
 
   private:
-    static bool m_autofolding;
-    static std::string m_charset;
-
-    typedef std::pair<const char*, CODER_BUILD> CODER_PAIR;
-    static std::list<CODER_PAIR> m_listcoders;
+    static cMimeContext m_global;
+};
 
-    typedef std::pair<const char*, FIELD_CODER_BUILD> FIELD_CODER_PAIR;
-    static std::list<FIELD_CODER_PAIR> m_listfieldcoders;
+/* cMimeContext - The settings and registries loading and storing go by,
+ * with the same meaning as in cMimeEnvironment. A context is built with
+ * its setters and then only read, so any number of threads may share one.
+ * A scope makes it the context of the calling thread:
+ *
+ *   cMimeContext tenant(cMimeEnvironment::context());
+ *   tenant.globalCharset("iso-8859-2");
+ *   ...
+ *   cMimeContext::scope use(tenant);
+ *   mail.load(p_data, n_size);
+ */
+class cMimeContext {
+  public:
+    // The defaults, with the built-in coders registered
+    cMimeContext();
+
+    // Changes with every setting or registration, and is the same only
+    // for a context and its copies as long as neither changes. Output
+    // kept from a store under one stamp holds for another with the same.
+    unsigned long stamp () const { return m_stamp; }
+
+    // Makes the context current in the calling thread until the scope
+    // ends, scopes nest. The context must outlive it.
+    class scope {
+      public:
+        explicit scope (const cMimeContext& p_context);
+        ~scope();
+
+      private:
+        scope (const scope&);
+        scope& operator= (const scope&);
+        const cMimeContext* m_previous;
+    };
+
+    bool autoFolding () const { return m_autofolding; }
+    void autoFolding (bool b_autofolding);
+
+    const char* globalCharset () const { return m_charset.c_str(); }
+    void globalCharset (const char* p_charset);
+
+    size_t spillThreshold () const { return m_spillthreshold; }
+    void spillThreshold (size_t p_threshold);
+    const char* spillDirectory () const;
+    void spillDirectory (const char* p_directory);
+
+    int simdLevel () const { return m_simdlevel; }
+    void simdLevel (int p_level);
+
+    size_t parallelThreshold () const { return m_parallelthreshold; }
+    void parallelThreshold (size_t p_threshold);
+    unsigned codingThreads () const;
+    void codingThreads (unsigned p_threads);
+
+    cMimeCodeBase* registerCoder (const char* p_codingname) const;
+    void registerCoder (const char* p_codingname, 
+      cMimeEnvironment::CODER_BUILD p_createobject);
+    bool passthrough (const char* p_codingname) const;
+    int coderKind (const char* p_codingname) const;
+
+    cFieldCodeBase* registerFieldCoder (const char* p_fieldname) const;
+    void registerFieldCoder (const char* p_fieldname, 
+      cMimeEnvironment::FIELD_CODER_BUILD p_createobject);
+    int fieldCoderKind (const char* p_fieldname) const;
+
+    cMimeBody* createBodyPart (const char* p_mediatype) const;
+    void registerMediaType (const char* p_mediatype, 
+      cMimeEnvironment::BODY_PART_BUILD p_createobject);
 
-    typedef std::pair<const char*, BODY_PART_BUILD> MEDIA_TYPE_PAIR;
-    static std::list<MEDIA_TYPE_PAIR> m_listmediatypes;
+  private:
+    unsigned long m_stamp;
+    void changed ();
 
-    static cMimeEnvironment m_globalmanager;
+    bool m_autofolding;
+    std::string m_charset;
+    size_t m_spillthreshold;
+    std::string m_spilldirectory;
+    int m_simdlevel;
+    size_t m_parallelthreshold;
+    unsigned m_codingthreads;
+
+    // Registries keyed by copies of the names as registered, which compare
+    // without case like encodings, field names and media types do
+    struct caselessHash {
+      size_t operator() (const std::string& p_name) const;
+    };
+    struct caselessEqual {
+      bool operator() (const std::string& p_name1, 
+          const std::string& p_name2) const {
+        return p_name1.size() == p_name2.size() && 
+          !strcasecmp(p_name1.c_str(), p_name2.c_str());
+      }
+    };
+    // A name to look up as a key, in a buffer of the calling thread that
+    // only allocates when a name outgrows it
+    static const std::string& lookupKey (const char* p_name);
+
+    // Factory with its coderKind or fieldCoderKind, set on registration
+    template <class BUILD> struct registryEntry {
+      BUILD build;
+      int kind;
+    };
+    typedef std::unordered_map<std::string, 
+      registryEntry<cMimeEnvironment::CODER_BUILD>, caselessHash, 
+      caselessEqual> CODER_MAP;
+    CODER_MAP m_coders;
+
+    typedef std::unordered_map<std::string, 
+      registryEntry<cMimeEnvironment::FIELD_CODER_BUILD>, caselessHash, 
+      caselessEqual> FIELD_CODER_MAP;
+    FIELD_CODER_MAP m_fieldcoders;
+
+    typedef std::unordered_map<std::string, 
+      cMimeEnvironment::BODY_PART_BUILD, caselessHash, caselessEqual> 
+      MEDIA_TYPE_MAP;
+    MEDIA_TYPE_MAP m_mediatypes;
 };
 
 /* cMimeCodeBase
@@ -129,29 +286,93 @@ class cMimeEnvironment {
 class cMimeCodeBase {
   public:
     cMimeCodeBase();
-
-    void setInput (const char* p_input, int p_inputsize, bool p_encoding);
-    int getOutputLength() const;
-    int getOutput (unsigned char* p_optout, int p_maxsize);
+    virtual ~cMimeCodeBase() {}
+
+    void setInput (const char* p_input, size_t p_inputsize, bool p_encoding);
+    size_t getOutputLength() const;
+    ssize_t getOutput (unsigned char* p_optout, size_t p_maxsize);
+
+    // Streaming: begin(), then update() with each chunk of input and
+    // finish() after the last one. After each of them getOutputLength() and
+    // getOutput() give the output of the input that can be coded so far,
+    // the rest is kept for the next chunk. The output joined together is
+    // the same as coding the whole input at once.
+    void begin (bool p_encoding);
+    void update (const char* p_input, size_t p_inputsize);
+    void finish ();
+
+    // getOutputLength() and getOutput() with p_direct calls to the
+    // overrides of C, which must be the type of the coder and befriend
+    // cMimeCodeBase. A stream goes through getOutput() anyway.
+    template <class C> static size_t outputLength (const C& p_coder, 
+      bool p_direct);
+    template <class C> static ssize_t output (C& p_coder, 
+      unsigned char* p_output, size_t p_maxsize, bool p_direct);
 
   protected:
-    virtual int getEncodeLength() const;
-    virtual int getDecodeLength() const;
-    virtual int encode (unsigned char* p_output, int p_maxsize) const;
-    virtual int decode (unsigned char* p_output, int p_maxsize);
+    virtual size_t getEncodeLength() const;
+    virtual size_t getDecodeLength() const;
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const;
+    virtual ssize_t decode (unsigned char* p_output, size_t p_maxsize);
+
+    // Leading bytes of the m_inputsize pending bytes that code the same
+    // whatever input follows them. A decoder may instead lower m_inputsize
+    // to what it used. streamAdvance() sees the m_inputsize bytes coded
+    // before they are dropped.
+    virtual size_t streamPrefix() const;
+    virtual void streamAdvance (size_t p_size);
+    bool streamMore() const { return m_streaming && !m_final; }
 
     const unsigned char* m_input;
-    int m_inputsize;
+    size_t m_inputsize;
     bool m_isencoding;
+    bool m_streaming;
+    bool m_final;
+    size_t m_streamoffset;   // stream offset of m_input
+    size_t m_streamsize;     // input at m_input, known to follow
+
+  private:
+    std::string m_pending;
+};
+
+/* cMimeFold - Folds long lines before white space and unfolds header
+ * fields, each in one forward pass. A line is held back from its last fold
+ * point only, so nothing written is ever moved.
+ */
+class cMimeFold {
+  public:
+    cMimeFold (size_t p_maxline = MAX_MIME_LINE_LEN);
+
+    // Fold into p_output, or just measure if it's NULL. Returns the output
+    // size.
+    size_t fold (const unsigned char* p_input, size_t p_size, 
+      unsigned char* p_output, size_t p_maxsize) const;
+
+    // Replace each line break and the white space after it with a space,
+    // p_output may be p_input. Returns the output size.
+    static size_t unfold (const unsigned char* p_input, size_t p_size,
+      unsigned char* p_output);
+
+  private:
+    size_t m_maxline;
+};
+
+/* cMimeCodeCopy - for content stored and loaded as it is, 7bit/8bit
+ * without folding, binary and unregistered encodings
+ */
+class cMimeCodeCopy : public cMimeCodeBase {
+  DECLARE_MIMECODER(cMimeCodeCopy)
 };
 
 /* cMimeCode7bit - for handling 7bit/8bit (fold long line) */
 class cMimeCode7bit : public cMimeCodeBase {
   DECLARE_MIMECODER(cMimeCode7bit)
+  friend class cMimeCodeBase;
 
   protected:
-    virtual int getEncodeLength() const;
-    virtual int encode (unsigned char* p_output, int p_maxsize) const;
+    virtual size_t getEncodeLength() const;
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const;
+    virtual size_t streamPrefix() const;
 };
 
 /* cMimeCodeQP - for handling quoted-printable */
@@ -160,15 +381,32 @@ class cMimeCodeQP : public cMimeCodeBase {
     cMimeCodeQP();
 
     DECLARE_MIMECODER(cMimeCodeQP)
+    friend class cMimeCodeBase;
     void quoteLineBreak(bool p_quote=true);
 
   protected:
-    virtual int getEncodeLength() const;
-    virtual int encode (unsigned char* p_output, int p_maxsize) const;
-    virtual int decode (unsigned char* p_output, int p_maxsize);
+    virtual size_t getEncodeLength() const;
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const;
+    virtual ssize_t decode (unsigned char* p_output, size_t p_maxsize);
+    virtual size_t streamPrefix() const;
+    virtual void streamAdvance (size_t p_size);
 
   private:
     bool m_quotelinebreak;
+    unsigned char m_before[2];   // the input that came before, streaming
+
+    // One encoded line: the input it takes, including a hard line break,
+    // the input bytes written as =XX and the output length with the break
+    struct qpLine {
+      size_t end;
+      size_t textend;
+      size_t length;
+      bool soft;
+      size_t quoted[MAX_MIME_LINE_LEN / 3 + 1];
+      int quotedcount;
+    };
+    void planLine (size_t p_start, qpLine& p_line) const;
+    bool afterLineBreak (size_t p_pos) const;
 };
 
 /* cMimeCodeBase64 - for handling base64 */
@@ -177,25 +415,94 @@ class cMimeCodeBase64 : public cMimeCodeBase {
     cMimeCodeBase64();
 
     DECLARE_MIMECODER(cMimeCodeBase64)
+    friend class cMimeCodeBase;
     void addLineBreak (bool add=true);
 
+    // Input offset of the first invalid byte of the last decode: a byte
+    // outside the alphabet and white space, a misplaced or missing '=', or
+    // a lone character in the last group. -1 when the input was valid.
+    ssize_t errorOffset() const { return m_erroroffset; }
+
   protected:
-    virtual int getEncodeLength() const;
-    virtual int getDecodeLength() const;
-    virtual int encode (unsigned char* p_output, int p_maxsize) const;
-    virtual int decode (unsigned char* p_output, int p_maxsize);
+    virtual size_t getEncodeLength() const;
+    virtual size_t getDecodeLength() const;
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const;
+    virtual ssize_t decode (unsigned char* p_output, size_t p_maxsize);
+    virtual size_t streamPrefix() const;
 
   private:
     bool m_addlinebreak;
+    ssize_t m_erroroffset;
 
-    static inline int decodeBase64Char (unsigned int code) {
-      if (code >= 'A' && code <= 'Z') return code - 'A';
-      if (code >= 'a' && code <= 'z') return code - 'a' + 26;
-      if (code >= '0' && code <= '9') return code - '0' + 52;
-      if (code == '+') return 62;
-      if (code == '/') return 64;
-      return 64;
-    }
+    size_t parallelEncode (unsigned char* p_output, size_t p_size, 
+      size_t p_linesize) const;
+    bool parallelDecode (unsigned char* p_output, size_t p_maxsize,
+      size_t* p_size);
+};
+
+/* cMimeAutoEncoding - The transfer encoding that codes a payload in the
+ * fewest bytes, from one scan of it. 7bit and 8bit take lines of up to 998
+ * bytes (76 while auto folding refolds them) and no NUL or bare CR or LF;
+ * 8bit only if the transport takes it. Other payloads with NUL or bare
+ * line breaks are binary and go to base64.
+ */
+class cMimeAutoEncoding {
+  public:
+    cMimeAutoEncoding (const unsigned char* p_data, size_t p_size, 
+      bool p_allow8bit = false);
+
+    const char* encoding () const { return m_encoding; }
+    // Exact size of the payload in that encoding
+    size_t encodedLength () const { return m_length; }
+
+  private:
+    const char* m_encoding;
+    size_t m_length;
+};
+
+/* cMimeCodeCharset - Converts text in a charset to UTF-8 when decoding, a
+ * header value at once or a body part streamed. US-ASCII and UTF-8 are
+ * validated, ISO-8859 and windows-125x mapped by table and the others, the
+ * CJK charsets among them, converted with iconv. Invalid bytes become
+ * U+FFFD. Encoding copies.
+ */
+class cMimeCodeCharset : public cMimeCodeBase {
+  public:
+    cMimeCodeCharset (const char* p_charset = NULL);
+    virtual ~cMimeCodeCharset();
+
+    const char* charset () const;
+    void charset (const char* p_charset);
+    // The charset is known, unknown ones are read as UTF-8
+    bool supported () const;
+
+  protected:
+    virtual size_t getDecodeLength() const;
+    virtual ssize_t decode (unsigned char* p_output, size_t p_maxsize);
+
+  private:
+    enum kind { CHARSET_UTF8, CHARSET_LATIN1, CHARSET_TABLE, CHARSET_ICONV };
+
+    // Code points of the bytes from 0x80 up of a single byte charset, by
+    // its name in lower case letters and digits (mimecharset.cpp)
+    struct charsetTable {
+      const char* name;
+      unsigned short high[128];
+    };
+    static const charsetTable m_tables[];
+
+    std::string m_charset;
+    int m_kind;
+    bool m_supported;
+    const unsigned short* m_table;
+    iconv_t m_iconv;
+
+    size_t utf8Decode (unsigned char* p_output);
+    size_t tableDecode (unsigned char* p_output);
+    size_t iconvDecode (unsigned char* p_output, size_t p_maxsize);
+
+    cMimeCodeCharset (const cMimeCodeCharset&);
+    cMimeCodeCharset& operator= (const cMimeCodeCharset&);
 };
 
 /* cMimeEncodedWord - encoded word for non-ascii text (RFC 2047) */
@@ -207,38 +514,90 @@ class cMimeEncodedWord : public cMimeCodeBase {
     void encoding (int p_encoding, const char* p_charset);
     const char* charset() const;
 
+    // Decode to UTF-8, each word from its own charset and the text between
+    // them as UTF-8 (see cMimeCodeCharset)
+    void utf8Output (bool p_utf8 = true);
+
+    // Decode a header value in [p_begin, p_end) into p_buffer and point
+    // p_text at it, or at the value itself if it has no encoded-words (and
+    // is ASCII, for UTF-8). Returns the size of the text.
+    static size_t decodeValue (const char* p_begin, const char* p_end,
+      std::string& p_buffer, const char** p_text, bool p_utf8 = false);
+
   protected:
-    virtual int getEncodeLength() const;
-    virtual int encode (unsigned char* p_output, int p_maxsize) const;
-    virtual int decode (unsigned char* p_output, int p_maxsize);
+    virtual size_t getEncodeLength() const;
+    virtual size_t getDecodeLength() const;
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const;
+    virtual ssize_t decode (unsigned char* p_output, size_t p_maxsize);
+    virtual size_t streamPrefix() const;
 
   private:
     int m_encoding;
     std::string m_charset;
+    bool m_afterword;     // streaming decode stopped after an encoded-word
+    bool m_utf8;
+    std::string m_word;   // adjacent words decoded, not yet in UTF-8
+    std::string m_wordcharset;
 
-    int base64Encode (unsigned char* p_output, int p_maxsize) const;
-    int QPEncode (unsigned char* p_output, int p_maxsize) const;
+    size_t flushWords (unsigned char* p_output, size_t p_maxsize);
+
+    ssize_t base64Encode (unsigned char* p_output, size_t p_maxsize) const;
+    ssize_t QPEncode (unsigned char* p_output, size_t p_maxsize) const;
 };
 
 /* cFieldCodeBase - Base class to encode/decode header fields. Default coder
  * for unregsitered fields
  */
 class cFieldCodeBase : public cMimeCodeBase {
+  friend class cMimeCodeBase;
+
   public:
+    cFieldCodeBase();
+
     const char* charset () const;
     void charset (const char* p_charset);
 
+    // Column the value starts at on its first line, after the field name
+    void column (size_t p_column) { m_column = p_column; }
+
   protected:
     std::string m_charset;
 
     virtual bool isFoldingChar (char /*ch*/) const { return false; }
     virtual int getDelimeter() const { return 0; }
-    int findSymbol (const char* p_data, int p_size, int& p_delimeter,
-      int& p_nonAscChars) const;
-    void unfoldField (std::string& p_field) const;
-    int selectEncoding (int p_length, int p_nonasciichars) const;
+    size_t findSymbol (const char* p_data, size_t p_size, int& p_delimeter,
+      size_t& p_nonAscChars) const;
+    int selectEncoding (size_t p_length, size_t p_nonasciichars) const;
 
-    virtual int getEncodeLength() const;
+    virtual size_t getEncodeLength() const;
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const;
+    virtual ssize_t decode (unsigned char* p_output, size_t p_maxsize);
+
+  private:
+    size_t m_column;
+
+    // Where encodeField() writes, white space is held back until the next
+    // word shows if the line folds there
+    struct fieldOutput {
+      unsigned char* data;      // NULL when measuring
+      size_t size;
+      size_t maxsize;
+      bool full;
+      size_t column;
+      bool linestart;           // no word on the line yet
+      const char* space;
+      size_t spacesize;
+      bool foldpoint;           // may fold before the next word
+    };
+
+    bool isPlain () const;
+    size_t encodeField (unsigned char* p_output, size_t p_maxsize) const;
+    unsigned char* reserve (fieldOutput& p_out, size_t p_size) const;
+    void startWord (fieldOutput& p_out, bool p_fold) const;
+    void putText (fieldOutput& p_out, const char* p_data, size_t p_size,
+      bool p_fold) const;
+    void putEncoded (fieldOutput& p_out, const unsigned char* p_data, 
+      size_t p_size, int p_encoding, const std::string& p_charset) const;
 };
 
 /* cFieldCodeText - encode / decode header fields as text */
@@ -262,8 +621,90 @@ class cFieldCodeParameter : public cFieldCodeBase {
   DECLARE_FIELDCODER(cFieldCodeParameter)
 
   protected:
-    virtual bool isFoldingCHar(char ch) const { return ch == ';'; }
+    virtual bool isFoldingChar(char ch) const { return ch == ';'; }
+};
+
+/* cMimeCodeWhole - Op for cMimeEnvironment::withCoder(), codes a whole
+ * input or measures its output if output is NULL. Field coders are given
+ * the charset and column.
+ */
+struct cMimeCodeWhole {
+  typedef ssize_t result_type;
+  const char* input;
+  size_t size;
+  bool encoding;
+  unsigned char* output;
+  size_t maxsize;
+  const char* charset;
+  size_t column;
+
+  void prepare (cMimeCodeBase&) const {}
+  void prepare (cFieldCodeBase& p_coder) const {
+    p_coder.charset(charset != NULL ? charset : "");
+    p_coder.column(column);
+  }
+  template <class C> ssize_t operator() (C& p_coder, bool p_direct) const {
+    prepare(p_coder);
+    p_coder.setInput(input, size, encoding);
+    if (output == NULL)
+      return cMimeCodeBase::outputLength(p_coder, p_direct);
+    return cMimeCodeBase::output(p_coder, output, maxsize, p_direct);
+  }
 };
 
+template <class C> inline size_t cMimeCodeBase::outputLength (
+    const C& p_coder, bool p_direct) {
+  if (!p_direct)
+    return p_coder.getOutputLength();
+  return p_coder.m_isencoding ? p_coder.C::getEncodeLength() : 
+    p_coder.C::getDecodeLength();
+}
+
+template <class C> inline ssize_t cMimeCodeBase::output (C& p_coder,
+    unsigned char* p_output, size_t p_maxsize, bool p_direct) {
+  if (!p_direct || p_coder.m_streaming)
+    return p_coder.getOutput(p_output, p_maxsize);
+  return p_coder.m_isencoding ? p_coder.C::encode(p_output, p_maxsize) :
+    p_coder.C::decode(p_output, p_maxsize);
+}
+
+template <class Op> inline typename Op::result_type 
+    cMimeEnvironment::withCoder (const char* p_codingname, Op& p_op) {
+  const cMimeContext& current = context();
+  switch (current.coderKind(p_codingname)) {
+    case CODER_COPY: { cMimeCodeCopy coder; return p_op(coder, true); }
+    case CODER_7BIT: { cMimeCode7bit coder; return p_op(coder, true); }
+    case CODER_QP: { cMimeCodeQP coder; return p_op(coder, true); }
+    case CODER_BASE64: { cMimeCodeBase64 coder; return p_op(coder, true); }
+  }
+  cMimeCodeBase* coder = current.registerCoder(p_codingname);
+  ASSERT(coder != NULL);
+  typename Op::result_type result = p_op(*coder, false);
+  delete coder;
+  return result;
+}
+
+template <class Op> inline typename Op::result_type 
+    cMimeEnvironment::withFieldCoder (const char* p_fieldname, Op& p_op) {
+  const cMimeContext& current = context();
+  switch (current.fieldCoderKind(p_fieldname)) {
+    case FIELD_CODER_BASE: { cFieldCodeBase coder; return p_op(coder, true); }
+    case FIELD_CODER_TEXT: { cFieldCodeText coder; return p_op(coder, true); }
+    case FIELD_CODER_ADDRESS: { 
+      cFieldCodeAddress coder; 
+      return p_op(coder, true); 
+    }
+    case FIELD_CODER_PARAMETER: { 
+      cFieldCodeParameter coder; 
+      return p_op(coder, true); 
+    }
+  }
+  cFieldCodeBase* coder = current.registerFieldCoder(p_fieldname);
+  ASSERT(coder != NULL);
+  typename Op::result_type result = p_op(*coder, false);
+  delete coder;
+  return result;
+}
+
 #endif
 
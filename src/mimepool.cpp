@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2015 Dan Nielsen <dnielsen@fastmail.fm>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "mimepool.h"
+
+/* cWorkers - The threads of the pool, and the one job they work on */
+class cWorkers {
+  public:
+    cWorkers();
+    ~cWorkers();
+
+    bool run (size_t p_count, unsigned p_threads,
+      const std::function<void (size_t)>& p_task);
+
+  private:
+    void work ();
+    void runTasks ();
+
+    std::mutex m_jobmutex;        // held for the whole of a job
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::vector<std::thread> m_threads;
+
+    const std::function<void (size_t)>* m_task;
+    size_t m_count;
+    std::atomic<size_t> m_next;
+    unsigned m_generation;
+    unsigned m_wanted;            // workers yet to join the job
+    unsigned m_running;           // workers in the job
+    bool m_stop;
+};
+
+cWorkers::cWorkers() :
+  m_task(NULL),
+  m_count(0),
+  m_next(0),
+  m_generation(0),
+  m_wanted(0),
+  m_running(0),
+  m_stop(false) {}
+
+cWorkers::~cWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (size_t i = 0; i < m_threads.size(); i++)
+    m_threads[i].join();
+}
+
+void cWorkers::runTasks () {
+  for (size_t i = m_next++; i < m_count; i = m_next++)
+    (*m_task)(i);
+}
+
+void cWorkers::work () {
+  unsigned generation = 0;
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (;;) {
+    m_wake.wait(lock, [&] { 
+      return m_stop || (generation != m_generation && m_wanted > 0); 
+    });
+    if (m_stop)
+      return;
+    generation = m_generation;
+    m_wanted--;
+    m_running++;
+    lock.unlock();
+    runTasks();
+    lock.lock();
+    if (--m_running == 0 && m_wanted == 0)
+      m_done.notify_all();
+  }
+}
+
+/* cWorkers::run - The caller takes tasks too, then waits for the workers it
+ * asked for to join and finish, so none of them outlives p_task
+ */
+bool cWorkers::run (size_t p_count, unsigned p_threads,
+    const std::function<void (size_t)>& p_task) {
+  std::unique_lock<std::mutex> job(m_jobmutex, std::try_to_lock);
+  if (!job.owns_lock())
+    return false;
+
+  unsigned helpers = p_threads - 1;
+  if (helpers > p_count - 1)
+    helpers = p_count - 1;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (m_threads.size() < helpers)
+      m_threads.push_back(std::thread(&cWorkers::work, this));
+    m_task = &p_task;
+    m_count = p_count;
+    m_next = 0;
+    m_generation++;
+    m_wanted = helpers;
+  }
+  m_wake.notify_all();
+
+  runTasks();
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [&] { return m_wanted == 0 && m_running == 0; });
+  m_task = NULL;
+  return true;
+}
+
+void cMimePool::run (size_t p_count, unsigned p_threads,
+    const std::function<void (size_t)>& p_task) {
+  static cWorkers s_workers;
+  if (p_count == 0)
+    return;
+  if (p_threads > 1 && p_count > 1 && s_workers.run(p_count, p_threads, 
+      p_task))
+    return;
+  for (size_t i = 0; i < p_count; i++)
+    p_task(i);
+}
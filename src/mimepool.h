@@ -0,0 +1,36 @@
+/* mimepool.h - Worker threads that code the segments of a large body in
+ * parallel
+ *
+ * Copyright (C) 2015 Dan Nielsen <dnielsen@fastmail.fm>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * #include "mimepool.h"
+ */
+#if !defined(_MIME_POOL_H)
+#define _MIME_POOL_H
+
+#include <stddef.h>
+#include <functional>
+
+class cMimePool {
+  public:
+    // Run p_task(0) to p_task(p_count-1) on up to p_threads threads, the
+    // calling one included, and return when all have finished. The threads
+    // are started on first use and kept. A job that finds the pool busy
+    // with another runs in the calling thread alone.
+    static void run (size_t p_count, unsigned p_threads,
+      const std::function<void (size_t)>& p_task);
+};
+#endif // _MIME_POOL_H
@@ -0,0 +1,1592 @@
+/*
+ * Copyright (C) 2015 Dan Nielsen <dnielsen@fastmail.fm>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "mimesimd.h"
+#include "mimechar.h"
+#include "mimecode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIME_SIMD_X86
+#include <immintrin.h>
+#endif
+
+static const char s_base64Table[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Encode a multiple of 3 bytes to base64 without line breaks */
+typedef size_t (*BASE64_BLOCKS)(const unsigned char*, size_t,
+  unsigned char*);
+
+static size_t base64BlocksScalar (const unsigned char* p_input,
+    size_t p_size, unsigned char* p_output) {
+  unsigned char* p_outstart = p_output;
+  for (const unsigned char* p_end = p_input + p_size; p_input < p_end;
+      p_input += 3) {
+    unsigned int group = (p_input[0] << 16) | (p_input[1] << 8) | p_input[2];
+    *p_output++ = s_base64Table[group >> 18];
+    *p_output++ = s_base64Table[(group >> 12) & 0x3f];
+    *p_output++ = s_base64Table[(group >> 6) & 0x3f];
+    *p_output++ = s_base64Table[group & 0x3f];
+  }
+  return p_output - p_outstart;
+}
+
+#if defined(MIME_SIMD_X86)
+/* base64Ssse3 - Encode the 12 bytes at p_offset of a register to 16
+ * characters, the reshuffle and multiply scheme of Wojciech Mula
+ */
+__attribute__((target("ssse3")))
+static inline __m128i base64Ssse3 (__m128i in, int p_offset) {
+  const __m128i shuffle = _mm_add_epi8(_mm_set1_epi8(p_offset),
+    _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+  in = _mm_shuffle_epi8(in, shuffle);
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  __m128i indices = _mm_or_si128(t1, t3);
+
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, '+' 11, '/' 12
+  __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+  const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, result), indices);
+}
+
+/* base64BlocksSsse3 - 12 bytes at a time. Loads stay inside the input: the
+ * last block reads the 16 bytes that end the input and overlaps output
+ * already written with the same characters.
+ */
+__attribute__((target("ssse3")))
+static size_t base64BlocksSsse3 (const unsigned char* p_input,
+    size_t p_size, unsigned char* p_output) {
+  size_t i = 0, o = 0;
+  for (; p_size - i >= 16; i += 12, o += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i));
+    _mm_storeu_si128((__m128i*)(p_output + o), base64Ssse3(in, 0));
+  }
+  if (i == p_size)
+    return o;
+  if (p_size < 16)
+    return o + base64BlocksScalar(p_input + i, p_size - i, p_output + o);
+
+  if (p_size - i > 12) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i - 4));
+    _mm_storeu_si128((__m128i*)(p_output + o), base64Ssse3(in, 4));
+  }
+  __m128i in = _mm_loadu_si128((const __m128i*)(p_input + p_size - 16));
+  _mm_storeu_si128((__m128i*)(p_output + (p_size - 12) / 3 * 4),
+    base64Ssse3(in, 4));
+  return p_size / 3 * 4;
+}
+
+/* base64Avx2 - The SSSE3 scheme on both lanes, 24 bytes to 32 characters.
+ * The low lane takes bytes 0..11 of p_input, the high lane bytes 4..15 of
+ * p_input + 8, so exactly 24 bytes are read.
+ */
+__attribute__((target("avx2")))
+static inline __m256i base64Avx2 (const unsigned char* p_input) {
+  __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+    _mm_loadu_si128((const __m128i*)p_input)),
+    _mm_loadu_si128((const __m128i*)(p_input + 8)), 1);
+  in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+    5, 4, 6, 5, 8, 7, 9, 8, 11, 10, 12, 11, 14, 13, 15, 14));
+  __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+  __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+  __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+  __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+  __m256i indices = _mm256_or_si256(t1, t3);
+
+  __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+  __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+  result = _mm256_or_si256(result,
+    _mm256_and_si256(less, _mm256_set1_epi8(13)));
+  const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, result), indices);
+}
+
+__attribute__((target("avx2")))
+static size_t base64BlocksAvx2 (const unsigned char* p_input,
+    size_t p_size, unsigned char* p_output) {
+  if (p_size < 24)
+    return base64BlocksSsse3(p_input, p_size, p_output);
+  size_t i = 0, o = 0;
+  for (; p_size - i >= 24; i += 24, o += 32)
+    _mm256_storeu_si256((__m256i*)(p_output + o), base64Avx2(p_input + i));
+  if (i < p_size) {
+    _mm256_storeu_si256((__m256i*)(p_output + (p_size - 24) / 3 * 4),
+      base64Avx2(p_input + p_size - 24));
+  }
+  return p_size / 3 * 4;
+}
+
+/* base64BlocksAvx512 - 48 bytes to 64 characters with VBMI byte permutes
+ * and multishifts. The tail is a masked block, nothing is read or written
+ * past either buffer.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static size_t base64BlocksAvx512 (const unsigned char* p_input,
+    size_t p_size, unsigned char* p_output) {
+  const __m512i shuffle = _mm512_setr_epi32(
+    0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+    0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+    0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+    0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+  const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040aLL);
+  const __m512i table = _mm512_loadu_si512(s_base64Table);
+
+  size_t i = 0, o = 0;
+  while (i < p_size) {
+    size_t inbytes = p_size - i < 48 ? p_size - i : 48;
+    __mmask64 inmask = inbytes < 48 ?
+      ((__mmask64)1 << inbytes) - 1 : 0xffffffffffffULL;
+    __mmask64 outmask = inbytes < 48 ?
+      ((__mmask64)1 << (inbytes / 3 * 4)) - 1 : ~(__mmask64)0;
+    __m512i in = _mm512_maskz_loadu_epi8(inmask, p_input + i);
+    in = _mm512_permutexvar_epi8(shuffle, in);
+    __m512i indices = _mm512_multishift_epi64_epi8(shifts, in);
+    _mm512_mask_storeu_epi8(p_output + o, outmask,
+      _mm512_permutexvar_epi8(indices, table));
+    i += inbytes;
+    o += inbytes / 3 * 4;
+  }
+  return o;
+}
+#endif // MIME_SIMD_X86
+
+/* Base64 decoding goes over the input in chunks, in two passes. The first
+ * translates alphabet characters to their 6-bit values and packs them 
+ * together, dropping white space, and stops at any other byte. The second
+ * turns each 4 values into 3 bytes.
+ */
+typedef size_t (*BASE64_VALUES)(const unsigned char*, size_t,
+  unsigned char*, size_t*);
+typedef void (*BASE64_PACK)(const unsigned char*, size_t, unsigned char*);
+
+// 6-bit values of the alphabet, 0x40 for white space, 0x80 for the rest
+static const unsigned char s_base64Values[256] = {
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x40, 0x80, 0x80, 0x40, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x40, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+static size_t base64ValuesScalar (const unsigned char* p_input, 
+    size_t p_size, unsigned char* p_values, size_t* p_read) {
+  size_t count = 0, i;
+  for (i = 0; i < p_size; i++) {
+    unsigned char value = s_base64Values[p_input[i]];
+    if (value < 0x40) {
+      p_values[count++] = value;
+    } else if (value != 0x40) {
+      break;
+    }
+  }
+  *p_read = i;
+  return count;
+}
+
+static void base64PackScalar (const unsigned char* p_values, size_t p_count,
+    unsigned char* p_output) {
+  for (size_t i = 0; i < p_count; i += 4) {
+    unsigned int group = (p_values[i] << 18) | (p_values[i+1] << 12) |
+      (p_values[i+2] << 6) | p_values[i+3];
+    *p_output++ = (unsigned char)(group >> 16);
+    *p_output++ = (unsigned char)(group >> 8);
+    *p_output++ = (unsigned char)group;
+  }
+}
+
+#if defined(MIME_SIMD_X86)
+/* compactTable - pshufb indices that gather the bytes selected by each 8-bit
+ * mask to the front, and how many there are
+ */
+struct compactTable {
+  unsigned char index[256][8];
+  unsigned char count[256];
+
+  compactTable() {
+    for (int mask = 0; mask < 256; mask++) {
+      int n = 0;
+      for (int bit = 0; bit < 8; bit++) {
+        if (mask & (1 << bit))
+          index[mask][n++] = bit;
+      }
+      count[mask] = n;
+      while (n < 8)
+        index[mask][n++] = 0x80;
+    }
+  }
+};
+static const compactTable s_compact;
+
+/* base64TranslateSsse3 - 6-bit values of 16 characters, with masks of the
+ * alphabet characters and of white space
+ */
+__attribute__((target("ssse3")))
+static inline __m128i base64TranslateSsse3 (__m128i in, unsigned* p_valid,
+    unsigned* p_space) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+    _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+  __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+    _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+    _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+  __m128i plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+  __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+  __m128i shift = _mm_or_si128(
+    _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+      _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+    _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+      _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+        _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+    _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+  __m128i space = _mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(' ')),
+      _mm_cmpeq_epi8(in, _mm_set1_epi8('\t'))),
+    _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('\r')),
+      _mm_cmpeq_epi8(in, _mm_set1_epi8('\n'))));
+  *p_valid = _mm_movemask_epi8(valid);
+  *p_space = _mm_movemask_epi8(space);
+  return _mm_add_epi8(in, shift);
+}
+
+/* base64CompactSsse3 - Store the bytes of p_mask to p_output, writes up to
+ * 16 bytes whatever the count
+ */
+__attribute__((target("ssse3")))
+static inline size_t base64CompactSsse3 (__m128i p_values, unsigned p_mask,
+    unsigned char* p_output) {
+  unsigned lo = p_mask & 0xff, hi = (p_mask >> 8) & 0xff;
+  __m128i index = _mm_unpacklo_epi64(
+    _mm_loadl_epi64((const __m128i*)s_compact.index[lo]),
+    _mm_add_epi8(_mm_loadl_epi64((const __m128i*)s_compact.index[hi]),
+      _mm_set1_epi8(8)));
+  __m128i packed = _mm_shuffle_epi8(p_values, index);
+  _mm_storel_epi64((__m128i*)p_output, packed);
+  _mm_storel_epi64((__m128i*)(p_output + s_compact.count[lo]),
+    _mm_srli_si128(packed, 8));
+  return s_compact.count[lo] + s_compact.count[hi];
+}
+
+__attribute__((target("ssse3")))
+static size_t base64ValuesSsse3 (const unsigned char* p_input,
+    size_t p_size, unsigned char* p_values, size_t* p_read) {
+  size_t i = 0, count = 0;
+  for (; p_size - i >= 16; i += 16) {
+    unsigned valid, space;
+    __m128i values = base64TranslateSsse3(
+      _mm_loadu_si128((const __m128i*)(p_input + i)), &valid, &space);
+    if (valid == 0xffff) {
+      _mm_storeu_si128((__m128i*)(p_values + count), values);
+      count += 16;
+      continue;
+    }
+    unsigned stop = ~(valid | space) & 0xffff;
+    if (stop) {
+      int at = __builtin_ctz(stop);
+      count += base64CompactSsse3(values, valid & ((1u << at) - 1),
+        p_values + count);
+      *p_read = i + at;
+      return count;
+    }
+    count += base64CompactSsse3(values, valid, p_values + count);
+  }
+  size_t read;
+  count += base64ValuesScalar(p_input + i, p_size - i, p_values + count,
+    &read);
+  *p_read = i + read;
+  return count;
+}
+
+/* base64PackSsse3 - 16 values to 12 bytes with two multiply-adds. Each 
+ * store writes 4 bytes past its block, so the last blocks go byte-wise.
+ */
+__attribute__((target("ssse3")))
+static void base64PackSsse3 (const unsigned char* p_values, size_t p_count,
+    unsigned char* p_output) {
+  size_t i = 0;
+  for (; p_count - i >= 24; i += 16, p_output += 12) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p_values + i));
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    v = _mm_shuffle_epi8(v, 
+      _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i*)p_output, v);
+  }
+  base64PackScalar(p_values + i, p_count - i, p_output);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i base64TranslateAvx2 (__m256i in, unsigned* p_valid,
+    unsigned* p_space) {
+  __m256i upper = _mm256_and_si256(
+    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+  __m256i lower = _mm256_and_si256(
+    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+  __m256i digit = _mm256_and_si256(
+    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+  __m256i plus = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('+'));
+  __m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+  __m256i shift = _mm256_or_si256(
+    _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+      _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+    _mm256_or_si256(_mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+      _mm256_or_si256(_mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')),
+        _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')))));
+  __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+    _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+  __m256i space = _mm256_or_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8(' ')),
+      _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\t'))),
+    _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('\r')),
+      _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\n'))));
+  *p_valid = (unsigned)_mm256_movemask_epi8(valid);
+  *p_space = (unsigned)_mm256_movemask_epi8(space);
+  return _mm256_add_epi8(in, shift);
+}
+
+__attribute__((target("avx2")))
+static size_t base64ValuesAvx2 (const unsigned char* p_input,
+    size_t p_size, unsigned char* p_values, size_t* p_read) {
+  size_t i = 0, count = 0;
+  for (; p_size - i >= 32; i += 32) {
+    unsigned valid, space;
+    __m256i values = base64TranslateAvx2(
+      _mm256_loadu_si256((const __m256i*)(p_input + i)), &valid, &space);
+    if (valid == 0xffffffff) {
+      _mm256_storeu_si256((__m256i*)(p_values + count), values);
+      count += 32;
+      continue;
+    }
+    unsigned stop = ~(valid | space);
+    int at = stop ? __builtin_ctz(stop) : 32;
+    if (at < 32)
+      valid &= (1u << at) - 1;
+    count += base64CompactSsse3(_mm256_castsi256_si128(values), valid,
+      p_values + count);
+    count += base64CompactSsse3(_mm256_extracti128_si256(values, 1),
+      valid >> 16, p_values + count);
+    if (at < 32) {
+      *p_read = i + at;
+      return count;
+    }
+  }
+  size_t read;
+  count += base64ValuesSsse3(p_input + i, p_size - i, p_values + count,
+    &read);
+  *p_read = i + read;
+  return count;
+}
+
+__attribute__((target("avx2")))
+static void base64PackAvx2 (const unsigned char* p_values, size_t p_count,
+    unsigned char* p_output) {
+  size_t i = 0;
+  for (; p_count - i >= 44; i += 32, p_output += 24) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p_values + i));
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    v = _mm256_permutevar8x32_epi32(v, 
+      _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256((__m256i*)p_output, v);
+  }
+  base64PackSsse3(p_values + i, p_count - i, p_output);
+}
+
+/* base64ValuesAvx512 - Translation is one two-table byte permute, packing a
+ * byte compress. Masked loads cover the tail.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi,avx512vbmi2,popcnt")))
+static size_t base64ValuesAvx512 (const unsigned char* p_input,
+    size_t p_size, unsigned char* p_values, size_t* p_read) {
+  const __m512i table_lo = _mm512_loadu_si512(s_base64Values);
+  const __m512i table_hi = _mm512_loadu_si512(s_base64Values + 64);
+  size_t i = 0, count = 0;
+  while (i < p_size) {
+    size_t size = p_size - i < 64 ? p_size - i : 64;
+    __mmask64 load = size < 64 ? ((__mmask64)1 << size) - 1 : ~(__mmask64)0;
+    __m512i in = _mm512_maskz_loadu_epi8(load, p_input + i);
+    __m512i values = _mm512_or_si512(
+      _mm512_permutex2var_epi8(table_lo, in, table_hi),
+      _mm512_and_si512(in, _mm512_set1_epi8((char)0x80)));
+    __mmask64 valid = 
+      _mm512_cmplt_epu8_mask(values, _mm512_set1_epi8(0x40)) & load;
+    __mmask64 space = 
+      _mm512_cmpeq_epi8_mask(values, _mm512_set1_epi8(0x40)) & load;
+    __mmask64 stop = ~(valid | space) & load;
+    int at = stop ? __builtin_ctzll(stop) : 64;
+    if (at < 64)
+      valid &= ((__mmask64)1 << at) - 1;
+    _mm512_storeu_si512(p_values + count, 
+      _mm512_maskz_compress_epi8(valid, values));
+    count += __builtin_popcountll(valid);
+    if (at < 64) {
+      *p_read = i + at;
+      return count;
+    }
+    i += size;
+  }
+  *p_read = p_size;
+  return count;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void base64PackAvx512 (const unsigned char* p_values, size_t p_count,
+    unsigned char* p_output) {
+  unsigned char order[64];
+  for (int k = 0; k < 64; k++)
+    order[k] = k < 48 ? (k / 3) * 4 + 2 - k % 3 : 0;
+  const __m512i index = _mm512_loadu_si512(order);
+
+  for (size_t i = 0; i < p_count; i += 64, p_output += 48) {
+    size_t size = p_count - i < 64 ? p_count - i : 64;
+    __mmask64 load = size < 64 ? ((__mmask64)1 << size) - 1 : ~(__mmask64)0;
+    __m512i v = _mm512_maskz_loadu_epi8(load, p_values + i);
+    v = _mm512_maddubs_epi16(v, _mm512_set1_epi32(0x01400140));
+    v = _mm512_madd_epi16(v, _mm512_set1_epi32(0x00011000));
+    v = _mm512_permutexvar_epi8(index, v);
+    _mm512_mask_storeu_epi8(p_output, ((__mmask64)1 << (size / 4 * 3)) - 1,
+      v);
+  }
+}
+#endif // MIME_SIMD_X86
+
+/* Count the alphabet characters up to the first byte that is neither one
+ * nor white space, which is where the input stops being plain groups
+ */
+static size_t base64ScanScalar (const unsigned char* p_input, size_t p_size,
+    size_t* p_values) {
+  size_t count = 0, i;
+  for (i = 0; i < p_size; i++) {
+    unsigned char value = s_base64Values[p_input[i]];
+    if (value < 0x40) {
+      count++;
+    } else if (value != 0x40) {
+      break;
+    }
+  }
+  *p_values += count;
+  return i;
+}
+
+#if defined(MIME_SIMD_X86)
+__attribute__((target("ssse3,popcnt")))
+static size_t base64ScanSsse3 (const unsigned char* p_input, size_t p_size,
+    size_t* p_values) {
+  size_t i = 0;
+  for (; p_size - i >= 16; i += 16) {
+    unsigned valid, space;
+    base64TranslateSsse3(_mm_loadu_si128((const __m128i*)(p_input + i)),
+      &valid, &space);
+    unsigned stop = ~(valid | space) & 0xffff;
+    if (stop) {
+      int at = __builtin_ctz(stop);
+      *p_values += __builtin_popcount(valid & ((1u << at) - 1));
+      return i + at;
+    }
+    *p_values += __builtin_popcount(valid);
+  }
+  return i + base64ScanScalar(p_input + i, p_size - i, p_values);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t base64ScanAvx2 (const unsigned char* p_input, size_t p_size,
+    size_t* p_values) {
+  size_t i = 0;
+  for (; p_size - i >= 32; i += 32) {
+    unsigned valid, space;
+    base64TranslateAvx2(_mm256_loadu_si256((const __m256i*)(p_input + i)),
+      &valid, &space);
+    unsigned stop = ~(valid | space);
+    if (stop) {
+      int at = __builtin_ctz(stop);
+      *p_values += __builtin_popcount(valid & ((1u << at) - 1));
+      return i + at;
+    }
+    *p_values += __builtin_popcount(valid);
+  }
+  return i + base64ScanSsse3(p_input + i, p_size - i, p_values);
+}
+#endif // MIME_SIMD_X86
+
+/* Quoted-printable literals: printable ASCII except '=', and TAB */
+static size_t qpLiteralRunScalar (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t i = 0;
+  for (; i < p_size; i++) {
+    unsigned char ch = p_input[i];
+    if ((ch < 0x20 && ch != '\t') || ch > 0x7e || ch == '=')
+      break;
+  }
+  return i;
+}
+
+#if defined(MIME_SIMD_X86)
+/* qpSpecialSse2 - Mask of the bytes that can't be copied literally. Bytes
+ * from 0x80 up are negative, so one signed compare catches them with the
+ * controls.
+ */
+__attribute__((target("sse2")))
+static inline unsigned qpSpecialSse2 (__m128i in) {
+  __m128i special = _mm_or_si128(
+    _mm_andnot_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('\t')),
+      _mm_cmpgt_epi8(_mm_set1_epi8(0x20), in)),
+    _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(0x7f)),
+      _mm_cmpeq_epi8(in, _mm_set1_epi8('='))));
+  return (unsigned)_mm_movemask_epi8(special);
+}
+
+__attribute__((target("sse2")))
+static size_t qpLiteralRunSse2 (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t i = 0;
+  for (; p_size - i >= 16; i += 16) {
+    unsigned special = qpSpecialSse2(
+      _mm_loadu_si128((const __m128i*)(p_input + i)));
+    if (special)
+      return i + __builtin_ctz(special);
+  }
+  return i + qpLiteralRunScalar(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t qpLiteralRunAvx2 (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t i = 0;
+  for (; p_size - i >= 32; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i*)(p_input + i));
+    __m256i special = _mm256_or_si256(
+      _mm256_andnot_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('\t')),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), in)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x7f)),
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('='))));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(special);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + qpLiteralRunSse2(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t qpLiteralRunAvx512 (const unsigned char* p_input, 
+    size_t p_size) {
+  for (size_t i = 0; i < p_size; i += 64) {
+    size_t size = p_size - i < 64 ? p_size - i : 64;
+    __mmask64 load = size < 64 ? ((__mmask64)1 << size) - 1 : ~(__mmask64)0;
+    __m512i in = _mm512_maskz_loadu_epi8(load, p_input + i);
+    __mmask64 literal = 
+      (_mm512_cmpge_epu8_mask(in, _mm512_set1_epi8(0x20)) &
+       _mm512_cmple_epu8_mask(in, _mm512_set1_epi8(0x7e)) &
+       _mm512_cmpneq_epi8_mask(in, _mm512_set1_epi8('='))) |
+      _mm512_cmpeq_epi8_mask(in, _mm512_set1_epi8('\t'));
+    __mmask64 special = ~literal & load;
+    if (special)
+      return i + __builtin_ctzll(special);
+  }
+  return p_size;
+}
+#endif // MIME_SIMD_X86
+
+/* Quoted-printable decoding stops at '=' and at line ends, where trailing
+ * white space is dropped
+ */
+static size_t qpDecodeRunScalar (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t i = 0;
+  while (i < p_size && p_input[i] != '=' && p_input[i] != '\n')
+    i++;
+  return i;
+}
+
+#if defined(MIME_SIMD_X86)
+__attribute__((target("sse2")))
+static size_t qpDecodeRunSse2 (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t i = 0;
+  for (; p_size - i >= 16; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i));
+    unsigned stop = (unsigned)_mm_movemask_epi8(_mm_or_si128(
+      _mm_cmpeq_epi8(in, _mm_set1_epi8('=')), 
+      _mm_cmpeq_epi8(in, _mm_set1_epi8('\n'))));
+    if (stop)
+      return i + __builtin_ctz(stop);
+  }
+  return i + qpDecodeRunScalar(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t qpDecodeRunAvx2 (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t i = 0;
+  for (; p_size - i >= 32; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i*)(p_input + i));
+    unsigned stop = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+      _mm256_cmpeq_epi8(in, _mm256_set1_epi8('=')), 
+      _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\n'))));
+    if (stop)
+      return i + __builtin_ctz(stop);
+  }
+  return i + qpDecodeRunSse2(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t qpDecodeRunAvx512 (const unsigned char* p_input, 
+    size_t p_size) {
+  for (size_t i = 0; i < p_size; i += 64) {
+    size_t size = p_size - i < 64 ? p_size - i : 64;
+    __mmask64 load = size < 64 ? ((__mmask64)1 << size) - 1 : ~(__mmask64)0;
+    __m512i in = _mm512_maskz_loadu_epi8(load, p_input + i);
+    __mmask64 stop = load &
+      (_mm512_cmpeq_epi8_mask(in, _mm512_set1_epi8('=')) |
+       _mm512_cmpeq_epi8_mask(in, _mm512_set1_epi8('\n')));
+    if (stop)
+      return i + __builtin_ctzll(stop);
+  }
+  return p_size;
+}
+#endif // MIME_SIMD_X86
+
+/* Payload scans reduce each block of bytes to masks, line ends are few
+ * enough to take one by one. p_crcarry is a CR ending the block before.
+ */
+static inline void textMasks (cMimeSimd::textStats* p_stats, size_t p_offset,
+    int p_width, uint64_t p_nonascii, uint64_t p_nul, uint64_t p_cr, 
+    uint64_t p_lf, uint64_t p_quoted, size_t& p_linestart, 
+    bool& p_crcarry) {
+  uint64_t crbefore = (p_cr << 1) | (uint64_t)p_crcarry;
+  p_stats->nonascii += __builtin_popcountll(p_nonascii);
+  p_stats->nul += __builtin_popcountll(p_nul);
+  p_stats->quoted += __builtin_popcountll(p_quoted & ~(p_cr | p_lf));
+  p_stats->barebreaks += __builtin_popcountll(p_cr) + 
+    __builtin_popcountll(p_lf) - 2 * __builtin_popcountll(p_lf & crbefore);
+  for (uint64_t lf = p_lf; lf != 0; lf &= lf - 1) {
+    int bit = __builtin_ctzll(lf);
+    size_t end = p_offset + bit - ((crbefore >> bit) & 1);
+    if (end > p_linestart && end - p_linestart > p_stats->maxline)
+      p_stats->maxline = end - p_linestart;
+    p_linestart = p_offset + bit + 1;
+  }
+  p_crcarry = (p_cr >> (p_width - 1)) & 1;
+}
+
+/* textScanScalar - The masks of up to 64 bytes at a time */
+static void textScanScalar (const unsigned char* p_input, size_t p_size,
+    size_t p_offset, cMimeSimd::textStats* p_stats, size_t& p_linestart,
+    bool& p_crcarry) {
+  for (size_t i = 0; i < p_size; i += 64) {
+    int width = p_size - i < 64 ? (int)(p_size - i) : 64;
+    uint64_t nonascii = 0, nul = 0, cr = 0, lf = 0, quoted = 0;
+    for (int bit = 0; bit < width; bit++) {
+      unsigned char ch = p_input[i + bit];
+      uint64_t mask = (uint64_t)1 << bit;
+      nonascii |= ch & 0x80 ? mask : 0;
+      nul |= ch == 0 ? mask : 0;
+      cr |= ch == '\r' ? mask : 0;
+      lf |= ch == '\n' ? mask : 0;
+      quoted |= (ch < 0x20 && ch != '\t') || ch > 0x7e || ch == '=' ? 
+        mask : 0;
+    }
+    textMasks(p_stats, p_offset + i, width, nonascii, nul, cr, lf, quoted,
+      p_linestart, p_crcarry);
+  }
+}
+
+#if defined(MIME_SIMD_X86)
+__attribute__((target("sse2")))
+static size_t textScanSse2 (const unsigned char* p_input, size_t p_size,
+    cMimeSimd::textStats* p_stats, size_t& p_linestart, bool& p_crcarry) {
+  size_t i = 0;
+  for (; p_size - i >= 16; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i));
+    textMasks(p_stats, i, 16, 
+      (unsigned)_mm_movemask_epi8(in),
+      (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_setzero_si128())),
+      (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('\r'))),
+      (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('\n'))),
+      qpSpecialSse2(in), p_linestart, p_crcarry);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t textScanAvx2 (const unsigned char* p_input, size_t p_size,
+    cMimeSimd::textStats* p_stats, size_t& p_linestart, bool& p_crcarry) {
+  size_t i = 0;
+  for (; p_size - i >= 32; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i*)(p_input + i));
+    __m256i special = _mm256_or_si256(
+      _mm256_andnot_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('\t')),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), in)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x7f)),
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('='))));
+    textMasks(p_stats, i, 32, 
+      (unsigned)_mm256_movemask_epi8(in),
+      (unsigned)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(in, _mm256_setzero_si256())),
+      (unsigned)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\r'))),
+      (unsigned)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\n'))),
+      (unsigned)_mm256_movemask_epi8(special), p_linestart, p_crcarry);
+  }
+  return i;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t textScanAvx512 (const unsigned char* p_input, size_t p_size,
+    cMimeSimd::textStats* p_stats, size_t& p_linestart, bool& p_crcarry) {
+  size_t i = 0;
+  for (; p_size - i >= 64; i += 64) {
+    __m512i in = _mm512_loadu_si512((const void*)(p_input + i));
+    __mmask64 literal = 
+      (_mm512_cmpge_epu8_mask(in, _mm512_set1_epi8(0x20)) &
+       _mm512_cmple_epu8_mask(in, _mm512_set1_epi8(0x7e)) &
+       _mm512_cmpneq_epi8_mask(in, _mm512_set1_epi8('='))) |
+      _mm512_cmpeq_epi8_mask(in, _mm512_set1_epi8('\t'));
+    textMasks(p_stats, i, 64, _mm512_movepi8_mask(in),
+      _mm512_cmpeq_epi8_mask(in, _mm512_setzero_si512()),
+      _mm512_cmpeq_epi8_mask(in, _mm512_set1_epi8('\r')),
+      _mm512_cmpeq_epi8_mask(in, _mm512_set1_epi8('\n')),
+      ~literal, p_linestart, p_crcarry);
+  }
+  return i;
+}
+#endif // MIME_SIMD_X86
+
+/* Header fields: non-ASCII bytes are counted, words end at a delimiter */
+static size_t nonAsciiCountScalar (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t count = 0;
+  for (size_t i = 0; i < p_size; i++)
+    count += p_input[i] >> 7;
+  return count;
+}
+
+static size_t delimiterRunScalar (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t i = 0;
+  while (i < p_size && !cMimeChar::isDelimiter(p_input[i]))
+    i++;
+  return i;
+}
+
+#if defined(MIME_SIMD_X86)
+/* nonAsciiCountSse2 - Compares give -1 for each byte from 0x80 up, summed
+ * in byte lanes for up to 255 vectors and then added up with psadbw
+ */
+__attribute__((target("sse2")))
+static size_t nonAsciiCountSse2 (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t count = 0, i = 0;
+  while (p_size - i >= 16) {
+    size_t end = i + 255 * 16 < p_size ? i + 255 * 16 : p_size;
+    __m128i sum = _mm_setzero_si128();
+    for (; end - i >= 16; i += 16) {
+      __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i));
+      sum = _mm_sub_epi8(sum, _mm_cmplt_epi8(in, _mm_setzero_si128()));
+    }
+    sum = _mm_sad_epu8(sum, _mm_setzero_si128());
+    count += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+  }
+  return count + nonAsciiCountScalar(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t nonAsciiCountAvx2 (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t count = 0, i = 0;
+  while (p_size - i >= 32) {
+    size_t end = i + 255 * 32 < p_size ? i + 255 * 32 : p_size;
+    __m256i sum = _mm256_setzero_si256();
+    for (; end - i >= 32; i += 32) {
+      __m256i in = _mm256_loadu_si256((const __m256i*)(p_input + i));
+      sum = _mm256_sub_epi8(sum, 
+        _mm256_cmpgt_epi8(_mm256_setzero_si256(), in));
+    }
+    sum = _mm256_sad_epu8(sum, _mm256_setzero_si256());
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum),
+      _mm256_extracti128_si256(sum, 1));
+    count += _mm_cvtsi128_si32(half) + _mm_extract_epi16(half, 4);
+  }
+  return count + nonAsciiCountSse2(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static size_t nonAsciiCountAvx512 (const unsigned char* p_input, 
+    size_t p_size) {
+  size_t count = 0;
+  for (size_t i = 0; i < p_size; i += 64) {
+    size_t size = p_size - i < 64 ? p_size - i : 64;
+    __mmask64 load = size < 64 ? ((__mmask64)1 << size) - 1 : ~(__mmask64)0;
+    __m512i in = _mm512_maskz_loadu_epi8(load, p_input + i);
+    count += _mm_popcnt_u64(_mm512_movepi8_mask(in));
+  }
+  return count;
+}
+
+/* The delimiters by nibble: a bit for each high nibble they have, set in
+ * the entries of their low nibbles. pshufb gives 0 for bytes from 0x80 up,
+ * the high table has nothing for them either.
+ */
+static const unsigned char s_delimiterLow[16] = {
+  0x0a, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x02, 0x03, 0x05, 0x15, 0x17, 0x15, 0x06, 0x00
+};
+static const unsigned char s_delimiterHigh[16] = {
+  0x01, 0x00, 0x02, 0x04, 0x08, 0x10, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+__attribute__((target("ssse3")))
+static size_t delimiterRunSsse3 (const unsigned char* p_input, 
+    size_t p_size) {
+  __m128i low = _mm_loadu_si128((const __m128i*)s_delimiterLow);
+  __m128i high = _mm_loadu_si128((const __m128i*)s_delimiterHigh);
+  size_t i = 0;
+  for (; p_size - i >= 16; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i));
+    __m128i bits = _mm_and_si128(_mm_shuffle_epi8(low, in),
+      _mm_shuffle_epi8(high, 
+        _mm_and_si128(_mm_srli_epi16(in, 4), _mm_set1_epi8(0x0f))));
+    unsigned stop = 0xffff ^ (unsigned)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(bits, _mm_setzero_si128()));
+    if (stop)
+      return i + __builtin_ctz(stop);
+  }
+  return i + delimiterRunScalar(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t delimiterRunAvx2 (const unsigned char* p_input, 
+    size_t p_size) {
+  __m256i low = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*)s_delimiterLow));
+  __m256i high = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*)s_delimiterHigh));
+  size_t i = 0;
+  for (; p_size - i >= 32; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i*)(p_input + i));
+    __m256i bits = _mm256_and_si256(_mm256_shuffle_epi8(low, in),
+      _mm256_shuffle_epi8(high, _mm256_and_si256(
+        _mm256_srli_epi16(in, 4), _mm256_set1_epi8(0x0f))));
+    unsigned stop = ~(unsigned)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(bits, _mm256_setzero_si256()));
+    if (stop)
+      return i + __builtin_ctz(stop);
+  }
+  return i + delimiterRunSsse3(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t delimiterRunAvx512 (const unsigned char* p_input, 
+    size_t p_size) {
+  __m512i low = _mm512_broadcast_i32x4(
+    _mm_loadu_si128((const __m128i*)s_delimiterLow));
+  __m512i high = _mm512_broadcast_i32x4(
+    _mm_loadu_si128((const __m128i*)s_delimiterHigh));
+  for (size_t i = 0; i < p_size; i += 64) {
+    size_t size = p_size - i < 64 ? p_size - i : 64;
+    __mmask64 load = size < 64 ? ((__mmask64)1 << size) - 1 : ~(__mmask64)0;
+    __m512i in = _mm512_maskz_loadu_epi8(load, p_input + i);
+    __m512i bits = _mm512_and_si512(_mm512_shuffle_epi8(low, in),
+      _mm512_shuffle_epi8(high, _mm512_and_si512(
+        _mm512_srli_epi16(in, 4), _mm512_set1_epi8(0x0f))));
+    __mmask64 stop = load & _mm512_test_epi8_mask(bits, bits);
+    if (stop)
+      return i + __builtin_ctzll(stop);
+  }
+  return p_size;
+}
+#endif // MIME_SIMD_X86
+
+/* Charset conversion to UTF-8: ASCII is copied in runs, UTF-8 validated in
+ * blocks and Latin-1 widened to two bytes from 0x80 up
+ */
+static size_t asciiRunScalar (const unsigned char* p_input, size_t p_size) {
+  size_t i = 0;
+  while (i < p_size && p_input[i] < 0x80)
+    i++;
+  return i;
+}
+
+/* utf8Sequence - Length of the valid UTF-8 character at p_input, 0 if it is
+ * invalid or cut short (RFC 3629)
+ */
+static inline size_t utf8Sequence (const unsigned char* p_input, 
+    size_t p_size) {
+  unsigned char ch = p_input[0], low = 0x80, high = 0xbf;
+  size_t length;
+  if (ch < 0x80) {
+    return 1;
+  } else if (ch < 0xc2) {
+    return 0;
+  } else if (ch < 0xe0) {
+    length = 2;
+  } else if (ch < 0xf0) {
+    length = 3;
+    if (ch == 0xe0)
+      low = 0xa0;         // overlong
+    else if (ch == 0xed)
+      high = 0x9f;        // surrogates
+  } else if (ch < 0xf5) {
+    length = 4;
+    if (ch == 0xf0)
+      low = 0x90;         // overlong
+    else if (ch == 0xf4)
+      high = 0x8f;        // above U+10FFFF
+  } else {
+    return 0;
+  }
+  if (p_size < length || p_input[1] < low || p_input[1] > high)
+    return 0;
+  for (size_t i = 2; i < length; i++) {
+    if ((p_input[i] & 0xc0) != 0x80)
+      return 0;
+  }
+  return length;
+}
+
+static size_t utf8RunScalar (const unsigned char* p_input, size_t p_size) {
+  size_t i = 0;
+  while (i < p_size) {
+    i += asciiRunScalar(p_input + i, p_size - i);
+    if (i == p_size)
+      break;
+    size_t length = utf8Sequence(p_input + i, p_size - i);
+    if (!length)
+      break;
+    i += length;
+  }
+  return i;
+}
+
+/* utf8CharStart - Back from p_pos, which follows valid blocks, to the start
+ * of the character running over it
+ */
+static inline size_t utf8CharStart (const unsigned char* p_input, 
+    size_t p_pos) {
+  for (size_t i = 1; i <= 3 && i <= p_pos; i++) {
+    unsigned char ch = p_input[p_pos - i];
+    if ((ch & 0xc0) != 0x80) {
+      size_t length = ch >= 0xf0 ? 4 : ch >= 0xe0 ? 3 : ch >= 0xc0 ? 2 : 1;
+      return length > i ? p_pos - i : p_pos;
+    }
+  }
+  return p_pos;
+}
+
+static size_t latin1ToUtf8Scalar (const unsigned char* p_input, 
+    size_t p_size, unsigned char* p_output) {
+  unsigned char* p_start = p_output;
+  for (size_t i = 0; i < p_size; i++) {
+    unsigned char ch = p_input[i];
+    if (ch < 0x80) {
+      *p_output++ = ch;
+    } else {
+      *p_output++ = 0xc0 | (ch >> 6);
+      *p_output++ = 0x80 | (ch & 0x3f);
+    }
+  }
+  return p_output - p_start;
+}
+
+#if defined(MIME_SIMD_X86)
+__attribute__((target("sse2")))
+static size_t asciiRunSse2 (const unsigned char* p_input, size_t p_size) {
+  size_t i = 0;
+  for (; p_size - i >= 16; i += 16) {
+    unsigned high = (unsigned)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i*)(p_input + i)));
+    if (high)
+      return i + __builtin_ctz(high);
+  }
+  return i + asciiRunScalar(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t asciiRunAvx2 (const unsigned char* p_input, size_t p_size) {
+  size_t i = 0;
+  for (; p_size - i >= 32; i += 32) {
+    unsigned high = (unsigned)_mm256_movemask_epi8(
+      _mm256_loadu_si256((const __m256i*)(p_input + i)));
+    if (high)
+      return i + __builtin_ctz(high);
+  }
+  return i + asciiRunSse2(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t asciiRunAvx512 (const unsigned char* p_input, size_t p_size) {
+  for (size_t i = 0; i < p_size; i += 64) {
+    size_t size = p_size - i < 64 ? p_size - i : 64;
+    __mmask64 load = size < 64 ? ((__mmask64)1 << size) - 1 : ~(__mmask64)0;
+    __mmask64 high = _mm512_movepi8_mask(
+      _mm512_maskz_loadu_epi8(load, p_input + i));
+    if (high)
+      return i + __builtin_ctzll(high);
+  }
+  return p_size;
+}
+
+/* UTF-8 validation by lookup (Keiser and Lemire): the high and low nibbles
+ * of each byte and the high nibble of the one after it select the errors
+ * the pair may have; a byte is wrong where all three agree on one, or where
+ * it should continue a 3 or 4 byte character and does not, or the other
+ * way round.
+ */
+enum {
+  UTF8_TOO_SHORT = 0x01,    // lead not followed by a continuation
+  UTF8_TOO_LONG = 0x02,     // continuation after ASCII
+  UTF8_OVERLONG_3 = 0x04,
+  UTF8_TOO_LARGE = 0x08,
+  UTF8_SURROGATE = 0x10,
+  UTF8_OVERLONG_2 = 0x20,
+  UTF8_TOO_LARGE_1000 = 0x40,
+  UTF8_OVERLONG_4 = 0x40,
+  UTF8_TWO_CONTS = 0x80,    // continuation after continuation
+  UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS
+};
+
+static const unsigned char s_utf8Byte1High[16] = {
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+  UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+static const unsigned char s_utf8Byte1Low[16] = {
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+  UTF8_CARRY | UTF8_OVERLONG_2,
+  UTF8_CARRY,
+  UTF8_CARRY,
+  UTF8_CARRY | UTF8_TOO_LARGE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+static const unsigned char s_utf8Byte2High[16] = {
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+    UTF8_TOO_LARGE,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/* utf8ErrorsSsse3 - Non-zero bytes where the block is not valid UTF-8,
+ * given the block before it
+ */
+__attribute__((target("ssse3")))
+static inline __m128i utf8ErrorsSsse3 (__m128i in, __m128i prev) {
+  __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+  __m128i special = _mm_and_si128(_mm_and_si128(
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s_utf8Byte1High),
+      _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s_utf8Byte1Low),
+      _mm_and_si128(prev1, nibble))),
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s_utf8Byte2High),
+      _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+  // bytes from 0x80 up where the one 2 before is a 3 or 4 byte lead, or
+  // the one 3 before a 4 byte lead
+  __m128i third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), 
+    _mm_set1_epi8((char)(0xe0 - 0x80)));
+  __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), 
+    _mm_set1_epi8((char)(0xf0 - 0x80)));
+  __m128i must = _mm_and_si128(_mm_or_si128(third, fourth), 
+    _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must, special);
+}
+
+/* utf8RunSsse3 - Whole blocks up to the first with an error, the rest from
+ * the character the last of them ends in is left to the scalar code
+ */
+__attribute__((target("ssse3")))
+static size_t utf8RunSsse3 (const unsigned char* p_input, size_t p_size) {
+  __m128i prev = _mm_setzero_si128();
+  size_t i = 0;
+  for (; p_size - i >= 16; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i));
+    // ASCII after ASCII needs no lookups
+    if (_mm_movemask_epi8(_mm_or_si128(in, prev))) {
+      __m128i errors = utf8ErrorsSsse3(in, prev);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) 
+          != 0xffff)
+        break;
+    }
+    prev = in;
+  }
+  i = utf8CharStart(p_input, i);
+  return i + utf8RunScalar(p_input + i, p_size - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i utf8ErrorsAvx2 (__m256i in, __m256i prev) {
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  // the block before, shifted into the lanes of this one
+  __m256i before = _mm256_permute2x128_si256(prev, in, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(in, before, 15);
+  __m256i special = _mm256_and_si256(_mm256_and_si256(
+    _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i*)s_utf8Byte1High)),
+      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+    _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i*)s_utf8Byte1Low)),
+      _mm256_and_si256(prev1, nibble))),
+    _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i*)s_utf8Byte2High)),
+      _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+  __m256i third = _mm256_subs_epu8(_mm256_alignr_epi8(in, before, 14),
+    _mm256_set1_epi8((char)(0xe0 - 0x80)));
+  __m256i fourth = _mm256_subs_epu8(_mm256_alignr_epi8(in, before, 13),
+    _mm256_set1_epi8((char)(0xf0 - 0x80)));
+  __m256i must = _mm256_and_si256(_mm256_or_si256(third, fourth), 
+    _mm256_set1_epi8((char)0x80));
+  return _mm256_xor_si256(must, special);
+}
+
+__attribute__((target("avx2")))
+static size_t utf8RunAvx2 (const unsigned char* p_input, size_t p_size) {
+  __m256i prev = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; p_size - i >= 32; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i*)(p_input + i));
+    // ASCII after ASCII needs no lookups
+    if (_mm256_movemask_epi8(_mm256_or_si256(in, prev))) {
+      __m256i errors = utf8ErrorsAvx2(in, prev);
+      if (!_mm256_testz_si256(errors, errors))
+        break;
+    }
+    prev = in;
+  }
+  i = utf8CharStart(p_input, i);
+  return i + utf8RunScalar(p_input + i, p_size - i);
+}
+
+/* latin1ToUtf8Ssse3 - Each half block spreads to a lead and a continuation
+ * byte per input byte, the leads stand for ASCII bytes on their own and the
+ * continuations of those are packed out. A half writes 16 bytes for at
+ * least 8, so blocks stop 8 input bytes short of the end.
+ */
+__attribute__((target("ssse3")))
+static size_t latin1ToUtf8Ssse3 (const unsigned char* p_input, 
+    size_t p_size, unsigned char* p_output) {
+  unsigned char* p_start = p_output;
+  size_t i = 0;
+  for (; p_size - i >= 16 + 8; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(p_input + i));
+    __m128i high = _mm_cmplt_epi8(in, _mm_setzero_si128());
+    if (!_mm_movemask_epi8(high)) {
+      _mm_storeu_si128((__m128i*)p_output, in);
+      p_output += 16;
+      continue;
+    }
+    // 0xc2 or 0xc3 for bytes from 0x80 up, from 0xc0 up
+    __m128i lead = _mm_sub_epi8(_mm_set1_epi8((char)0xc2),
+      _mm_cmpgt_epi8(in, _mm_set1_epi8((char)0xbf)));
+    lead = _mm_or_si128(_mm_andnot_si128(high, in), 
+      _mm_and_si128(high, lead));
+    __m128i cont = _mm_and_si128(in, _mm_set1_epi8((char)0xbf));
+    __m128i all = _mm_set1_epi8(-1);
+    p_output += base64CompactSsse3(_mm_unpacklo_epi8(lead, cont),
+      _mm_movemask_epi8(_mm_unpacklo_epi8(all, high)), p_output);
+    p_output += base64CompactSsse3(_mm_unpackhi_epi8(lead, cont),
+      _mm_movemask_epi8(_mm_unpackhi_epi8(all, high)), p_output);
+  }
+  return (p_output - p_start) + 
+    latin1ToUtf8Scalar(p_input + i, p_size - i, p_output);
+}
+
+/* latin1ToUtf8Avx512 - Bytes widened to 16 bits hold the lead and the
+ * continuation, the compressing store drops the high half of ASCII ones
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi2")))
+static size_t latin1ToUtf8Avx512 (const unsigned char* p_input, 
+    size_t p_size, unsigned char* p_output) {
+  unsigned char* p_start = p_output;
+  for (size_t i = 0; i < p_size; i += 32) {
+    size_t size = p_size - i < 32 ? p_size - i : 32;
+    __mmask64 load = ((__mmask64)1 << size) - 1;
+    __m512i loaded = _mm512_maskz_loadu_epi8(load, p_input + i);
+    __m256i in = _mm512_castsi512_si256(loaded);
+    __mmask32 high = (__mmask32)_mm512_movepi8_mask(loaded);
+    if (!high && size == 32) {
+      _mm256_storeu_si256((__m256i*)p_output, in);
+      p_output += 32;
+      continue;
+    }
+    __m512i wide = _mm512_cvtepu8_epi16(in);
+    __m512i pair = _mm512_or_si512(
+      _mm512_or_si512(_mm512_srli_epi16(wide, 6), _mm512_set1_epi16(0xc0)),
+      _mm512_slli_epi16(_mm512_or_si512(
+        _mm512_and_si512(wide, _mm512_set1_epi16(0x3f)), 
+        _mm512_set1_epi16(0x80)), 8));
+    pair = _mm512_mask_mov_epi16(wide, high, pair);
+    // the low byte of each loaded byte, the high one of those from 0x80 up,
+    // the only ones where it is not 0
+    __mmask64 keep = (_mm512_test_epi8_mask(pair, pair) | 
+      0x5555555555555555ULL) & 
+      (size < 32 ? ((__mmask64)1 << 2 * size) - 1 : ~(__mmask64)0);
+    _mm512_mask_compressstoreu_epi8(p_output, keep, pair);
+    p_output += size + __builtin_popcount(high);
+  }
+  return p_output - p_start;
+}
+#endif // MIME_SIMD_X86
+
+/* detectLevel - Best level of this CPU */
+static int detectLevel () {
+  int level = cMimeSimd::LEVEL_SCALAR;
+#if defined(MIME_SIMD_X86)
+  __builtin_cpu_init();
+  // the kernels count with popcnt at every vector level, which some
+  // SSSE3 CPUs lack
+  if (!__builtin_cpu_supports("popcnt")) {
+    level = cMimeSimd::LEVEL_SCALAR;
+  } else if (__builtin_cpu_supports("avx512vbmi") &&
+      __builtin_cpu_supports("avx512vbmi2") &&
+      __builtin_cpu_supports("avx512bw")) {
+    level = cMimeSimd::LEVEL_AVX512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    level = cMimeSimd::LEVEL_AVX2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    level = cMimeSimd::LEVEL_SSSE3;
+  }
+#endif
+  return level;
+}
+
+int cMimeSimd::supported () {
+  // initialized once, safely across threads
+  static const int s_level = detectLevel();
+  return s_level;
+}
+
+int cMimeSimd::level () {
+  int level = cMimeEnvironment::simdLevel();
+  int cpu = supported();
+  return level < cpu ? level : cpu;
+}
+
+static BASE64_BLOCKS base64Blocks () {
+  switch (cMimeSimd::level()) {
+#if defined(MIME_SIMD_X86)
+    case cMimeSimd::LEVEL_AVX512: return base64BlocksAvx512;
+    case cMimeSimd::LEVEL_AVX2: return base64BlocksAvx2;
+    case cMimeSimd::LEVEL_SSSE3: return base64BlocksSsse3;
+#endif
+    default: return base64BlocksScalar;
+  }
+}
+
+size_t cMimeSimd::base64Encode (const unsigned char* p_input, size_t p_size,
+    unsigned char* p_output, size_t p_linesize) {
+  ASSERT(p_size % 3 == 0 && p_linesize % 3 == 0);
+  BASE64_BLOCKS blocks = base64Blocks();
+  if (!p_linesize)
+    return blocks(p_input, p_size, p_output);
+
+  unsigned char* p_outstart = p_output;
+  for (; p_size >= p_linesize; p_size -= p_linesize) {
+    p_output += blocks(p_input, p_linesize, p_output);
+    p_input += p_linesize;
+    *p_output++ = '\r';
+    *p_output++ = '\n';
+  }
+  p_output += blocks(p_input, p_size, p_output);
+  return p_output - p_outstart;
+}
+
+/* base64GroupStart - Input offset of the first of the p_count values that
+ * were read from p_input before p_end
+ */
+static size_t base64GroupStart (const unsigned char* p_input, size_t p_end,
+    size_t p_count) {
+  while (p_count > 0) {
+    if (s_base64Values[p_input[--p_end]] != 0x40)
+      p_count--;
+  }
+  return p_end;
+}
+
+/* cMimeSimd::base64Decode - Decode until the end of the input, padding or a
+ * byte outside the alphabet and white space. A final group of 2 or 3
+ * characters is decoded with or without its padding.
+ */
+size_t cMimeSimd::base64Decode (const unsigned char* p_input, size_t p_size,
+    unsigned char* p_output, size_t p_maxsize, ssize_t* p_error,
+    size_t* p_consumed) {
+  BASE64_VALUES translate = base64ValuesScalar;
+  BASE64_PACK pack = base64PackScalar;
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: 
+      translate = base64ValuesAvx512; 
+      pack = base64PackAvx512; 
+      break;
+    case LEVEL_AVX2: 
+      translate = base64ValuesAvx2; 
+      pack = base64PackAvx2; 
+      break;
+    case LEVEL_SSSE3: 
+      translate = base64ValuesSsse3; 
+      pack = base64PackSsse3; 
+      break;
+#endif
+  }
+
+  // carried values, a chunk of input and room for the wide stores
+  const size_t chunksize = 4096;
+  unsigned char values[chunksize + 4 + 64];
+  size_t input = 0, output = 0, carry = 0;
+  bool stopped = false;
+  *p_error = -1;
+
+  while (input < p_size && !stopped) {
+    size_t size = p_size - input < chunksize ? p_size - input : chunksize;
+    size_t read;
+    size_t count = carry + translate(p_input + input, size, values + carry,
+      &read);
+    input += read;
+    stopped = read < size;
+
+    size_t groups = count / 4;
+    if (groups > (p_maxsize - output) / 3)
+      groups = (p_maxsize - output) / 3;
+    pack(values, groups * 4, p_output + output);
+    output += groups * 3;
+    carry = count - groups * 4;
+    if (carry >= 4) {
+      // output is full
+      if (p_consumed != NULL)
+        *p_consumed = base64GroupStart(p_input, input, carry);
+      return output;
+    }
+    memmove(values, values + groups * 4, carry);
+  }
+
+  if (p_consumed != NULL) {
+    // more input follows, it completes the last group unless the input is
+    // invalid already
+    bool invalid = stopped && carry == 1;
+    if (stopped && !invalid) {
+      size_t padding = carry >= 2 ? 4 - carry : 0;
+      size_t i = input;
+      for (; i < p_size; i++) {
+        if (p_input[i] == '=' && padding > 0) {
+          padding--;
+        } else if (s_base64Values[p_input[i]] != 0x40) {
+          break;
+        }
+      }
+      invalid = i < p_size;
+    }
+    if (!invalid) {
+      *p_consumed = base64GroupStart(p_input, input, carry);
+      return output;
+    }
+    *p_consumed = p_size;
+  }
+
+  if (carry == 1) {
+    *p_error = input;
+  } else if (carry > 1 && p_maxsize - output >= carry - 1) {
+    unsigned int group = (values[0] << 18) | (values[1] << 12) |
+      (carry == 3 ? values[2] << 6 : 0);
+    p_output[output++] = (unsigned char)(group >> 16);
+    if (carry == 3)
+      p_output[output++] = (unsigned char)(group >> 8);
+  }
+  if (!stopped || *p_error >= 0)
+    return output;
+
+  // only the padding that completes the last group, then white space
+  size_t padding = carry >= 2 ? 4 - carry : 0;
+  for (; input < p_size; input++) {
+    unsigned char ch = p_input[input];
+    if (ch == '=' && padding > 0) {
+      padding--;
+    } else if (s_base64Values[ch] != 0x40) {
+      break;
+    }
+  }
+  if (input < p_size || padding > 0)
+    *p_error = input;
+  return output;
+}
+
+size_t cMimeSimd::base64Scan (const unsigned char* p_input, size_t p_size,
+    size_t* p_values) {
+  *p_values = 0;
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: 
+    case LEVEL_AVX2: return base64ScanAvx2(p_input, p_size, p_values);
+    case LEVEL_SSSE3: return base64ScanSsse3(p_input, p_size, p_values);
+#endif
+    default: return base64ScanScalar(p_input, p_size, p_values);
+  }
+}
+
+size_t cMimeSimd::qpLiteralRun (const unsigned char* p_input, size_t p_size) {
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: return qpLiteralRunAvx512(p_input, p_size);
+    case LEVEL_AVX2: return qpLiteralRunAvx2(p_input, p_size);
+    case LEVEL_SSSE3: return qpLiteralRunSse2(p_input, p_size);
+#endif
+    default: return qpLiteralRunScalar(p_input, p_size);
+  }
+}
+
+size_t cMimeSimd::qpDecodeRun (const unsigned char* p_input, size_t p_size) {
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: return qpDecodeRunAvx512(p_input, p_size);
+    case LEVEL_AVX2: return qpDecodeRunAvx2(p_input, p_size);
+    case LEVEL_SSSE3: return qpDecodeRunSse2(p_input, p_size);
+#endif
+    default: return qpDecodeRunScalar(p_input, p_size);
+  }
+}
+
+size_t cMimeSimd::nonAsciiCount (const unsigned char* p_input, 
+    size_t p_size) {
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: return nonAsciiCountAvx512(p_input, p_size);
+    case LEVEL_AVX2: return nonAsciiCountAvx2(p_input, p_size);
+    case LEVEL_SSSE3: return nonAsciiCountSse2(p_input, p_size);
+#endif
+    default: return nonAsciiCountScalar(p_input, p_size);
+  }
+}
+
+size_t cMimeSimd::delimiterRun (const unsigned char* p_input, 
+    size_t p_size) {
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: return delimiterRunAvx512(p_input, p_size);
+    case LEVEL_AVX2: return delimiterRunAvx2(p_input, p_size);
+    case LEVEL_SSSE3: return delimiterRunSsse3(p_input, p_size);
+#endif
+    default: return delimiterRunScalar(p_input, p_size);
+  }
+}
+
+void cMimeSimd::textScan (const unsigned char* p_input, size_t p_size,
+    textStats* p_stats) {
+  memset(p_stats, 0, sizeof(*p_stats));
+  size_t linestart = 0, done = 0;
+  bool crcarry = false;
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: 
+      done = textScanAvx512(p_input, p_size, p_stats, linestart, crcarry);
+      break;
+    case LEVEL_AVX2: 
+      done = textScanAvx2(p_input, p_size, p_stats, linestart, crcarry);
+      break;
+    case LEVEL_SSSE3: 
+      done = textScanSse2(p_input, p_size, p_stats, linestart, crcarry);
+      break;
+#endif
+  }
+  textScanScalar(p_input + done, p_size - done, done, p_stats, linestart,
+    crcarry);
+  if (p_size - linestart > p_stats->maxline)
+    p_stats->maxline = p_size - linestart;
+}
+
+size_t cMimeSimd::asciiRun (const unsigned char* p_input, size_t p_size) {
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: return asciiRunAvx512(p_input, p_size);
+    case LEVEL_AVX2: return asciiRunAvx2(p_input, p_size);
+    case LEVEL_SSSE3: return asciiRunSse2(p_input, p_size);
+#endif
+    default: return asciiRunScalar(p_input, p_size);
+  }
+}
+
+size_t cMimeSimd::utf8Run (const unsigned char* p_input, size_t p_size) {
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: 
+    case LEVEL_AVX2: return utf8RunAvx2(p_input, p_size);
+    case LEVEL_SSSE3: return utf8RunSsse3(p_input, p_size);
+#endif
+    default: return utf8RunScalar(p_input, p_size);
+  }
+}
+
+size_t cMimeSimd::latin1ToUtf8 (const unsigned char* p_input, size_t p_size,
+    unsigned char* p_output) {
+  switch (level()) {
+#if defined(MIME_SIMD_X86)
+    case LEVEL_AVX512: return latin1ToUtf8Avx512(p_input, p_size, p_output);
+    case LEVEL_AVX2: 
+    case LEVEL_SSSE3: return latin1ToUtf8Ssse3(p_input, p_size, p_output);
+#endif
+    default: return latin1ToUtf8Scalar(p_input, p_size, p_output);
+  }
+}
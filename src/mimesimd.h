@@ -0,0 +1,96 @@
+/* mimesimd.h - Vector kernels for the MIME coders, chosen at run time from
+ * what the CPU supports
+ *
+ * Copyright (C) 2015 Dan Nielsen <dnielsen@fastmail.fm>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * #include "mimesimd.h"
+ */
+#if !defined(_MIME_SIMD_H)
+#define _MIME_SIMD_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+class cMimeSimd {
+  public:
+    // Instruction set levels, each one implies those below it
+    enum level { LEVEL_SCALAR, LEVEL_SSSE3, LEVEL_AVX2, LEVEL_AVX512 };
+
+    // Best level of this CPU, and the level in use after the cap set with
+    // cMimeEnvironment::simdLevel()
+    static int supported ();
+    static int level ();
+
+    // Base64 of p_size input bytes, a multiple of 3, without padding. A
+    // CRLF follows every full line of p_linesize input bytes, if not 0.
+    // Returns the number of bytes written.
+    static size_t base64Encode (const unsigned char* p_input, size_t p_size,
+      unsigned char* p_output, size_t p_linesize);
+
+    // Decode base64 skipping white space, writing at most p_maxsize bytes.
+    // p_error gets the offset of the first byte that is not valid base64,
+    // decoding stops there, or -1. Returns the number of bytes written.
+    // With p_consumed more input follows: an incomplete last group is left
+    // undecoded and p_consumed gets the input used.
+    static size_t base64Decode (const unsigned char* p_input, size_t p_size,
+      unsigned char* p_output, size_t p_maxsize, ssize_t* p_error,
+      size_t* p_consumed = NULL);
+
+    // Number of leading bytes that are base64 characters or white space,
+    // p_values gets how many of them are base64 characters
+    static size_t base64Scan (const unsigned char* p_input, size_t p_size,
+      size_t* p_values);
+
+    // Number of leading bytes that quoted-printable copies as they are:
+    // printable ASCII other than '=', space and TAB
+    static size_t qpLiteralRun (const unsigned char* p_input, size_t p_size);
+
+    // Number of leading bytes before the first '=' or LF, which quoted-
+    // printable decoding copies as they are
+    static size_t qpDecodeRun (const unsigned char* p_input, size_t p_size);
+
+    // What a payload scan finds for choosing its transfer encoding. Line
+    // lengths leave out the CRLF, only LF ends a line.
+    struct textStats {
+      size_t nonascii;          // bytes from 0x80 up
+      size_t nul;
+      size_t barebreaks;        // CR and LF not in a CRLF
+      size_t quoted;            // bytes quoted-printable writes as =XX
+      size_t maxline;
+    };
+    static void textScan (const unsigned char* p_input, size_t p_size,
+      textStats* p_stats);
+
+    // Number of bytes from 0x80 up, which header fields encode
+    static size_t nonAsciiCount (const unsigned char* p_input, size_t p_size);
+
+    // Number of leading bytes before the first white space or RFC 822
+    // special, where header fields split into words
+    static size_t delimiterRun (const unsigned char* p_input, size_t p_size);
+
+    // Number of leading ASCII bytes, which every charset converted to
+    // UTF-8 keeps as they are
+    static size_t asciiRun (const unsigned char* p_input, size_t p_size);
+
+    // Number of leading bytes that are whole, valid UTF-8 characters
+    static size_t utf8Run (const unsigned char* p_input, size_t p_size);
+
+    // Latin-1 to UTF-8. p_output takes p_size bytes plus one for each byte
+    // from 0x80 up. Returns the number of bytes written.
+    static size_t latin1ToUtf8 (const unsigned char* p_input, size_t p_size,
+      unsigned char* p_output);
+};
+#endif // _MIME_SIMD_H
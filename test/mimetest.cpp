@@ -1,9 +1,1276 @@
+#include <ctype.h>
 #include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include "../src/mime.h"
+#include "../src/mimechar.h"
+#include "../src/mimecode.h"
+#include "../src/mimesimd.h"
 
 using namespace std;
 
+static int s_failures = 0;
+
+#define CHECK(exp) \
+  do { if (!(exp)) { \
+    cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #exp ") failed" << endl; \
+    s_failures++; } } while (0)
+
+/* Content-Type is parsed once and reparsed when the field changes */
+static void testContentType () {
+  cMimeMessage mail;
+  CHECK(mail.isText());
+  CHECK(mail.subType() == "plain");
+
+  mail.contentType("image/png; name=\"logo.png\"");
+  CHECK(mail.mediaType() == cMimeHeader::MEDIA_IMAGE);
+  CHECK(mail.subType() == "png");
+  CHECK(mail.isAttachment());
+
+  cMimeField* fd = mail.field("Content-Type");
+  fd->value("Message/rfc822");
+  CHECK(mail.isMessage());
+  CHECK(mail.mainType() == "Message");
+  CHECK(!mail.isAttachment());
+
+  mail.boundary("abc");
+  CHECK(mail.isMultipart());
+  CHECK(mail.getBoundary() == "abc");
+
+  mail.fields().clear();
+  CHECK(mail.isText());
+
+  // changes made right after fields() replace the field behind the cache
+  mail.contentType("image/gif");
+  CHECK(mail.mediaType() == cMimeHeader::MEDIA_IMAGE);
+  mail.fields().clear();
+  CHECK(mail.isText());
+  cMimeField gif;
+  gif.name("Content-Type");
+  gif.value("image/gif");
+  mail.fields().push_back(gif);
+  CHECK(mail.mediaType() == cMimeHeader::MEDIA_IMAGE);
+}
+
+/* Parameters, including RFC 2231 sections, are parsed into a table */
+static void testParameters () {
+  cMimeField fd;
+  fd.name("Content-Disposition");
+  fd.value("attachment; filename*0*=utf-8''%E2%82%AC%20rates; "
+    "filename*1=\"  2015.pdf\"; size=1024");
+
+  string value;
+  fd.value(value);
+  CHECK(value == "attachment");
+  CHECK(fd.parameter("filename", value));
+  CHECK(value == "\xE2\x82\xAC rates  2015.pdf");
+  CHECK(!strcmp(fd.parameterCharset("FILENAME"), "utf-8"));
+  CHECK(!strcmp(fd.parameter("size"), "1024"));
+  CHECK(fd.parameter("creation-date") == NULL);
+
+  fd.parameter("size", "2048");
+  fd.parameter("name", "\"q\\\"uote\"");
+  CHECK(!strcmp(fd.value(), "attachment; "
+    "filename*=utf-8''%E2%82%AC%20rates%20%202015.pdf; size=\"2048\"; "
+    "name=\"q\\\\\\\"uote\""));
+
+  cMimeField copy;
+  copy.value(fd.value());
+  CHECK(!strcmp(copy.parameter("name"), "q\\\"uote"));
+  CHECK(!strcmp(copy.parameter("filename"), fd.parameter("filename")));
+
+  // sections join in number order, numbers out of range are dropped
+  cMimeField sections;
+  sections.value("attachment; filename=\"plain.txt\"; filename*2=c; "
+    "filename*99999999999*=x; filename*0=a; filename*1=b; filename*1=y; "
+    "filename*4294967295=z; filename*4=e");
+  CHECK(!strcmp(sections.parameter("filename"), "abc"));
+  sections.value("attachment; filename=\"plain.txt\"; "
+    "filename*99999999999=x");
+  CHECK(!strcmp(sections.parameter("filename"), "plain.txt"));
+}
+
+/* Payloads are adopted rather than copied, messages can be moved */
+static void testAdoption () {
+  cMimeMessage mail;
+  string text("an adopted payload too long for a small string buffer");
+  const char* p_text = text.data();
+  mail.payload(std::move(text));
+  CHECK((const char*)mail.content() == p_text);
+  CHECK(mail.contentLength() == 53);
+
+  static bool s_deleted = false;
+  unsigned char* p_data = new unsigned char[4];
+  memcpy(p_data, "data", 4);
+  mail.payload(p_data, 4, [](unsigned char* p) { 
+    delete[] p; 
+    s_deleted = true; 
+  });
+  CHECK(mail.content() == p_data);
+
+  mail.emplaceField("Subject", string("moved"));
+  cMimeMessage moved(std::move(mail));
+  CHECK(moved.content() == p_data);
+  CHECK(mail.content() == NULL);
+  CHECK(!strcmp(moved.subject(), "moved"));
+  CHECK(mail.subject() == NULL);
+
+  moved.payload("copied");
+  CHECK(s_deleted);
+}
+
+/* Sizes past 4 GB. The part is untouched anonymous memory so it costs no
+ * RSS; set MIMETEST_LARGE to also store a 2.5 GB message.
+ */
+static void testLargeSizes () {
+  const size_t partsize = (size_t)3 << 30;
+  unsigned char* p_part = (unsigned char*)mmap(NULL, partsize, 
+    PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  CHECK(p_part != MAP_FAILED);
+  if (p_part == MAP_FAILED)
+    return;
+
+  cMimeMessage mail;
+  mail.transferEncoding("base64");
+  mail.payload(p_part, partsize, [partsize](unsigned char* p) {
+    munmap(p, partsize);
+  });
+  CHECK(mail.contentLength() == partsize);
+  size_t encoded = partsize / 3 * 4;
+  CHECK(mail.getLength() > encoded + encoded / 76 * 2);
+
+  if (!getenv("MIMETEST_LARGE"))
+    return;
+
+  // binary is copied as is, so 2.25 GB in and out
+  const size_t storesize = ((size_t)9 << 28);
+  cMimeMessage large;
+  large.transferEncoding("binary");
+  large.payload(p_part, storesize, cMimeBody::cBufferDeleter());
+  size_t msize = large.getLength();
+  CHECK(msize > storesize);
+  char* p_out = (char*)mmap(NULL, msize, PROT_READ | PROT_WRITE, 
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  CHECK(p_out != MAP_FAILED);
+  if (p_out == MAP_FAILED)
+    return;
+  CHECK(large.store(p_out, msize) == (ssize_t)msize);
+  CHECK(!memcmp(p_out, "Content-Transfer-Encoding: binary\r\n\r\n", 37));
+  munmap(p_out, msize);
+}
+
+/* Memory accounting and the load limit */
+static void testMemoryUsage () {
+  cMimeMessage mail;
+  mail.subject("memory");
+  mail.contentType("multipart/mixed");
+  mail.boundary("memory-boundary");
+  for (int i = 0; i < 3; i++) {
+    cMimeBody* p_bp = mail.createPart();
+    p_bp->contentType("application/octet-stream");
+    p_bp->transferEncoding("base64");
+    p_bp->payload(string(10000, 'a' + i));
+  }
+  size_t msize = mail.getLength();
+  char* mbuff = new char[msize];
+  msize = mail.store(mbuff, msize);
+
+  cMimeMessage loaded;
+  CHECK(loaded.load(mbuff, msize) > 0);
+  cMimeMemoryUsage usage = loaded.memoryUsage();
+  CHECK(usage.parts == 4);
+  CHECK(usage.bodies >= 30000 && usage.bodies < 30100);
+  CHECK(usage.headers > 0);
+  CHECK(usage.total() > usage.bodies + usage.headers);
+
+  cMimeMessage limited;
+  limited.memoryLimit(20000);
+  CHECK(limited.load(mbuff, msize) == cMimeBody::ERROR_MEMORY_LIMIT);
+  CHECK(limited.memoryUsage().parts == 1);
+  limited.memoryLimit(usage.total() + 1000);
+  CHECK(limited.load(mbuff, msize) > 0);
+  delete[] mbuff;
+}
+
+/* Decoded bodies over the spill threshold live in temporary files */
+static void testSpill () {
+  cMimeMessage mail;
+  mail.transferEncoding("base64");
+  string data(100000, 'x');
+  for (size_t i = 0; i < data.size(); i += 7)
+    data[i] = (char)('a' + i % 26);
+  mail.payload(data.data(), data.size());
+  size_t msize = mail.getLength();
+  char* mbuff = new char[msize];
+  msize = mail.store(mbuff, msize);
+
+  cMimeEnvironment::spillThreshold(4096);
+  cMimeMessage loaded;
+  CHECK(loaded.load(mbuff, msize) > 0);
+  cMimeEnvironment::spillThreshold(0);
+  delete[] mbuff;
+
+  cMimeMemoryUsage usage = loaded.memoryUsage();
+  CHECK(usage.spilled == data.size());
+  CHECK(usage.bodies < 1000);
+  string text;
+  loaded.payload(text);
+  CHECK(text == data);
+  CHECK(!memcmp(loaded.content(), data.data(), data.size()));
+
+  // content stays where it is and terminated across stores
+  const unsigned char* p_content = loaded.content();
+  string stored(loaded.getLength(), 0);
+  stored.resize(loaded.store(&stored[0], stored.size()));
+  CHECK(loaded.content() == p_content && p_content[data.size()] == 0);
+  CHECK(!memcmp(p_content, data.data(), data.size()));
+
+  const char* p_file = "/tmp/mimetest-spill.eml";
+  CHECK(loaded.writeToFile(p_file));
+  cMimeMessage reread;
+  CHECK(reread.readFromFile(p_file));
+  reread.payload(text);
+  CHECK(text == data);
+  CHECK(reread.memoryUsage().spilled == 0);
+  unlink(p_file);
+}
+
+/* A frozen snapshot reads the same as the message it was made from */
+static void testFreeze () {
+  cMimeMessage mail;
+  mail.subject("frozen");
+  mail.contentType("multipart/mixed");
+  mail.boundary("frozen-boundary");
+  cMimeBody* p_bp = mail.createPart();
+  p_bp->contentType("text/plain");
+  p_bp->charset("utf-8");
+  p_bp->payload("first");
+  p_bp = mail.createPart();
+  p_bp->contentType("application/octet-stream");
+  p_bp->name("data.bin");
+  p_bp->transferEncoding("base64");
+  p_bp->payload("second");
+
+  size_t msize = mail.getLength();
+  string stored(msize, 0);
+  stored.resize(mail.store(&stored[0], msize));
+
+  shared_ptr<const cMimeMessage> frozen = mail.freeze();
+  CHECK(mail.partCount() == 0);
+  CHECK(mail.subject() == NULL);
+  CHECK(frozen->partCount() == 2);
+  CHECK(!strcmp(frozen->subject(), "frozen"));
+
+  cMimeBody::cPartIterator it = frozen->partsBegin();
+  CHECK((*it)->charset() == "utf-8");
+  ++it;
+  CHECK((*it)->isAttachment());
+  CHECK((*it)->name() == "data.bin");
+  ++it;
+  CHECK(it == frozen->partsEnd());
+
+  string copy(frozen->getLength(), 0);
+  copy.resize(frozen->store(&copy[0], copy.size()));
+  CHECK(copy == stored);
+
+  // the index of a snapshot finds the snapshot, not the emptied message
+  cMimeMessage indexed;
+  indexed.indexParts(true);
+  CHECK(indexed.load(stored.data(), stored.size()) > 0);
+  frozen = indexed.freeze();
+  vector<const cMimeBody*> roots;
+  CHECK(frozen->partIndex().mediaType("multipart/mixed", roots) == 1);
+  CHECK(roots.size() == 1 && roots[0] == frozen.get());
+  CHECK(indexed.partIndex().size() == 0);
+  const cMimeBody* p_found = frozen->partIndex().filename("data.bin");
+  CHECK(p_found != NULL && p_found->name() == "data.bin");
+}
+
+/* Clones of a template reuse its cached encodings until they change */
+static void testTemplate () {
+  cMimeMessage tmpl;
+  tmpl.subject("newsletter");
+  tmpl.contentType("multipart/mixed");
+  tmpl.boundary("template-boundary");
+  cMimeBody* p_bp = tmpl.createPart();
+  p_bp->contentType("text/plain");
+  p_bp->payload("Dear reader");
+  p_bp = tmpl.createPart();
+  p_bp->contentType("application/octet-stream");
+  p_bp->transferEncoding("base64");
+  p_bp->payload(string(5000, 'z'));
+  tmpl.cacheEncoding();
+
+  size_t msize = tmpl.getLength();
+  string stored(msize, 0);
+  stored.resize(tmpl.store(&stored[0], msize));
+
+  cMimeMessage* p_mail = tmpl.clone();
+  cMimeBody* p_text = p_mail->findFirstPart();
+  cMimeBody* p_data = p_mail->findNextPart();
+  cMimeBody::cPartIterator it = tmpl.partsBegin();
+  ++it;
+  CHECK(p_data->content() == (*it)->content());
+  CHECK(p_data->contentLength() == 5000);
+  string copy(p_mail->getLength(), 0);
+  copy.resize(p_mail->store(&copy[0], copy.size()));
+  CHECK(copy == stored);
+
+  p_mail->to("reader@example.com");
+  p_text->payload("Dear Jane");
+  copy.assign(p_mail->getLength(), 0);
+  copy.resize(p_mail->store(&copy[0], copy.size()));
+  CHECK(copy.find("To: reader@example.com") != string::npos);
+  CHECK(copy.find("Dear Jane") != string::npos);
+  CHECK(copy.find("Dear reader") == string::npos);
+  CHECK(copy.size() == stored.size() + 24 - 2);
+
+  p_data->fields().clear();
+  CHECK(p_data->getLength() < 5000 / 3 * 4);
+  delete p_mail;
+
+  // cached bytes only stand for the settings they were made with
+  string line;
+  for (int i = 0; i < 40; i++)
+    line += "word ";
+  cMimeMessage mail;
+  mail.transferEncoding("7bit");
+  mail.payload((line + "\r\n").c_str());
+  string plain(mail.getLength(), 0);
+  plain.resize(mail.store(&plain[0], plain.size()));
+  cMimeContext folding(cMimeEnvironment::context());
+  folding.autoFolding(true);
+  string folded(mail.getLength(folding), 0);
+  folded.resize(mail.store(&folded[0], folded.size(), folding));
+  CHECK(folded != plain);
+
+  mail.cacheEncoding();
+  copy.assign(mail.getLength(folding), 0);
+  copy.resize(mail.store(&copy[0], copy.size(), folding));
+  CHECK(copy == folded);
+  cMimeEnvironment::autoFolding(true);
+  copy.assign(mail.getLength(), 0);
+  copy.resize(mail.store(&copy[0], copy.size()));
+  CHECK(copy == folded);
+  cMimeEnvironment::autoFolding(false);
+  copy.assign(mail.getLength(), 0);
+  copy.resize(mail.store(&copy[0], copy.size()));
+  CHECK(copy == plain);
+
+  // parameter changes count as changes to the cached header
+  cMimeMessage attachment;
+  attachment.contentType("application/octet-stream");
+  attachment.name("old.bin");
+  attachment.transferEncoding("base64");
+  attachment.payload(string(300, 'q'));
+  attachment.cacheEncoding();
+  attachment.name("new.bin");
+  copy.assign(attachment.getLength(), 0);
+  copy.resize(attachment.store(&copy[0], copy.size()));
+  CHECK(copy.find("name=\"new.bin\"") != string::npos);
+  CHECK(copy.find("old.bin") == string::npos);
+}
+
+/* cid: references and filenames resolve through the part index */
+static void testPartIndex () {
+  cMimeMessage mail;
+  mail.contentType("multipart/related");
+  mail.boundary("index-boundary");
+  cMimeBody* p_bp = mail.createPart();
+  p_bp->contentType("text/html");
+  p_bp->payload("<img src=\"cid:logo@example.com\">");
+  for (int i = 0; i < 3; i++) {
+    p_bp = mail.createPart();
+    p_bp->contentType("image/png");
+    string cid = "<img" + to_string(i) + "@example.com>";
+    p_bp->fieldValue("Content-ID", cid.c_str());
+    p_bp->disposition("inline");
+    p_bp->field("Content-Disposition")->parameter("filename",
+      ("img" + to_string(i) + ".png").c_str());
+  }
+  p_bp->fieldValue("Content-ID", "<logo@example.com>");
+
+  size_t msize = mail.getLength();
+  char* mbuff = new char[msize];
+  msize = mail.store(mbuff, msize);
+
+  cMimeMessage loaded;
+  loaded.indexParts(true);
+  CHECK(loaded.load(mbuff, msize) > 0);
+  delete[] mbuff;
+
+  const cMimePartIndex& index = loaded.partIndex();
+  CHECK(index.size() == 5);
+  const cMimeBody* p_logo = index.contentId("cid:logo@example.com");
+  CHECK(p_logo != NULL && p_logo->filename() == "img2.png");
+  CHECK(index.contentId("<img1@example.com>") == index.filename("img1.png"));
+  CHECK(index.contentId("img2@example.com") == NULL);
+  vector<const cMimeBody*> images;
+  CHECK(index.mediaType("IMAGE/png", images) == 3);
+  CHECK(index.mediaType("multipart/related", images) == 1);
+  CHECK(images.back() == &loaded);
+
+  loaded.clear();
+  CHECK(loaded.partIndex().size() == 0);
+}
+
+/* Base64 as RFC 2045 has it, lines of 76 characters */
+static string base64Reference (const string& p_data, bool p_linebreak) {
+  static const char* s_table = 
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string text;
+  for (size_t i = 0; i < p_data.size(); i += 3) {
+    unsigned group = (unsigned char)p_data[i] << 16;
+    if (i + 1 < p_data.size())
+      group |= (unsigned char)p_data[i+1] << 8;
+    if (i + 2 < p_data.size())
+      group |= (unsigned char)p_data[i+2];
+    text += s_table[group >> 18];
+    text += s_table[(group >> 12) & 0x3f];
+    text += i + 1 < p_data.size() ? s_table[(group >> 6) & 0x3f] : '=';
+    text += i + 2 < p_data.size() ? s_table[group & 0x3f] : '=';
+  }
+  if (!p_linebreak)
+    return text;
+  string lines;
+  for (size_t i = 0; i < text.size(); i += 76)
+    lines += text.substr(i, 76) + "\r\n";
+  return lines;
+}
+
+/* Every vector level encodes base64 exactly like the reference */
+static void testBase64Encode () {
+  string data;
+  for (int i = 0; i < 1200; i++)
+    data += (char)(i * 7919 >> 3);
+  int best = cMimeSimd::supported();
+  for (int level = cMimeSimd::LEVEL_SCALAR; level <= best; level++) {
+    cMimeEnvironment::simdLevel(level);
+    for (size_t size = 0; size <= data.size(); 
+        size += size < 300 ? 1 : 149) {
+      for (int linebreak = 0; linebreak < 2; linebreak++) {
+        cMimeCodeBase64 coder;
+        coder.addLineBreak(linebreak != 0);
+        coder.setInput(data.data(), size, true);
+        string output(coder.getOutputLength(), 0);
+        output.resize(coder.getOutput((unsigned char*)&output[0], 
+          output.size()));
+        if (output != base64Reference(data.substr(0, size), linebreak)) {
+          cerr << "base64 level " << level << " size " << size << endl;
+          CHECK(false);
+        }
+      }
+    }
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+}
+
+static string base64Decode (const string& p_text, ssize_t* p_error) {
+  cMimeCodeBase64 coder;
+  coder.setInput(p_text.data(), p_text.size(), false);
+  string output(coder.getOutputLength(), 0);
+  output.resize(coder.getOutput((unsigned char*)&output[0], output.size()));
+  *p_error = coder.errorOffset();
+  return output;
+}
+
+/* Every vector level decodes like the scalar code and finds the same 
+ * errors
+ */
+static void testBase64Decode () {
+  string data;
+  for (int i = 0; i < 3000; i++)
+    data += (char)(i * 7919 >> 3);
+  int best = cMimeSimd::supported();
+  for (int level = cMimeSimd::LEVEL_SCALAR; level <= best; level++) {
+    cMimeEnvironment::simdLevel(level);
+    ssize_t error;
+    for (size_t size = 0; size <= data.size(); 
+        size += size < 200 ? 1 : 331) {
+      string text = base64Reference(data.substr(0, size), true);
+      for (size_t i = 17; i < text.size(); i += 41)
+        text.insert(i, i % 2 ? " " : "\t");
+      if (base64Decode(text, &error) != data.substr(0, size) || 
+          error != -1) {
+        cerr << "base64 level " << level << " size " << size << endl;
+        CHECK(false);
+      }
+    }
+
+    string text = base64Reference(data, false);
+    for (int ch = 0; ch < 256; ch++) {
+      string bad = text;
+      bad[100] = (char)ch;
+      string output = base64Decode(bad, &error);
+      bool valid = isalnum(ch) || ch == '+' || ch == '/' || ch == ' ' ||
+        ch == '\t' || ch == '\r' || ch == '\n';
+      CHECK(error == (valid ? -1 : 100));
+      if (!valid)
+        CHECK(output == data.substr(0, 75));
+    }
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+
+  ssize_t error;
+  CHECK(base64Decode("+/+/", &error) == "\xfb\xff\xbf" && error == -1);
+  CHECK(base64Decode("QUI=\r\n", &error) == "AB" && error == -1);
+  CHECK(base64Decode("QQ= =\r\n", &error) == "A" && error == -1);
+  CHECK(base64Decode("QQ", &error) == "A" && error == -1);
+  CHECK(base64Decode("QQ=", &error) == "A" && error == 3);
+  CHECK(base64Decode("QUI==", &error) == "AB" && error == 4);
+  CHECK(base64Decode("QUJD=", &error) == "ABC" && error == 4);
+  CHECK(base64Decode("QUJDR", &error) == "ABC" && error == 5);
+  CHECK(base64Decode("QQ==QUJD", &error) == "A" && error == 4);
+}
+
+static string qpCode (const string& p_data, bool p_encoding) {
+  cMimeCodeQP coder;
+  coder.setInput(p_data.data(), p_data.size(), p_encoding);
+  string output(coder.getOutputLength(), 0);
+  output.resize(coder.getOutput((unsigned char*)&output[0], output.size()));
+  return output;
+}
+
+/* Quoted-printable output has the exact predicted length, no line over 76
+ * characters or ending in white space, decodes back, and is the same at
+ * every vector level
+ */
+static void testQPEncode () {
+  string data;
+  for (int i = 0; i < 5000; i++) {
+    int kind = (i * 7919 >> 4) % 23;
+    data += kind == 0 ? "\r\n" : kind == 1 ? " " : kind == 2 ? "=" : 
+      kind == 3 ? "\xe9" : kind == 4 ? "\t\r\n" : kind == 5 ? "\r\n.\r\n" :
+      string(kind * 3, (char)('a' + kind));
+  }
+  string expect;
+  int best = cMimeSimd::supported();
+  for (int level = cMimeSimd::LEVEL_SCALAR; level <= best; level++) {
+    cMimeEnvironment::simdLevel(level);
+    for (size_t size = 0; size <= data.size(); 
+        size += size < 300 ? 1 : 977) {
+      string input = data.substr(0, size);
+      cMimeCodeQP coder;
+      coder.setInput(input.data(), input.size(), true);
+      string text(coder.getOutputLength() + 10, 0);
+      text.resize(coder.getOutput((unsigned char*)&text[0], text.size()));
+      CHECK(text.size() == coder.getOutputLength());
+      CHECK(qpCode(text, false) == input);
+
+      size_t start = 0;
+      for (size_t end; start < text.size(); start = end + 2) {
+        end = text.find("\r\n", start);
+        if (end == string::npos) { end = text.size(); }
+        CHECK(end - start <= 76);
+        if (end > start)
+          CHECK(text[end-1] != ' ' && text[end-1] != '\t');
+      }
+      CHECK(text.find("\r\n.\r\n") == string::npos);
+    }
+    string text = qpCode(data, true);
+    if (level == cMimeSimd::LEVEL_SCALAR)
+      expect = text;
+    CHECK(text == expect);
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+
+  CHECK(qpCode("a=b \r\n.\r\nc\t", true) == "a=3Db=20\r\n=2E\r\nc=09");
+  string line = string(70, 'x') + " yyyyyyyy";
+  CHECK(qpCode(line, true) == string(70, 'x') + " =\r\nyyyyyyyy");
+  CHECK(qpCode(string(80, 'z'), true) == 
+    string(75, 'z') + "=\r\n" + string(5, 'z'));
+}
+
+/* Lenient quoted-printable as found in real mail */
+static void testQPDecode () {
+  CHECK(qpCode("a=3db=3D=e9", false) == "a=b=\xe9");
+  CHECK(qpCode("soft=\nbreak=  \r\nhere=", false) == "softbreakhere");
+  CHECK(qpCode("trailing \t\r\nspace  \nkept=20\r\n", false) == 
+    "trailing\r\nspace\nkept \r\n");
+  CHECK(qpCode("a=zz=4=\rb", false) == "a=zz=4=\rb");
+
+  string text;
+  for (int i = 0; i < 3000; i++)
+    text += i % 17 == 0 ? "=\r\n" : i % 13 == 0 ? " \n" : i % 7 == 0 ? 
+      "=4a" : i % 5 == 0 ? "=\n" : string(i % 11, (char)('a' + i % 26));
+  string expect = qpCode(text, false);
+  for (int level = cMimeSimd::LEVEL_SCALAR; 
+      level <= cMimeSimd::supported(); level++) {
+    cMimeEnvironment::simdLevel(level);
+    CHECK(qpCode(text, false) == expect);
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+  CHECK(expect.find('=') == string::npos && expect.find(' ') == string::npos);
+}
+
+static string wholeCode (cMimeCodeBase& p_coder, const string& p_data, 
+    bool p_encoding) {
+  p_coder.setInput(p_data.data(), p_data.size(), p_encoding);
+  string output(p_coder.getOutputLength(), 0);
+  output.resize(p_coder.getOutput((unsigned char*)&output[0], output.size()));
+  return output;
+}
+
+static string streamCode (cMimeCodeBase& p_coder, const string& p_data, 
+    bool p_encoding, size_t p_chunk) {
+  string output, buffer;
+  p_coder.begin(p_encoding);
+  for (size_t i = 0; i < p_data.size() + p_chunk; i += p_chunk) {
+    if (i < p_data.size()) {
+      p_coder.update(p_data.data() + i, min(p_chunk, p_data.size() - i));
+    } else {
+      p_coder.finish();
+    }
+    buffer.resize(p_coder.getOutputLength());
+    buffer.resize(p_coder.getOutput((unsigned char*)&buffer[0], 
+      buffer.size()));
+    output += buffer;
+  }
+  return output;
+}
+
+/* Coding a stream in chunks of any size gives what coding it whole does */
+static void testStreaming () {
+  string text;
+  for (int i = 0; i < 1500; i++) {
+    int kind = (i * 7919 >> 3) % 19;
+    text += kind == 0 ? "\r\n" : kind == 1 ? " " : kind == 2 ? "=" : 
+      kind == 3 ? "\xe9\xa0" : kind == 4 ? " \r\n" : kind == 5 ? 
+      "\r\n.\r\n" : kind == 6 ? "?_" : string(kind * 2, (char)('a' + kind));
+  }
+  string long_lines;
+  for (int i = 0; i < 300; i++)
+    long_lines += string(i % 13 * 9, 'x') + (i % 5 ? " " : "\r\n");
+
+  size_t chunks[] = { 1, 2, 3, 7, 64, 1000, 100000 };
+  for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+    size_t chunk = chunks[c];
+    cMimeCodeBase64 base64;
+    string encoded = wholeCode(base64, text, true);
+    CHECK(streamCode(base64, text, true, chunk) == encoded);
+    CHECK(streamCode(base64, encoded, false, chunk) == text);
+    CHECK(base64.errorOffset() == -1);
+    base64.addLineBreak(false);
+    CHECK(streamCode(base64, text, true, chunk) == wholeCode(base64, text, 
+      true));
+    streamCode(base64, encoded.substr(0, 500) + "!", false, chunk);
+    CHECK(base64.errorOffset() == 500);
+
+    cMimeCodeQP qp;
+    encoded = wholeCode(qp, text, true);
+    CHECK(streamCode(qp, text, true, chunk) == encoded);
+    CHECK(streamCode(qp, encoded, false, chunk) == text);
+    CHECK(streamCode(qp, "a=\nb  \r\nc=4", false, chunk) == "ab\r\nc=4");
+    qp.quoteLineBreak(true);
+    CHECK(streamCode(qp, text, true, chunk) == wholeCode(qp, text, true));
+
+    cMimeCode7bit fold;
+    CHECK(streamCode(fold, long_lines, true, chunk) == 
+      wholeCode(fold, long_lines, true));
+
+    for (int coding = 0; coding < 2; coding++) {
+      cMimeEncodedWord word;
+      word.encoding(coding ? 'Q' : 'B', "iso-8859-1");
+      string words = wholeCode(word, text.substr(0, 700), true);
+      CHECK(streamCode(word, text.substr(0, 700), true, chunk) == words);
+      words = "plain " + words + " \r\n =?utf-8?q?a_b?= tail =";
+      CHECK(streamCode(word, words, false, chunk) == 
+        wholeCode(word, words, false));
+    }
+  }
+}
+
+/* Large base64 bodies coded in segments on several threads come out the
+ * same as coded serially
+ */
+static void testParallelBase64 () {
+  string data;
+  for (unsigned i = 0; i < (3u << 20) + 1000; i++)
+    data += (char)((i * 7919u) >> 5);
+  cMimeEnvironment::codingThreads(4);
+  cMimeCodeBase64 base64;
+  for (int linebreak = 0; linebreak < 2; linebreak++) {
+    base64.addLineBreak(linebreak != 0);
+    cMimeEnvironment::parallelThreshold(0);
+    string serial = wholeCode(base64, data, true);
+    cMimeEnvironment::parallelThreshold(1 << 20);
+    CHECK(wholeCode(base64, data, true) == serial);
+
+    string text = serial;
+    for (size_t i = 3; i < text.size(); i += 1000003)
+      text.insert(i, "\t ");
+    CHECK(wholeCode(base64, text, false) == data);
+    CHECK(base64.errorOffset() == -1);
+
+    // the segments are 1MB, so include both sides of the first boundaries
+    size_t bad[] = { 100, text.size() / 2 + 1, text.size() - 10, 
+      (1 << 20) - 1, 1 << 20, (2 << 20) - 1 };
+    for (int i = 0; i < 6; i++) {
+      string broken = text;
+      broken[bad[i]] = '*';
+      string output = wholeCode(base64, broken, false);
+      ssize_t error = base64.errorOffset();
+      cMimeEnvironment::parallelThreshold(0);
+      CHECK(wholeCode(base64, broken, false) == output);
+      CHECK(base64.errorOffset() == error && error == (ssize_t)bad[i]);
+      cMimeEnvironment::parallelThreshold(1 << 20);
+    }
+  }
+  cMimeEnvironment::parallelThreshold(4 << 20);
+  cMimeEnvironment::codingThreads(0);
+
+  size_t values;
+  for (int level = cMimeSimd::LEVEL_SCALAR; 
+      level <= cMimeSimd::supported(); level++) {
+    cMimeEnvironment::simdLevel(level);
+    string text = "QUJD \r\n" + string(100, 'x') + "\tQQ==";
+    CHECK(cMimeSimd::base64Scan((const unsigned char*)text.data(), 
+      text.size(), &values) == text.size() - 2 && values == 106);
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+}
+
+/* Long lines fold at white space and unfold back to one line, fields fold
+ * after their delimeters when auto folding is on
+ */
+static void testFolding () {
+  string text;
+  for (int i = 0; i < 2000; i++)
+    text += i % 9 == 8 ? ' ' : (char)('a' + i % 26);
+  text += "\r\n" + string(200, 'x') + "\r\nshort line\r\n";
+
+  cMimeCode7bit coder;
+  string folded = wholeCode(coder, text, true);
+  CHECK(streamCode(coder, text, true, 7) == folded);
+  size_t line = 0, longest = 0, breaks = 0;
+  for (size_t i = 0; i < folded.size(); i++) {
+    if (folded[i] == '\n') {
+      longest = line > longest ? line : longest;
+      line = 0;
+      breaks++;
+    } else if (folded[i] != '\r') {
+      line++;
+    }
+  }
+  CHECK(longest == 200 && breaks > 2000 / 76 + 3);
+  string joined = folded;
+  for (size_t pos; (pos = joined.find("\r\n ")) != string::npos; )
+    joined.erase(pos, 2);
+  CHECK(joined == text);
+
+  cMimeField field;
+  const char* loaded = "Subject: one\r\n two\r\n\t  three\r\n";
+  CHECK(field.load(loaded, strlen(loaded)) > 0);
+  CHECK(string(field.value()) == "one two three");
+
+  string list;
+  for (int i = 0; i < 12; i++)
+    list += string(i > 0 ? ", " : "") + "User Number <user@example.com>";
+  cMimeEnvironment::autoFolding(true);
+  field.name("To");
+  field.value(list.c_str());
+  string stored(field.getLength(), '\0');
+  stored.resize(field.store(&stored[0], stored.size()));
+  cMimeEnvironment::autoFolding(false);
+  CHECK(stored.find("\r\n ") != string::npos);
+  for (size_t pos = 0, end; (end = stored.find("\r\n", pos)) != 
+      string::npos; pos = end + 2)
+    CHECK(end - pos <= 78);
+  CHECK(field.load(stored.data(), stored.size()) > 0);
+  CHECK(string(field.value()) == list);
+}
+
+/* Non-ASCII words go out as encoded-words no longer than a line, which
+ * decode back to the field value
+ */
+static void testFieldEncoding () {
+  const char* values[][2] = {
+    { "Subject", "Gr\xc3\xbc\xc3\x9f" "e aus M\xc3\xbcnchen, and a subject "
+      "that runs on well past the end of a single header line" },
+    { "From", "Zo\xc3\xab \xc3\x85ngstr\xc3\xb6m <zoe@example.com>, "
+      "plain <p@example.com>" },
+    { "To", "\"J\xc3\xb6hn D\xc3\xb6" "e\" <john@example.com>" },
+  };
+  const char* decoded[] = { values[0][1], values[1][1], 
+    "J\xc3\xb6hn D\xc3\xb6" "e <john@example.com>" };
+
+  cMimeEnvironment::globalCharset("UTF-8");
+  cMimeEnvironment::autoFolding(true);
+  for (int i = 0; i < 3; i++) {
+    cMimeField field;
+    field.name(values[i][0]);
+    field.value(values[i][1]);
+    string stored(field.getLength(), '\0');
+    stored.resize(field.store(&stored[0], stored.size()));
+    CHECK(stored.size() == field.getLength());
+    for (size_t pos = 0, end; (end = stored.find("\r\n", pos)) != 
+        string::npos; pos = end + 2)
+      CHECK(end - pos <= 76);
+    for (size_t pos = 0; pos < stored.size(); pos++)
+      CHECK(!(stored[pos] & 0x80));
+
+    CHECK(field.load(stored.data(), stored.size()) > 0);
+    cMimeEncodedWord coder;
+    CHECK(wholeCode(coder, field.value(), false) == decoded[i]);
+  }
+  cMimeEnvironment::autoFolding(false);
+  cMimeEnvironment::globalCharset("");
+}
+
+/* The character class kernels agree with cMimeChar at every level, for
+ * each byte value in each position of a vector
+ */
+static void testCharClasses () {
+  string data;
+  for (int i = 0; i < 4096; i++)
+    data += (char)(i * 7919 >> 3);
+  const unsigned char* p_data = (const unsigned char*) data.data();
+  for (int level = cMimeSimd::LEVEL_SCALAR; 
+      level <= cMimeSimd::supported(); level++) {
+    cMimeEnvironment::simdLevel(level);
+    size_t nonascii = 0;
+    for (size_t i = 0; i < data.size(); i++)
+      nonascii += cMimeChar::isNonAscii(p_data[i]);
+    CHECK(cMimeSimd::nonAsciiCount(p_data, data.size()) == nonascii);
+
+    for (int ch = 0; ch < 256; ch++) {
+      string word(100, 'a');
+      word[ch % 70] = (char)ch;
+      size_t run = cMimeSimd::delimiterRun(
+        (const unsigned char*) word.data(), word.size());
+      CHECK(run == (cMimeChar::isDelimiter(ch) ? ch % 70 : word.size()));
+    }
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+}
+
+/* Payloads get the encoding that codes them smallest, with its exact size,
+ * and the scan finds the same at each level
+ */
+static void testAutoEncoding () {
+  string text;
+  for (int i = 0; i < 300; i++)
+    text += "A line of plain text, short enough for 7bit.\r\n";
+  string latin = text;
+  for (size_t i = 7; i < latin.size(); i += 46)
+    latin[i] = (char)0xe9;
+  string binary;
+  for (int i = 0; i < 5000; i++)
+    binary += (char)(i * 7919 >> 3);
+  string longline = text + string(1200, 'x') + "\r\n";
+
+  struct { const string* data; bool allow8bit; const char* encoding; } 
+  cases[] = {
+    { &text, false, "7bit" },
+    { &latin, false, "quoted-printable" },
+    { &latin, true, "8bit" },
+    { &binary, true, "base64" },
+    { &longline, true, "quoted-printable" },
+  };
+  for (int i = 0; i < 5; i++) {
+    const string& data = *cases[i].data;
+    cMimeAutoEncoding choice((const unsigned char*) data.data(), 
+      data.size(), cases[i].allow8bit);
+    CHECK(!strcmp(choice.encoding(), cases[i].encoding));
+    cMimeCodeBase* coder = cMimeEnvironment::registerCoder(choice.encoding());
+    CHECK(wholeCode(*coder, data, true).size() == choice.encodedLength());
+    delete coder;
+  }
+
+  string mixed = binary + "\r\n" + latin + "\r" + text + "\n\n";
+  const unsigned char* p_mixed = (const unsigned char*) mixed.data();
+  cMimeSimd::textStats expect;
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_SCALAR);
+  cMimeSimd::textScan(p_mixed, mixed.size(), &expect);
+  for (int level = cMimeSimd::LEVEL_SSSE3; 
+      level <= cMimeSimd::supported(); level++) {
+    cMimeEnvironment::simdLevel(level);
+    for (size_t offset = 0; offset < 70; offset += 23) {
+      cMimeSimd::textStats stats, scalar;
+      cMimeSimd::textScan(p_mixed + offset, mixed.size() - offset, &stats);
+      cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_SCALAR);
+      cMimeSimd::textScan(p_mixed + offset, mixed.size() - offset, &scalar);
+      cMimeEnvironment::simdLevel(level);
+      CHECK(!memcmp(&stats, &scalar, sizeof(stats)));
+    }
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+  size_t nonascii = 0;
+  for (size_t i = 0; i < mixed.size(); i++)
+    nonascii += (unsigned char)mixed[i] >> 7;
+  CHECK(expect.nonascii == nonascii && expect.nul > 0);
+  CHECK(expect.barebreaks >= 3 && expect.maxline >= 1000);
+}
+
+/* Binary and 8bit parts are referenced from the loaded buffer and stored
+ * as segments without copying */
+static void testPassthrough () {
+  string binary;
+  for (int i = 0; i < 5000; i++)
+    binary += (char)(i * 7919 >> 3);
+  cMimeMessage mail;
+  mail.subject("passthrough");
+  mail.contentType("multipart/mixed");
+  mail.boundary("passthrough-boundary");
+  cMimeBody* p_bp = mail.createPart();
+  p_bp->contentType("text/plain");
+  p_bp->transferEncoding("8bit");
+  p_bp->payload("caf\xc3\xa9\r\n");
+  p_bp = mail.createPart();
+  p_bp->contentType("application/octet-stream");
+  p_bp->transferEncoding("binary");
+  p_bp->payload(binary.data(), binary.size());
+  p_bp = mail.createPart();
+  p_bp->transferEncoding("base64");
+  p_bp->payload(binary.data(), binary.size());
+
+  size_t msize = mail.getLength();
+  shared_ptr<string> source = make_shared<string>(msize, 0);
+  source->resize(mail.store(&(*source)[0], msize));
+
+  cMimeMessage loaded;
+  CHECK(loaded.load(source->data(), source->size(), source) > 0);
+  CHECK(loaded.partCount() == 3);
+  cMimeBody::cPartIterator it = loaded.partsBegin();
+  ++it;
+  const char* p_content = (const char*)(*it)->content();
+  CHECK(p_content > source->data() && 
+    p_content < source->data() + source->size());
+  CHECK(!memcmp(p_content, binary.data(), binary.size()));
+  ++it;
+  p_content = (const char*)(*it)->content();
+  CHECK(p_content < source->data() || 
+    p_content >= source->data() + source->size());
+
+  string stored(loaded.getLength(), 0);
+  stored.resize(loaded.store(&stored[0], stored.size()));
+  cMimeSegments segments;
+  CHECK(loaded.storeSegments(segments) == (ssize_t)stored.size());
+  CHECK(segments.size() == stored.size());
+  string joined;
+  for (size_t i = 0; i < segments.count(); i++)
+    joined.append((const char*)segments.data(i), segments.size(i));
+  CHECK(joined == stored);
+
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  string piped;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    _exit(segments.write(fds[1]) ? 0 : 1);
+  }
+  close(fds[1]);
+  char buff[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buff, sizeof(buff))) > 0)
+    piped.append(buff, n);
+  close(fds[0]);
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid && status == 0);
+  CHECK(piped == stored);
+}
+
+/* Text in any charset comes out as UTF-8, the vector kernels agree with
+ * the scalar ones
+ */
+static void testCharsets () {
+  struct { const char* charset; const char* text; const char* utf8; } 
+  cases[] = {
+    { "us-ascii", "plain", "plain" },
+    { "UTF-8", "caf\xc3\xa9 \xf0\x9f\x93\xa7", "caf\xc3\xa9 \xf0\x9f\x93\xa7" },
+    { "utf-8", "a\xc0\x80" "b\xed\xa0\x80" "c\xf4\x90\x80\x80" "d\xe2\x82",
+      "a\xef\xbf\xbd\xef\xbf\xbd" "b\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd" 
+      "c\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd" "d\xef\xbf\xbd" },
+    { "ISO-8859-1", "caf\xe9 \xff", "caf\xc3\xa9 \xc3\xbf" },
+    { "iso_8859-2", "\xa1\xb3", "\xc4\x84\xc5\x82" },
+    { "cp1252", "\x80 \x93x\x94", "\xe2\x82\xac \xe2\x80\x9cx\xe2\x80\x9d" },
+    { "windows-1251", "\xcf\xf0\xe8", "\xd0\x9f\xd1\x80\xd0\xb8" },
+    { "Shift_JIS", "\x93\xfa\x96\x7b", "\xe6\x97\xa5\xe6\x9c\xac" },
+    { "ISO-2022-JP", "\x1b$BF|K\\\x1b(B!", "\xe6\x97\xa5\xe6\x9c\xac!" },
+    { "gb2312", "\xd6\xd0\xce\xc4", "\xe4\xb8\xad\xe6\x96\x87" },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    cMimeCodeCharset converter(cases[i].charset);
+    CHECK(converter.supported());
+    CHECK(wholeCode(converter, cases[i].text, false) == cases[i].utf8);
+    for (size_t chunk = 1; chunk < 4; chunk++)
+      CHECK(streamCode(converter, cases[i].text, false, chunk) == 
+        cases[i].utf8);
+  }
+  cMimeCodeCharset unknown("x-unknown");
+  CHECK(!unknown.supported());
+  CHECK(wholeCode(unknown, "caf\xc3\xa9", false) == "caf\xc3\xa9");
+
+  cMimeEncodedWord word;
+  word.utf8Output();
+  CHECK(wholeCode(word, "=?iso-8859-1?q?caf=E9?= =?koi8-r?b?8NLJ9w==?= !", 
+    false) == "caf\xc3\xa9\xd0\x9f\xd1\x80\xd0\xb8\xd0\x92 !");
+
+  cMimeMessage mail;
+  mail.contentType("text/plain; charset=iso-8859-15");
+  mail.payload("\xa4 5");
+  string text;
+  CHECK(mail.utf8Payload(text) == 5 && text == "\xe2\x82\xac 5");
+
+  // valid and invalid UTF-8 and Latin-1 around the vector block edges
+  string mixed;
+  const char* pieces[] = { "abcdefgh", "\xc3\xa9", "\xe2\x82\xac", 
+    "\xf0\x9f\x93\xa7", "\xc3", "\x80", "\xed\xa0\x80", "\xf8", " " };
+  for (int i = 0; i < 3000; i++)
+    mixed += pieces[(i * 7919 >> 4) % (i < 2000 ? 4 : 9)];
+  const unsigned char* p_mixed = (const unsigned char*) mixed.data();
+  string expect(mixed.size() * 2, 0), widened(mixed.size() * 2, 0);
+  for (int level = cMimeSimd::LEVEL_SSSE3; 
+      level <= cMimeSimd::supported(); level++) {
+    for (size_t offset = 0; offset < 300; offset += 37) {
+      const unsigned char* p_data = p_mixed + offset;
+      size_t size = mixed.size() - offset;
+      cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_SCALAR);
+      size_t run = cMimeSimd::utf8Run(p_data, size);
+      size_t ascii = cMimeSimd::asciiRun(p_data, size);
+      size_t expectsize = cMimeSimd::latin1ToUtf8(p_data, size, 
+        (unsigned char*)&expect[0]);
+      cMimeEnvironment::simdLevel(level);
+      CHECK(cMimeSimd::utf8Run(p_data, size) == run);
+      CHECK(cMimeSimd::asciiRun(p_data, size) == ascii);
+      CHECK(cMimeSimd::latin1ToUtf8(p_data, size, 
+        (unsigned char*)&widened[0]) == expectsize);
+      CHECK(!memcmp(widened.data(), expect.data(), expectsize));
+    }
+  }
+  cMimeEnvironment::simdLevel(cMimeSimd::LEVEL_AVX512);
+  CHECK(cMimeSimd::utf8Run(p_mixed, mixed.size()) > 8000);
+}
+
+/* Encoded-words are read within the input only, adjacent ones join */
+static void testEncodedWords () {
+  struct { const char* value; const char* text; } cases[] = {
+    { "plain value", "plain value" },
+    { "=?utf-8?q?a_b=3F?= c", "a b? c" },
+    { "=?UTF-8?B?w6k=?=  \r\n =?utf-8?b?w6k=?= x", "\xc3\xa9\xc3\xa9 x" },
+    { "=?utf-8?q?a?= =?bad", "a =?bad" },
+    { "a =?utf-8?x?b?= =?", "a =?utf-8?x?b?= =?" },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    cMimeEncodedWord word;
+    CHECK(wholeCode(word, cases[i].value, false) == cases[i].text);
+    for (size_t chunk = 1; chunk < 5; chunk++)
+      CHECK(streamCode(word, cases[i].value, false, chunk) == cases[i].text);
+  }
+
+  // nothing is read past the end of the input
+  string value("=?utf-8?q?ab?=cd");
+  cMimeEncodedWord word;
+  word.setInput(value.data(), 11, false);
+  string text(word.getOutputLength(), 0);
+  text.resize(word.getOutput((unsigned char*)&text[0], text.size()));
+  CHECK(text == "a");
+
+  // a character split between two words
+  word.utf8Output();
+  value = "=?utf-8?q?caf=C3?= =?UTF-8?Q?=A9?= =?iso-8859-1?q?=E9?=";
+  CHECK(wholeCode(word, value, false) == "caf\xc3\xa9\xc3\xa9");
+  for (size_t chunk = 1; chunk < 5; chunk++)
+    CHECK(streamCode(word, value, false, chunk) == "caf\xc3\xa9\xc3\xa9");
+
+  string buffer;
+  const char* p_text;
+  value = "no words here";
+  CHECK(cMimeEncodedWord::decodeValue(value.data(), value.data() + 
+    value.size(), buffer, &p_text) == value.size());
+  CHECK(p_text == value.data() && buffer.empty());
+  value = "=?utf-8?q?caf=C3=A9?=";
+  CHECK(cMimeEncodedWord::decodeValue(value.data(), value.data() + 
+    value.size(), buffer, &p_text, true) == 5);
+  CHECK(p_text == buffer.data() && buffer == "caf\xc3\xa9");
+}
+
+/* A coder that swaps letter case, registered the way applications add
+ * their own
+ */
+class cSwapCaseCoder : public cMimeCodeBase {
+  DECLARE_MIMECODER(cSwapCaseCoder)
+
+  protected:
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const {
+      size_t size = m_inputsize < p_maxsize ? m_inputsize : p_maxsize;
+      for (size_t i = 0; i < size; i++)
+        p_output[i] = isalpha(m_input[i]) ? m_input[i] ^ 0x20 : m_input[i];
+      return size;
+    }
+    virtual ssize_t decode (unsigned char* p_output, size_t p_maxsize) {
+      return encode(p_output, p_maxsize);
+    }
+};
+
+class cSwapCaseField : public cFieldCodeBase {
+  DECLARE_FIELDCODER(cSwapCaseField)
+
+  protected:
+    virtual ssize_t encode (unsigned char* p_output, size_t p_maxsize) const {
+      size_t size = m_inputsize < p_maxsize ? m_inputsize : p_maxsize;
+      for (size_t i = 0; i < size; i++)
+        p_output[i] = isalpha(m_input[i]) ? m_input[i] ^ 0x20 : m_input[i];
+      return size;
+    }
+};
+
+/* Built-in coders run without a factory, registered ones still replace
+ * them and add new encodings and fields
+ */
+static void testCoderDispatch () {
+  CHECK(cMimeEnvironment::coderKind("base64") == 
+    cMimeEnvironment::CODER_BASE64);
+  CHECK(cMimeEnvironment::coderKind("quoted-printable") == 
+    cMimeEnvironment::CODER_QP);
+  CHECK(cMimeEnvironment::coderKind("binary") == 
+    cMimeEnvironment::CODER_COPY);
+  CHECK(cMimeEnvironment::fieldCoderKind("Subject") == 
+    cMimeEnvironment::FIELD_CODER_TEXT);
+  CHECK(cMimeEnvironment::fieldCoderKind("X-Unknown") == 
+    cMimeEnvironment::FIELD_CODER_BASE);
+
+  const char* encodings[] = { "base64", "quoted-printable", "x-swapcase" };
+  REGISTER_MIMECODER("x-swapcase", cSwapCaseCoder);
+  CHECK(cMimeEnvironment::coderKind("x-swapcase") == 
+    cMimeEnvironment::CODER_CUSTOM);
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < 3; i++) {
+      cMimeMessage body;
+      body.transferEncoding(encodings[i]);
+      body.payload("Caf\xc3\xa9 Menu\r\n");
+      string stored(body.getLength(), 0);
+      stored.resize(body.store(&stored[0], stored.size()));
+      CHECK(stored.size() == body.getLength());
+      CHECK((stored.find("cAF") != string::npos) == (round == 1 || i == 2));
+
+      cMimeMessage loaded;
+      CHECK(loaded.load(stored.data(), stored.size()) > 0);
+      CHECK(loaded.contentLength() == 12 && 
+        !memcmp(loaded.content(), "Caf\xc3\xa9 Menu\r\n", 12));
+    }
+    // a registered coder replaces a built-in one
+    REGISTER_MIMECODER("base64", cSwapCaseCoder);
+    REGISTER_MIMECODER("quoted-printable", cSwapCaseCoder);
+  }
+  REGISTER_MIMECODER("base64", cMimeCodeBase64);
+  REGISTER_MIMECODER("quoted-printable", cMimeCodeQP);
+  DEREGISTER_MIMECODER("x-swapcase");
+  CHECK(cMimeEnvironment::coderKind("base64") == 
+    cMimeEnvironment::CODER_BASE64);
+
+  REGISTER_FIELDCODER("X-Swapcase", cSwapCaseField);
+  CHECK(cMimeEnvironment::fieldCoderKind("X-Swapcase") == 
+    cMimeEnvironment::FIELD_CODER_CUSTOM);
+  cMimeField field;
+  field.name("X-Swapcase");
+  field.value("Mixed Case");
+  string stored(field.getLength(), 0);
+  stored.resize(field.store(&stored[0], stored.size()));
+  CHECK(stored == "X-Swapcase: mIXED cASE\r\n");
+  DEREGISTER_FIELDCODER("X-Swapcase");
+}
+
+/* Registered names match without case and are kept as copies, the
+ * string a name came in may change or go
+ */
+static void testRegistry () {
+  CHECK(cMimeEnvironment::coderKind("BASE64") == 
+    cMimeEnvironment::CODER_BASE64);
+  CHECK(cMimeEnvironment::coderKind("Quoted-Printable") == 
+    cMimeEnvironment::CODER_QP);
+  CHECK(!cMimeEnvironment::passthrough("Base64"));
+  CHECK(cMimeEnvironment::passthrough("BINARY"));
+  CHECK(cMimeEnvironment::fieldCoderKind("SUBJECT") == 
+    cMimeEnvironment::FIELD_CODER_TEXT);
+  CHECK(cMimeEnvironment::fieldCoderKind("content-type") == 
+    cMimeEnvironment::FIELD_CODER_PARAMETER);
+
+  string name("X-SwapCase");
+  REGISTER_MIMECODER(name.c_str(), cSwapCaseCoder);
+  name = "reused, and long enough to need a new buffer";
+  CHECK(cMimeEnvironment::coderKind("X-SWAPCASE") == 
+    cMimeEnvironment::CODER_CUSTOM);
+  cMimeCodeBase* coder = cMimeEnvironment::registerCoder("x-SwapCase");
+  CHECK(dynamic_cast<cSwapCaseCoder*>(coder) != NULL);
+  delete coder;
+  DEREGISTER_MIMECODER("X-SWAPCASE");
+  CHECK(cMimeEnvironment::passthrough("x-swapcase"));
+}
+
+/* Messages stored by their own contexts on several threads at once come
+ * out as each context says, and leave the global context alone
+ */
+static void testContexts () {
+  cMimeContext folding(cMimeEnvironment::context());
+  folding.autoFolding(true);
+  folding.registerCoder("x-swapcase", cSwapCaseCoder::createObject);
+  const cMimeContext& global = cMimeEnvironment::context();
+  CHECK(!global.autoFolding() && global.passthrough("x-swapcase"));
+
+  string line;
+  for (int i = 0; i < 40; i++)
+    line += "word ";
+  cMimeMessage mail;
+  mail.subject("contexts");
+  cMimeBody* p_bp = mail.createPart();
+  p_bp->transferEncoding("7bit");
+  p_bp->payload((line + "\r\n").c_str());
+  p_bp = mail.createPart();
+  p_bp->transferEncoding("x-swapcase");
+  p_bp->payload("Swap\r\n");
+  mail.contentType("multipart/mixed");
+  mail.boundary("context-boundary");
+
+  string plain(mail.getLength(), 0);
+  plain.resize(mail.store(&plain[0], plain.size()));
+  string folded(mail.getLength(folding), 0);
+  folded.resize(mail.store(&folded[0], folded.size(), folding));
+  CHECK(plain.find(line) != string::npos && plain.find("Swap") != 
+    string::npos);
+  CHECK(folded.find(line) == string::npos && folded.find("sWAP") != 
+    string::npos);
+  {
+    cMimeContext::scope use(folding);
+    CHECK(cMimeEnvironment::autoFolding());
+    {
+      cMimeContext::scope inner(global);
+      CHECK(!cMimeEnvironment::autoFolding());
+    }
+    CHECK(cMimeEnvironment::coderKind("x-swapcase") == 
+      cMimeEnvironment::CODER_CUSTOM);
+  }
+  CHECK(cMimeEnvironment::passthrough("x-swapcase"));
+
+  // only a snapshot may be read by several threads
+  shared_ptr<const cMimeMessage> snapshot = mail.freeze();
+  vector<string> stored(8);
+  vector<thread> threads;
+  for (size_t i = 0; i < stored.size(); i++) {
+    threads.push_back(thread([&, i] () {
+      const cMimeContext& context = i % 2 ? folding : global;
+      for (int round = 0; round < 50; round++) {
+        string out(snapshot->getLength(context), 0);
+        out.resize(snapshot->store(&out[0], out.size(), context));
+        cMimeMessage loaded;
+        if (loaded.load(out.data(), out.size(), context) > 0)
+          stored[i] = out;
+      }
+    }));
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  for (size_t i = 0; i < stored.size(); i++)
+    CHECK(stored[i] == (i % 2 ? folded : plain));
+}
+
 int main (void) {
   cMimeMessage mail;
 
@@ -33,5 +1300,31 @@ int main (void) {
   cout << mbuff << endl;
   delete mbuff;
 
-  return 0;
+  testContentType();
+  testParameters();
+  testAdoption();
+  testLargeSizes();
+  testMemoryUsage();
+  testSpill();
+  testFreeze();
+  testTemplate();
+  testPartIndex();
+  testBase64Encode();
+  testBase64Decode();
+  testQPEncode();
+  testQPDecode();
+  testStreaming();
+  testParallelBase64();
+  testFolding();
+  testFieldEncoding();
+  testCharClasses();
+  testAutoEncoding();
+  testPassthrough();
+  testCharsets();
+  testEncodedWords();
+  testCoderDispatch();
+  testRegistry();
+  testContexts();
+
+  return s_failures != 0;
 }